@@ -0,0 +1,128 @@
+/*
+    Activity indicator.
+
+    The shift paths only increment counters: OpenOCD's adapter queue executions are counted by a
+    link time wrapper of jtag_execute_queue(). A low priority FreeRTOS timer samples the counters
+    every ACTIVITY_PERIOD_MS and blinks the LED, updates the ESP-BOX widget and the metrics. No pin
+    is written from the shift loops.
+*/
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "activity.h"
+#include "server_shim.h"
+#include "metrics.h"
+#include "ui.h"
+
+static const char *TAG = "activity";
+
+static uint32_t s_queue_runs;
+
+static struct {
+    uint32_t queue_runs;
+    uint32_t packets;
+    bool active;
+    bool led_on;
+    int64_t active_us;
+    /* rates of the last sampling period */
+    uint32_t queue_runs_rate;
+    uint32_t packets_rate;
+} s_act;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+int __real_jtag_execute_queue(void);
+
+int __wrap_jtag_execute_queue(void)
+{
+    /* the only cost on the adapter path, the timer does the rest */
+    s_queue_runs++;
+    return __real_jtag_execute_queue();
+}
+
+uint32_t activity_queue_runs(void)
+{
+    return __atomic_load_n(&s_queue_runs, __ATOMIC_RELAXED);
+}
+
+static void activity_sample(TimerHandle_t timer)
+{
+    struct server_shim_stats stats;
+
+    server_shim_get_stats(&stats);
+    uint32_t queue_runs = activity_queue_runs();
+    uint32_t packets = stats.rx_packets + stats.tx_packets;
+
+    portENTER_CRITICAL(&s_lock);
+    s_act.queue_runs_rate = (queue_runs - s_act.queue_runs) * 1000 / CONFIG_ACTIVITY_PERIOD_MS;
+    s_act.packets_rate = (packets - s_act.packets) * 1000 / CONFIG_ACTIVITY_PERIOD_MS;
+    bool active = queue_runs != s_act.queue_runs || packets != s_act.packets;
+    bool changed = active != s_act.active;
+    s_act.queue_runs = queue_runs;
+    s_act.packets = packets;
+    s_act.active = active;
+    if (active) {
+        s_act.active_us += CONFIG_ACTIVITY_PERIOD_MS * 1000;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+#if CONFIG_ACTIVITY_LED_GPIO >= 0
+    /* blinks while there is traffic, off otherwise */
+    s_act.led_on = active && !s_act.led_on;
+    gpio_set_level(CONFIG_ACTIVITY_LED_GPIO, s_act.led_on);
+#endif
+
+    if (changed) {
+        ui_update_activity(active);
+    }
+}
+
+static void activity_metrics(cJSON *obj)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool active = s_act.active;
+    uint32_t queue_runs = s_act.queue_runs;
+    uint32_t queue_runs_rate = s_act.queue_runs_rate;
+    uint32_t packets_rate = s_act.packets_rate;
+    int64_t active_us = s_act.active_us;
+    portEXIT_CRITICAL(&s_lock);
+
+    cJSON_AddNumberToObject(obj, "ledGpio", CONFIG_ACTIVITY_LED_GPIO);
+    cJSON_AddBoolToObject(obj, "active", active);
+    cJSON_AddNumberToObject(obj, "activeMs", active_us / 1000);
+    cJSON_AddNumberToObject(obj, "adapterQueueRuns", queue_runs);
+    cJSON_AddNumberToObject(obj, "adapterQueueRunsPerSec", queue_runs_rate);
+    cJSON_AddNumberToObject(obj, "packetsPerSec", packets_rate);
+}
+
+esp_err_t activity_start(void)
+{
+#if CONFIG_ACTIVITY_LED_GPIO >= 0
+    gpio_config_t led_conf = {
+        .pin_bit_mask = BIT64(CONFIG_ACTIVITY_LED_GPIO),
+        .mode = GPIO_MODE_OUTPUT,
+    };
+    if (gpio_config(&led_conf) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure the led gpio (%d)", CONFIG_ACTIVITY_LED_GPIO);
+        return ESP_FAIL;
+    }
+    gpio_set_level(CONFIG_ACTIVITY_LED_GPIO, 0);
+#endif
+
+    /* runs in the timer service task, which has a low priority */
+    TimerHandle_t timer = xTimerCreate("activity", pdMS_TO_TICKS(CONFIG_ACTIVITY_PERIOD_MS), pdTRUE, NULL,
+                                       activity_sample);
+    if (!timer || xTimerStart(timer, 0) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start the sampling timer!");
+        return ESP_FAIL;
+    }
+
+    metrics_register("activity", activity_metrics);
+
+    return ESP_OK;
+}
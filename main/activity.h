@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/* Samples the adapter and server activity counters to drive the activity LED and the ESP-BOX widget */
+esp_err_t activity_start(void);
+#if CONFIG_ACTIVITY_ENABLE
+/* Number of OpenOCD adapter queue executions so far (wraps), counted even before activity_start() */
+uint32_t activity_queue_runs(void);
+#else
+static inline uint32_t activity_queue_runs(void)
+{
+    return 0;
+}
+#endif
@@ -0,0 +1,282 @@
+/*
+    TCK speed discovery and margining.
+
+    `esp_gpio_autotune` is a Tcl command defined in OpenOCD at start. It checks the chain at the
+    lowest speed to get a reference, then binary-searches the adapter speed. A speed passes when,
+    AUTOTUNE_ITERATIONS times in a row:
+    - the chain is examined again and the IDCODEs match the expected ones (jtag arp_init)
+    - with every TAP in BYPASS, test patterns come back like at the reference speed
+    - optionally, a pattern written to target RAM is read back unchanged
+
+    The highest passing speed minus AUTOTUNE_MARGIN_PERCENT is applied and every target is examined
+    again at that speed. Whatever the outcome, the RAM pattern is restored at the lowest speed first;
+    a failed search leaves the lowest speed applied.
+
+    The speed is saved in NVS for the target config and applied on the next starts. When the command
+    is run from the web page, it runs in a task of its own and the page polls for the result. When it
+    is run from telnet, tcl or gdb, the watcher task sees the run counter of the command move and
+    saves its result. It only asks while a remote client is connected, nobody else can run it.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "autotune.h"
+#include "openocd_rpc.h"
+#include "server_shim.h"
+#include "storage.h"
+#include "types.h"
+
+/* search takes a few seconds per step at low speeds */
+#define AUTOTUNE_RPC_TIMEOUT_MS     60000
+#define AUTOTUNE_TASK_STACK_SIZE    4096
+#define AUTOTUNE_TASK_PRIO          (tskIDLE_PRIORITY + 2)
+#define AUTOTUNE_WATCH_PERIOD_MS    2000
+#define AUTOTUNE_WATCH_STACK_SIZE   3072
+#define AUTOTUNE_WATCH_PRIO         (tskIDLE_PRIORITY + 1)
+
+#define AUTOTUNE_STR2(x)            #x
+#define AUTOTUNE_STR(x)             AUTOTUNE_STR2(x)
+
+static const char *TAG = "autotune";
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static autotune_state_t s_state;
+static struct autotune_result s_result;
+static uint32_t s_mem_addr;
+static uint32_t s_saved_runs;           /* value of esp_gpio_autotune_runs whose result is saved */
+
+static const char *s_tcl_script =
+    "proc esp_gpio_autotune_check {mem_addr} {\n"
+    "    if {[catch {jtag arp_init}]} { return fail }\n"
+    "    set taps [jtag names]\n"
+    "    foreach tap $taps { irscan $tap 0xffffffff }\n"
+    "    set sig {}\n"
+    "    foreach pattern {0x55555555 0xaaaaaaaa 0x0f0f0f0f 0xdeadbeef} {\n"
+    "        lappend sig [drscan [lindex $taps 0] 32 $pattern]\n"
+    "    }\n"
+    "    if {$mem_addr != 0} {\n"
+    "        set pattern {0x55aa55aa 0xaa55aa55 0x00ff00ff 0xff00ff00 0x01234567 0x89abcdef 0xffffffff 0x00000000}\n"
+    "        if {[catch {write_memory $mem_addr 32 $pattern; read_memory $mem_addr 32 [llength $pattern]} data]} { return fail }\n"
+    "        foreach a $pattern b $data { if {$a != $b} { return fail } }\n"
+    "    }\n"
+    "    return $sig\n"
+    "}\n"
+    "proc esp_gpio_autotune_pass {khz mem_addr ref} {\n"
+    "    adapter speed $khz\n"
+    "    for {set i 0} {$i < " AUTOTUNE_STR(CONFIG_AUTOTUNE_ITERATIONS) "} {incr i} {\n"
+    "        if {[esp_gpio_autotune_check $mem_addr] ne $ref} { return 0 }\n"
+    "    }\n"
+    "    return 1\n"
+    "}\n"
+    "proc esp_gpio_autotune_search {mem_addr min max} {\n"
+    "    set ref [esp_gpio_autotune_check $mem_addr]\n"
+    "    if {$ref eq {fail}} { error \"chain doesn't work at $min kHz\" }\n"
+    "    if {[esp_gpio_autotune_pass $max $mem_addr $ref]} { return $max }\n"
+    "    set lo $min\n"
+    "    set hi $max\n"
+    "    while {$hi - $lo > $lo / 20} {\n"
+    "        set mid [expr {($lo + $hi) / 2}]\n"
+    "        if {[esp_gpio_autotune_pass $mid $mem_addr $ref]} { set lo $mid } else { set hi $mid }\n"
+    "    }\n"
+    "    return $lo\n"
+    "}\n"
+    "set esp_gpio_autotune_runs 0\n"
+    "set esp_gpio_autotune_last {}\n"
+    "proc esp_gpio_autotune {{mem_addr 0}} {\n"
+    "    if {[transport select] ne {jtag}} { error {esp_gpio_autotune needs the jtag transport} }\n"
+    "    set min " AUTOTUNE_STR(CONFIG_AUTOTUNE_MIN_KHZ) "\n"
+    "    set max " AUTOTUNE_STR(CONFIG_AUTOTUNE_MAX_KHZ) "\n"
+    "    if {$mem_addr != 0 && [[target current] curstate] ne {halted}} { error {target must be halted for the memory check} }\n"
+    "    adapter speed $min\n"
+    "    if {$mem_addr != 0} { set saved [read_memory $mem_addr 32 8] }\n"
+    "    set failed [catch {esp_gpio_autotune_search $mem_addr $min $max} best]\n"
+    "    adapter speed $min\n"
+    "    catch {jtag arp_init}\n"
+    "    if {$mem_addr != 0 && [catch {write_memory $mem_addr 32 $saved} msg] && !$failed} {\n"
+    "        set failed 1\n"
+    "        set best \"memory at $mem_addr couldn't be restored: $msg\"\n"
+    "    }\n"
+    "    set tuned $min\n"
+    "    if {!$failed} {\n"
+    "        set tuned [expr {$best * (100 - " AUTOTUNE_STR(CONFIG_AUTOTUNE_MARGIN_PERCENT) ") / 100}]\n"
+    "        if {$tuned < $min} { set tuned $min }\n"
+    "    }\n"
+    "    adapter speed $tuned\n"
+    "    catch {jtag arp_init}\n"
+    "    foreach t [target names] { catch {$t arp_examine} }\n"
+    "    if {$failed} { error $best }\n"
+    "    set ::esp_gpio_autotune_last \"$best $tuned\"\n"
+    "    incr ::esp_gpio_autotune_runs\n"
+    "    return \"$best $tuned\"\n"
+    "}\n";
+
+const char *autotune_tcl_script(void)
+{
+    return s_tcl_script;
+}
+
+/* NVS keys are limited to 15 characters, config file names are hashed */
+static void autotune_key(const char *config_file, char *key, size_t len)
+{
+    uint32_t hash = 5381;
+
+    for (const char *p = config_file; *p; p++) {
+        hash = hash * 33 + (uint8_t)*p;
+    }
+    snprintf(key, len, OOCD_TCK_SPEED_KEY_PREFIX "%08" PRIx32, hash);
+}
+
+/* `runs` is the run counter of the Tcl command, a result seen by both paths is saved once */
+static esp_err_t autotune_save(uint32_t runs, const struct autotune_result *result)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool saved = runs == s_saved_runs;
+    s_saved_runs = runs;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (saved) {
+        return ESP_OK;
+    }
+
+    char key[16];
+    autotune_key(g_app_params.config_file, key, sizeof(key));
+    esp_err_t err = storage_write(key, (const char *)&result->tuned_khz, sizeof(result->tuned_khz));
+
+    ESP_LOGI(TAG, "%s: reliable up to %" PRIu32 " kHz, %" PRIu32 " kHz saved", g_app_params.config_file,
+             result->best_khz, result->tuned_khz);
+
+    return err;
+}
+
+esp_err_t autotune_run(uint32_t mem_addr, struct autotune_result *result)
+{
+    char cmd[96];
+    char resp[128];
+    unsigned best, tuned, runs;
+
+    snprintf(cmd, sizeof(cmd), "concat [esp_gpio_autotune 0x%08" PRIx32 "] $::esp_gpio_autotune_runs", mem_addr);
+
+    esp_err_t err = openocd_rpc_exec(cmd, resp, sizeof(resp), AUTOTUNE_RPC_TIMEOUT_MS);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "autotune failed (%s)", err == ESP_FAIL ? resp : esp_err_to_name(err));
+        return err;
+    }
+    if (sscanf(resp, "%u %u %u", &best, &tuned, &runs) != 3) {
+        ESP_LOGE(TAG, "unexpected response (%s)", resp);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    result->best_khz = best;
+    result->tuned_khz = tuned;
+
+    return autotune_save(runs, result);
+}
+
+static void autotune_task(void *arg)
+{
+    struct autotune_result result = { 0 };
+
+    esp_err_t err = autotune_run(s_mem_addr, &result);
+
+    portENTER_CRITICAL(&s_lock);
+    s_result = result;
+    s_state = err == ESP_OK ? AUTOTUNE_DONE : AUTOTUNE_FAILED;
+    portEXIT_CRITICAL(&s_lock);
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t autotune_start(uint32_t mem_addr)
+{
+    portENTER_CRITICAL(&s_lock);
+    bool running = s_state == AUTOTUNE_RUNNING;
+    if (!running) {
+        s_state = AUTOTUNE_RUNNING;
+        s_mem_addr = mem_addr;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xTaskCreate(autotune_task, "autotune", AUTOTUNE_TASK_STACK_SIZE, NULL, AUTOTUNE_TASK_PRIO,
+                    NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create autotune task!");
+        portENTER_CRITICAL(&s_lock);
+        s_state = AUTOTUNE_FAILED;
+        portEXIT_CRITICAL(&s_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+static void autotune_watch_task(void *arg)
+{
+    char resp[64];
+    unsigned runs, best, tuned;
+
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(AUTOTUNE_WATCH_PERIOD_MS));
+
+        /* esp_gpio_autotune can only be run by a remote client or by the web page */
+        if (!server_shim_has_remote_clients()) {
+            continue;
+        }
+        if (openocd_rpc_exec("concat $::esp_gpio_autotune_runs $::esp_gpio_autotune_last", resp, sizeof(resp),
+                             OPENOCD_RPC_TIMEOUT_MS) != ESP_OK) {
+            /* OpenOCD isn't serving tcl yet or is busy with a command, try again later */
+            continue;
+        }
+        if (sscanf(resp, "%u %u %u", &runs, &best, &tuned) == 3) {
+            struct autotune_result result = {
+                .best_khz = best,
+                .tuned_khz = tuned,
+            };
+            autotune_save(runs, &result);
+        }
+    }
+}
+
+esp_err_t autotune_watch_start(void)
+{
+    if (xTaskCreate(autotune_watch_task, "autotune_watch", AUTOTUNE_WATCH_STACK_SIZE, NULL, AUTOTUNE_WATCH_PRIO,
+                    NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create autotune watch task!");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+autotune_state_t autotune_status(struct autotune_result *result)
+{
+    portENTER_CRITICAL(&s_lock);
+    autotune_state_t state = s_state;
+    *result = s_result;
+    portEXIT_CRITICAL(&s_lock);
+
+    return state;
+}
+
+const char *autotune_speed_command(const char *config_file)
+{
+    static char command[32];
+    uint32_t khz = 0;
+    char key[16];
+
+    autotune_key(config_file, key, sizeof(key));
+    if (!storage_is_key_exist(key) || storage_read(key, (char *)&khz, sizeof(khz)) != ESP_OK || !khz) {
+        return NULL;
+    }
+
+    snprintf(command, sizeof(command), "adapter speed %" PRIu32, khz);
+    return command;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct autotune_result {
+    uint32_t best_khz;          /* highest speed which passed every check */
+    uint32_t tuned_khz;         /* best_khz minus the margin, saved and applied */
+};
+
+typedef enum {
+    AUTOTUNE_IDLE,
+    AUTOTUNE_RUNNING,
+    AUTOTUNE_DONE,
+    AUTOTUNE_FAILED,
+} autotune_state_t;
+
+/* Definition of the `esp_gpio_autotune` Tcl command, passed to OpenOCD with -c */
+const char *autotune_tcl_script(void);
+
+/*
+ * Runs `esp_gpio_autotune` in OpenOCD and saves the tuned speed for the current target config.
+ * `mem_addr` is a RAM address for the read-back check (0 to skip it), the target must be halted.
+ */
+esp_err_t autotune_run(uint32_t mem_addr, struct autotune_result *result);
+
+/* Runs autotune_run() in a task of its own, ESP_ERR_INVALID_STATE while a run is in progress */
+esp_err_t autotune_start(uint32_t mem_addr);
+
+/* State of the run started by autotune_start(), `result` is filled when it is AUTOTUNE_DONE */
+autotune_state_t autotune_status(struct autotune_result *result);
+
+/*
+ * Saves the result of `esp_gpio_autotune` runs made from telnet, tcl or gdb (monitor). Polls OpenOCD
+ * while a remote client is connected.
+ */
+esp_err_t autotune_watch_start(void);
+
+/* "adapter speed <khz>" command if a speed was saved for `config_file`, NULL otherwise */
+const char *autotune_speed_command(const char *config_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,227 @@
+/*
+    JTAG chain scan. Bit-bangs TCK/TMS/TDI through the GPIO registers to read the IDCODEs of the
+    chain before OpenOCD is launched. The registers are written directly through the LL layer,
+    gpio_set_level() argument checks would cost more than the cycle itself.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include "soc/gpio_struct.h"
+
+#include "jtag.h"
+
+static const char *TAG = "jtag";
+
+static struct jtag_pins s_pins;
+static bool s_initialized;
+
+static inline int jtag_bit_get(const uint8_t *buf, size_t i)
+{
+    return (buf[i / 8] >> (i % 8)) & 1;
+}
+
+static inline void jtag_bit_set(uint8_t *buf, size_t i, int value)
+{
+    if (value) {
+        buf[i / 8] |= 1 << (i % 8);
+    } else {
+        buf[i / 8] &= ~(1 << (i % 8));
+    }
+}
+
+static inline void jtag_write(int tck, int tms, int tdi)
+{
+    gpio_ll_set_level(&GPIO, s_pins.tms, tms);
+    gpio_ll_set_level(&GPIO, s_pins.tdi, tdi);
+    gpio_ll_set_level(&GPIO, s_pins.tck, tck);
+}
+
+/* clocks `bits` cycles with the TMS values of `tms`, LSB first, TDI is held low */
+static void jtag_clock_tms(uint8_t tms, size_t bits)
+{
+    for (size_t i = 0; i < bits; i++) {
+        int bit = (tms >> i) & 1;
+        jtag_write(0, bit, 0);
+        jtag_write(1, bit, 0);
+    }
+    jtag_write(0, (tms >> (bits - 1)) & 1, 0);
+}
+
+/* clocks `bits` cycles with TMS low, except the last one which leaves the shift state */
+static void jtag_shift(const uint8_t *tdi, uint8_t *tdo, size_t bits)
+{
+    int tms = 0;
+
+    for (size_t i = 0; i < bits; i++) {
+        int bit = jtag_bit_get(tdi, i);
+        if (i == bits - 1) {
+            tms = 1;
+        }
+        jtag_write(0, tms, bit);
+        /* TDO is driven by the target on the previous falling edge */
+        jtag_bit_set(tdo, i, gpio_ll_get_level(&GPIO, s_pins.tdo));
+        jtag_write(1, tms, bit);
+    }
+    jtag_write(0, tms, 0);
+}
+
+/* takes the last `esp_gpio_jtag_nums` of a Tcl text, commented out commands are skipped */
+static bool jtag_parse_pin_command(const char *text, struct jtag_pins *pins)
+{
+    static const char command[] = "esp_gpio_jtag_nums";
+    bool found = false;
+
+    for (const char *p = text; (p = strstr(p, command)); p += sizeof(command) - 1) {
+        const char *start = p;
+        while (start > text && start[-1] != '\n' && start[-1] != ';') {
+            start--;
+        }
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        int tck, tms, tdi, tdo;
+        if (*start != '#' && sscanf(p + sizeof(command) - 1, "%d %d %d %d", &tck, &tms, &tdi, &tdo) == 4) {
+            pins->tck = tck;
+            pins->tms = tms;
+            pins->tdi = tdi;
+            pins->tdo = tdo;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void jtag_openocd_pins(const char *command_arg, struct jtag_pins *pins)
+{
+    const char *source = "menuconfig";
+    char line[128];
+
+    *pins = (struct jtag_pins)JTAG_DEFAULT_PINS();
+
+    FILE *f = fopen(JTAG_OPENOCD_INTERFACE_CFG, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (jtag_parse_pin_command(line, pins)) {
+                source = JTAG_OPENOCD_INTERFACE_CFG;
+            }
+        }
+        fclose(f);
+    }
+    if (command_arg && jtag_parse_pin_command(command_arg, pins)) {
+        source = "command line";
+    }
+    ESP_LOGD(TAG, "pins from %s", source);
+}
+
+esp_err_t jtag_init(const struct jtag_pins *pins)
+{
+    if (s_initialized) {
+        jtag_deinit();
+    }
+
+    if (!GPIO_IS_VALID_OUTPUT_GPIO(pins->tck) || !GPIO_IS_VALID_OUTPUT_GPIO(pins->tms) ||
+            !GPIO_IS_VALID_OUTPUT_GPIO(pins->tdi) || !GPIO_IS_VALID_GPIO(pins->tdo)) {
+        ESP_LOGE(TAG, "Invalid pins tck(%d) tms(%d) tdi(%d) tdo(%d)", pins->tck, pins->tms, pins->tdi, pins->tdo);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    gpio_config_t out_conf = {
+        .pin_bit_mask = BIT64(pins->tck) | BIT64(pins->tms) | BIT64(pins->tdi),
+        .mode = GPIO_MODE_OUTPUT,
+    };
+    gpio_config_t in_conf = {
+        .pin_bit_mask = BIT64(pins->tdo),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+    };
+    if (gpio_config(&out_conf) != ESP_OK || gpio_config(&in_conf) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure the pins");
+        return ESP_FAIL;
+    }
+
+    s_pins = *pins;
+    s_initialized = true;
+    jtag_write(0, 1, 0);
+
+    ESP_LOGI(TAG, "tck(%d) tms(%d) tdi(%d) tdo(%d)", pins->tck, pins->tms, pins->tdi, pins->tdo);
+
+    return ESP_OK;
+}
+
+void jtag_deinit(void)
+{
+    if (!s_initialized) {
+        return;
+    }
+
+    /* leave the pins to OpenOCD in their reset state */
+    gpio_reset_pin(s_pins.tck);
+    gpio_reset_pin(s_pins.tms);
+    gpio_reset_pin(s_pins.tdi);
+    gpio_reset_pin(s_pins.tdo);
+    s_initialized = false;
+}
+
+esp_err_t jtag_read_idcodes(uint32_t *idcodes, size_t max, size_t *count)
+{
+    size_t bits = (max + 1) * 32;
+    uint8_t tdi[(JTAG_MAX_TAPS + 1) * 4];
+    uint8_t tdo[(JTAG_MAX_TAPS + 1) * 4];
+
+    if (max > JTAG_MAX_TAPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!s_initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    /* after a reset every TAP has IDCODE (32 bits, bit 0 set) or BYPASS (one 0 bit) in DR */
+    memset(tdi, 0xff, sizeof(tdi));
+    jtag_clock_tms(0x1f, 5);            /* RESET */
+    jtag_clock_tms(0x02, 4);            /* IDLE, DRSELECT, DRCAPTURE, DRSHIFT */
+    /* the last bit is shifted while leaving to DREXIT1 */
+    jtag_shift(tdi, tdo, bits);
+    jtag_clock_tms(0x01, 2);            /* DRUPDATE, IDLE */
+
+    size_t n = 0;
+    size_t pos = 0;
+    bool end = false;
+    bool any_id = false;
+    while (pos + 32 <= bits) {
+        if (!jtag_bit_get(tdo, pos)) {
+            if (n == max) {
+                break;
+            }
+            idcodes[n++] = 0;
+            pos++;
+            continue;
+        }
+        uint32_t id = 0;
+        for (size_t i = 0; i < 32; i++) {
+            id |= (uint32_t)jtag_bit_get(tdo, pos + i) << i;
+        }
+        if (id == 0xffffffff) {
+            /* the ones shifted in, end of the chain */
+            end = true;
+            break;
+        }
+        if (n == max) {
+            break;
+        }
+        idcodes[n++] = id;
+        any_id = true;
+        pos += 32;
+    }
+    *count = n;
+
+    /* TDO stuck high gives no TAP at all, stuck low only BYPASS TAPs */
+    if (n == 0 || !any_id) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return end ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
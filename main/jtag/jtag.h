@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * JTAG chain scan of the application. It bit-bangs the same pins as OpenOCD's esp_gpio driver,
+ * so it must only be used while OpenOCD isn't running (e.g. before it is launched).
+ */
+
+struct jtag_pins {
+    int tck;
+    int tms;
+    int tdi;
+    int tdo;
+};
+
+#define JTAG_DEFAULT_PINS() {                   \
+    .tck = CONFIG_JTAG_GPIO_TCK,                \
+    .tms = CONFIG_JTAG_GPIO_TMS,                \
+    .tdi = CONFIG_JTAG_GPIO_TDI,                \
+    .tdo = CONFIG_JTAG_GPIO_TDO,                \
+}
+
+/* interface config OpenOCD is launched with, OPENOCD_SCRIPTS is the storage partition */
+#define JTAG_OPENOCD_INTERFACE_CFG      "/data/interface/esp_gpio_jtag.cfg"
+
+/*
+ * Pins OpenOCD's esp_gpio driver will drive: the last `esp_gpio_jtag_nums` of the interface config,
+ * overridden by one in `command_arg` (the -c command run after it). JTAG_DEFAULT_PINS() if neither
+ * sets them.
+ */
+void jtag_openocd_pins(const char *command_arg, struct jtag_pins *pins);
+
+/* Takes the pins, jtag_deinit() leaves them to OpenOCD in their reset state */
+esp_err_t jtag_init(const struct jtag_pins *pins);
+void jtag_deinit(void);
+
+#define JTAG_MAX_TAPS       8
+
+/*
+ * Chain enumeration. IDCODEs are read after a TAP reset, a TAP without IDCODE register is
+ * reported as 0. ESP_ERR_NOT_FOUND if TDO is stuck (nothing connected), ESP_ERR_INVALID_SIZE
+ * if there are more than `max` TAPs.
+ */
+esp_err_t jtag_read_idcodes(uint32_t *idcodes, size_t max, size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
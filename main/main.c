@@ -1,7 +1,10 @@
 #include "sdkconfig.h"
 
+#include <stdlib.h>
 #include <unistd.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_event.h"
@@ -14,6 +17,13 @@
 #include "storage.h"
 #include "network.h"
 #include "web_server.h"
+#include "net_selftest.h"
+#include "server_shim.h"
+#include "pm_governor.h"
+#include "autotune.h"
+#include "activity.h"
+#include "poll_sched.h"
+#include "target_detect.h"
 #include "ui.h"
 #include "openocd.h"
 
@@ -29,10 +39,19 @@
 #define vfs_dev_uart_use_driver esp_vfs_dev_uart_use_driver
 #endif
 
+#if CONFIG_FREERTOS_UNICORE
+#define OPENOCD_TASK_CORE   0
+#else
+#define OPENOCD_TASK_CORE   CONFIG_OPENOCD_TASK_CORE
+#endif
+
 static const char *TAG = "main";
 
 app_params_t g_app_params;
 
+/* config_file when it was read from the storage, freed if the target detection replaces it */
+static char *s_stored_config_file;
+
 static void init_console(void)
 {
     /* Drain stdout before reconfiguring it */
@@ -85,6 +104,7 @@ static bool is_espressif_target(const char *cfg_file)
 
 void run_openocd(void)
 {
+    server_loop_attach();
     setenv("OPENOCD_SCRIPTS", "/data", 1);
     const char *argv[20] = {
         "openocd",
@@ -93,6 +113,13 @@ void run_openocd(void)
     /* Constant OpenOCD parameters takes 3 index */
     int argc = 3;
 
+    argv[argc++] = "-c";
+    argv[argc++] = autotune_tcl_script();
+#if CONFIG_SERVER_STEP_ENABLE
+    argv[argc++] = "-c";
+    argv[argc++] = server_step_tcl_script();
+#endif
+
     char iface[32] = {0};
     sprintf(iface, "interface/esp_gpio_%s.cfg", g_app_params.interface == 0 ? "jtag" : "swd");
     argv[argc++] = "-f";
@@ -117,6 +144,13 @@ void run_openocd(void)
     argv[argc++] = "-f";
     argv[argc++] = config;
 
+    /* tuned speed overrides the one set by the target config */
+    const char *speed_command = autotune_speed_command(g_app_params.config_file);
+    if (speed_command && g_app_params.interface == 0) {
+        argv[argc++] = "-c";
+        argv[argc++] = speed_command;
+    }
+
     char debug_level[8] = {0};
     sprintf(debug_level, "-d%c", g_app_params.debug_level);
     argv[argc++] = debug_level;
@@ -135,6 +169,7 @@ void load_openocd_params(void)
         g_app_params.config_file = CONFIG_OPENOCD_TARGET_CONFIG_FILE;
     } else {
         g_app_params.config_file = read_param;
+        s_stored_config_file = read_param;
     }
 
     err = storage_read(OOCD_INTERFACE_KEY, &g_app_params.interface, 1);
@@ -254,6 +289,25 @@ void load_network_params(void)
     ESP_LOGI(TAG, "wifi pass (%s)", g_app_params.wifi_pass);
 }
 
+static void openocd_task(void *arg)
+{
+    run_openocd();
+    xTaskNotifyGive((TaskHandle_t)arg);
+    vTaskDelete(NULL);
+}
+
+/* OpenOCD runs in its own task, pinned away from the Wi-Fi core. Returns when OpenOCD exits */
+static void run_openocd_task(void)
+{
+    if (xTaskCreatePinnedToCore(openocd_task, "openocd", CONFIG_OPENOCD_TASK_STACK_SIZE,
+                                xTaskGetCurrentTaskHandle(), CONFIG_OPENOCD_TASK_PRIO, NULL,
+                                OPENOCD_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create OpenOCD task!");
+        return;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
 void init_idf_components(void)
 {
     ESP_LOGI(TAG, "Setting up...");
@@ -267,6 +321,7 @@ void init_idf_components(void)
 void app_main(void)
 {
     init_idf_components();
+    server_shim_init();
     ui_init();
     load_openocd_params();
     load_network_params();
@@ -277,6 +332,24 @@ void app_main(void)
     }
     storage_update_rtos_struct();
 
+#if CONFIG_TARGET_DETECT_ENABLE
+    if (g_app_params.interface == 0) {
+        const char *detected = target_detect_config(g_app_params.config_file);
+        if (detected != g_app_params.config_file) {
+            bool was_espressif = is_espressif_target(g_app_params.config_file);
+            g_app_params.config_file = detected;
+            free(s_stored_config_file);
+            s_stored_config_file = NULL;
+            /* the default extra command depends on the kind of target */
+            if (!storage_is_key_exist(OOCD_CMD_LINE_ARGS_KEY) && was_espressif != is_espressif_target(detected)) {
+                g_app_params.command_arg = was_espressif ? CONFIG_OPENOCD_CUSTOM_COMMAND : "";
+            }
+            /* selects it in the target list */
+            storage_update_target_struct();
+        }
+    }
+#endif
+
 #if CONFIG_UI_ENABLE
     if (g_app_params.mode == APP_MODE_AP) {
         g_app_params.net_adapter_name = "wifiprov";
@@ -293,6 +366,12 @@ void app_main(void)
         goto _wait;
     }
 
+#if CONFIG_NET_SELFTEST_ENABLE
+    if (net_selftest_start(http_handle) != ESP_OK) {
+        ESP_LOGW(TAG, "Network self-test service couldn't be started");
+    }
+#endif
+
     struct network_init_config config = {
         .adapter_name = g_app_params.net_adapter_name,
         .ssid = g_app_params.wifi_ssid,
@@ -315,8 +394,30 @@ void app_main(void)
         network_get_my_ip(g_app_params.my_ip);
         ui_update_ip_info(g_app_params.my_ip);
 
+#if CONFIG_PM_GOVERNOR_ENABLE
+        if (pm_governor_start() != ESP_OK) {
+            ESP_LOGW(TAG, "Power governor couldn't be started");
+        }
+#endif
+
+#if CONFIG_ACTIVITY_ENABLE
+        if (activity_start() != ESP_OK) {
+            ESP_LOGW(TAG, "Activity indicator couldn't be started");
+        }
+#endif
+
+#if CONFIG_POLL_SCHED_ENABLE
+        if (poll_sched_start() != ESP_OK) {
+            ESP_LOGW(TAG, "Poll scheduler couldn't be started");
+        }
+#endif
+
+        if (g_app_params.interface == 0 && autotune_watch_start() != ESP_OK) {
+            ESP_LOGW(TAG, "Autotune watcher couldn't be started");
+        }
+
         ui_show_info_screen("OpenOCD has been launched.");
-        run_openocd();
+        run_openocd_task();
     } else {
         ui_show_info_screen("Network connection can not be establised. Please check your wifi credentials!");
         goto _wait;
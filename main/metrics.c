@@ -0,0 +1,80 @@
+/*
+    Runtime counters of the modules, reported by the "/metrics" endpoint of the web server.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "metrics.h"
+
+static const char *TAG = "metrics";
+
+struct metrics_node {
+    struct metrics_node *next;
+    const char *name;
+    metrics_provider_t provider;
+};
+
+static struct metrics_node *s_head;
+static struct metrics_node **s_tail = &s_head;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t metrics_register(const char *name, metrics_provider_t provider)
+{
+    if (!name || !provider) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    /* allocated outside the critical section, freed again if the name is already registered */
+    struct metrics_node *node = calloc(1, sizeof(*node));
+    if (!node) {
+        ESP_LOGE(TAG, "No memory for the metrics provider (%s)", name);
+        return ESP_ERR_NO_MEM;
+    }
+    node->name = name;
+    node->provider = provider;
+
+    struct metrics_node *it;
+    portENTER_CRITICAL(&s_lock);
+    for (it = s_head; it; it = it->next) {
+        if (!strcmp(it->name, name)) {
+            it->provider = provider;
+            break;
+        }
+    }
+    if (!it) {
+        *s_tail = node;
+        s_tail = &node->next;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (it) {
+        free(node);
+    }
+
+    return ESP_OK;
+}
+
+char *metrics_to_json(void)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return NULL;
+    }
+
+    /* providers are only appended, so no need to hold the lock while calling them */
+    for (struct metrics_node *it = s_head; it; it = it->next) {
+        cJSON *obj = cJSON_AddObjectToObject(root, it->name);
+        if (obj) {
+            it->provider(obj);
+        }
+    }
+
+    char *json_string = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    return json_string;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "esp_err.h"
+#include <cJSON.h>
+
+/* Fills the given object with the runtime counters of a module */
+typedef void (*metrics_provider_t)(cJSON *obj);
+
+esp_err_t metrics_register(const char *name, metrics_provider_t provider);
+char *metrics_to_json(void);
@@ -0,0 +1,539 @@
+/*
+    Network self-test service. Used to qualify the Wi-Fi link of a bench before blaming the debugger.
+
+    TCP sink   (CONFIG_NET_SELFTEST_SINK_PORT)   : iperf2 client compatible, counts the received bytes
+    TCP source (CONFIG_NET_SELFTEST_SOURCE_PORT) : sends data until the client disconnects or the test time expires
+    TCP/UDP echo (CONFIG_NET_SELFTEST_ECHO_PORT) : RFC 862 echo, RTT is measured on the host side
+    TCP rtt    (CONFIG_NET_SELFTEST_RTT_PORT)    : device sends probes, client echoes them back, RTT is measured here
+
+    The ports are opened by a POST to "/selftest" and closed again CONFIG_NET_SELFTEST_OPEN_S seconds after
+    the last test, so they don't hold lwIP sockets while the debugger is used.
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+#include <cJSON.h>
+
+#include "net_selftest.h"
+#include "ui.h"
+
+#define SELFTEST_TASK_STACK_SIZE    4096
+#define SELFTEST_TASK_PRIO          (tskIDLE_PRIORITY + 2)
+#define SELFTEST_BUF_SIZE           4096
+#define SELFTEST_RTT_PROBE_SIZE     32
+#define SELFTEST_RTT_TIMEOUT_MS     1000
+#define SELFTEST_IDLE_TIMEOUT_MS    5000
+#define SELFTEST_SELECT_TIMEOUT_MS  1000
+
+static const char *TAG = "net-selftest";
+
+struct selftest_throughput {
+    uint32_t runs;
+    uint64_t bytes;
+    int64_t duration_us;
+    uint32_t kbps;
+};
+
+struct selftest_rtt {
+    uint32_t runs;
+    uint32_t samples;
+    uint32_t lost;
+    uint32_t min_us;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+};
+
+struct selftest_results {
+    struct selftest_throughput sink;
+    struct selftest_throughput source;
+    struct selftest_rtt rtt;
+    uint64_t echo_tcp_bytes;
+    uint32_t echo_udp_packets;
+};
+
+enum selftest_service {
+    SELFTEST_SINK,
+    SELFTEST_SOURCE,
+    SELFTEST_ECHO_TCP,
+    SELFTEST_RTT,
+    SELFTEST_ECHO_UDP,
+    SELFTEST_SERVICE_COUNT
+};
+
+static const uint16_t s_ports[SELFTEST_SERVICE_COUNT] = {
+    [SELFTEST_SINK] = CONFIG_NET_SELFTEST_SINK_PORT,
+    [SELFTEST_SOURCE] = CONFIG_NET_SELFTEST_SOURCE_PORT,
+    [SELFTEST_ECHO_TCP] = CONFIG_NET_SELFTEST_ECHO_PORT,
+    [SELFTEST_RTT] = CONFIG_NET_SELFTEST_RTT_PORT,
+    [SELFTEST_ECHO_UDP] = CONFIG_NET_SELFTEST_ECHO_PORT,
+};
+
+static struct selftest_results s_results;
+static SemaphoreHandle_t s_results_lock;
+static uint8_t *s_buf;
+static TaskHandle_t s_task;
+
+/* listening sockets, opened by the "/selftest" POST handler and closed by the task */
+static int s_socks[SELFTEST_SERVICE_COUNT] = { [0 ... SELFTEST_SERVICE_COUNT - 1] = -1 };
+static SemaphoreHandle_t s_socks_lock;
+static bool s_open;
+static int64_t s_close_us;
+
+static uint32_t selftest_kbps(uint64_t bytes, int64_t duration_us)
+{
+    if (duration_us <= 0) {
+        return 0;
+    }
+    return (uint32_t)((bytes * 8 * 1000) / duration_us);
+}
+
+static void selftest_update_ui(void)
+{
+    char text[96];
+
+    xSemaphoreTake(s_results_lock, portMAX_DELAY);
+    snprintf(text, sizeof(text), "rx %" PRIu32 " kbps  tx %" PRIu32 " kbps  rtt p50/p99 %" PRIu32 "/%" PRIu32 " us",
+             s_results.sink.kbps, s_results.source.kbps, s_results.rtt.p50_us, s_results.rtt.p99_us);
+    xSemaphoreGive(s_results_lock);
+
+    ui_update_selftest_info(text);
+}
+
+static void selftest_set_timeout(int sock, int optname, uint32_t timeout_ms)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(sock, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
+static void selftest_store_throughput(struct selftest_throughput *res, uint64_t bytes, int64_t duration_us)
+{
+    xSemaphoreTake(s_results_lock, portMAX_DELAY);
+    res->runs++;
+    res->bytes = bytes;
+    res->duration_us = duration_us;
+    res->kbps = selftest_kbps(bytes, duration_us);
+    xSemaphoreGive(s_results_lock);
+}
+
+static void selftest_run_sink(int sock)
+{
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+
+    selftest_set_timeout(sock, SO_RCVTIMEO, SELFTEST_IDLE_TIMEOUT_MS);
+
+    while (true) {
+        int len = recv(sock, s_buf, SELFTEST_BUF_SIZE, 0);
+        if (len <= 0) {
+            break;
+        }
+        bytes += len;
+    }
+
+    int64_t duration = esp_timer_get_time() - start;
+    selftest_store_throughput(&s_results.sink, bytes, duration);
+    ESP_LOGI(TAG, "sink: %" PRIu64 " bytes in %" PRId64 " ms (%" PRIu32 " kbps)",
+             bytes, duration / 1000, selftest_kbps(bytes, duration));
+}
+
+static void selftest_run_source(int sock)
+{
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    const int64_t end = start + (int64_t)CONFIG_NET_SELFTEST_DURATION_S * 1000000;
+
+    for (size_t i = 0; i < SELFTEST_BUF_SIZE; i++) {
+        s_buf[i] = '0' + (i % 10);
+    }
+    selftest_set_timeout(sock, SO_SNDTIMEO, SELFTEST_IDLE_TIMEOUT_MS);
+
+    while (esp_timer_get_time() < end) {
+        int len = send(sock, s_buf, SELFTEST_BUF_SIZE, 0);
+        if (len <= 0) {
+            break;
+        }
+        bytes += len;
+    }
+
+    int64_t duration = esp_timer_get_time() - start;
+    selftest_store_throughput(&s_results.source, bytes, duration);
+    ESP_LOGI(TAG, "source: %" PRIu64 " bytes in %" PRId64 " ms (%" PRIu32 " kbps)",
+             bytes, duration / 1000, selftest_kbps(bytes, duration));
+}
+
+static void selftest_run_echo_tcp(int sock)
+{
+    uint64_t bytes = 0;
+
+    selftest_set_timeout(sock, SO_RCVTIMEO, SELFTEST_IDLE_TIMEOUT_MS);
+
+    while (true) {
+        int len = recv(sock, s_buf, SELFTEST_BUF_SIZE, 0);
+        if (len <= 0 || send(sock, s_buf, len, 0) != len) {
+            break;
+        }
+        bytes += len;
+    }
+
+    xSemaphoreTake(s_results_lock, portMAX_DELAY);
+    s_results.echo_tcp_bytes += bytes;
+    xSemaphoreGive(s_results_lock);
+}
+
+static int selftest_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool selftest_recv_all(int sock, uint8_t *buf, size_t len)
+{
+    while (len) {
+        int ret = recv(sock, buf, len, 0);
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void selftest_run_rtt(int sock)
+{
+    const uint32_t count = CONFIG_NET_SELFTEST_RTT_SAMPLES;
+    uint32_t *samples = calloc(count, sizeof(*samples));
+    if (!samples) {
+        ESP_LOGE(TAG, "Could not allocate memory for the rtt samples (%" PRIu32 ")", count);
+        return;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    selftest_set_timeout(sock, SO_RCVTIMEO, SELFTEST_RTT_TIMEOUT_MS);
+
+    uint8_t probe[SELFTEST_RTT_PROBE_SIZE];
+    uint8_t reply[SELFTEST_RTT_PROBE_SIZE];
+    uint32_t n = 0, lost = 0;
+
+    for (uint32_t seq = 0; seq < count; seq++) {
+        memset(probe, 0xA5, sizeof(probe));
+        memcpy(probe, &seq, sizeof(seq));
+
+        int64_t start = esp_timer_get_time();
+        if (send(sock, probe, sizeof(probe), 0) != sizeof(probe)) {
+            break;
+        }
+        if (!selftest_recv_all(sock, reply, sizeof(reply))) {
+            /* the stream is out of sync after a timeout, no point to continue */
+            lost += count - seq;
+            break;
+        }
+        if (memcmp(probe, reply, sizeof(probe)) != 0) {
+            lost++;
+            continue;
+        }
+        samples[n++] = (uint32_t)(esp_timer_get_time() - start);
+    }
+
+    qsort(samples, n, sizeof(*samples), selftest_cmp_u32);
+
+    xSemaphoreTake(s_results_lock, portMAX_DELAY);
+    struct selftest_rtt *rtt = &s_results.rtt;
+    rtt->runs++;
+    rtt->samples = n;
+    rtt->lost = lost;
+    if (n) {
+        rtt->min_us = samples[0];
+        rtt->p50_us = samples[(n - 1) * 50 / 100];
+        rtt->p90_us = samples[(n - 1) * 90 / 100];
+        rtt->p99_us = samples[(n - 1) * 99 / 100];
+        rtt->max_us = samples[n - 1];
+    }
+    ESP_LOGI(TAG, "rtt: samples(%" PRIu32 ") lost(%" PRIu32 ") p50(%" PRIu32 "us) p90(%" PRIu32 "us) p99(%" PRIu32 "us)",
+             rtt->samples, rtt->lost, rtt->p50_us, rtt->p90_us, rtt->p99_us);
+    xSemaphoreGive(s_results_lock);
+
+    free(samples);
+}
+
+static void selftest_echo_udp(int sock)
+{
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+
+    int len = recvfrom(sock, s_buf, SELFTEST_BUF_SIZE, 0, (struct sockaddr *)&from, &from_len);
+    if (len > 0 && sendto(sock, s_buf, len, 0, (struct sockaddr *)&from, from_len) == len) {
+        xSemaphoreTake(s_results_lock, portMAX_DELAY);
+        s_results.echo_udp_packets++;
+        xSemaphoreGive(s_results_lock);
+    }
+}
+
+static int selftest_open_socket(enum selftest_service service)
+{
+    int type = service == SELFTEST_ECHO_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    int sock = socket(AF_INET, type, 0);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Failed to create socket (%d)", errno);
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(s_ports[service]),
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Failed to bind port %d (%d)", s_ports[service], errno);
+        close(sock);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(sock, 1) != 0) {
+        ESP_LOGE(TAG, "Failed to listen port %d (%d)", s_ports[service], errno);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* called with s_socks_lock held, false if none of the ports could be opened */
+static bool selftest_open_sockets(void)
+{
+    bool opened = false;
+
+    for (int i = 0; i < SELFTEST_SERVICE_COUNT; i++) {
+        s_socks[i] = selftest_open_socket(i);
+        opened |= s_socks[i] >= 0;
+    }
+    return opened;
+}
+
+static void selftest_close_sockets(void)
+{
+    for (int i = 0; i < SELFTEST_SERVICE_COUNT; i++) {
+        if (s_socks[i] >= 0) {
+            close(s_socks[i]);
+            s_socks[i] = -1;
+        }
+    }
+}
+
+static void selftest_keep_open(void)
+{
+    xSemaphoreTake(s_socks_lock, portMAX_DELAY);
+    s_close_us = esp_timer_get_time() + (int64_t)CONFIG_NET_SELFTEST_OPEN_S * 1000000;
+    xSemaphoreGive(s_socks_lock);
+}
+
+/* false once the ports are closed */
+static bool selftest_close_expired(void)
+{
+    bool open = true;
+
+    xSemaphoreTake(s_socks_lock, portMAX_DELAY);
+    if (esp_timer_get_time() >= s_close_us) {
+        selftest_close_sockets();
+        s_open = false;
+        open = false;
+        ESP_LOGI(TAG, "test ports closed");
+    }
+    xSemaphoreGive(s_socks_lock);
+    return open;
+}
+
+static void selftest_serve(void)
+{
+    static void (*const tcp_handlers[])(int) = {
+        [SELFTEST_SINK] = selftest_run_sink,
+        [SELFTEST_SOURCE] = selftest_run_source,
+        [SELFTEST_ECHO_TCP] = selftest_run_echo_tcp,
+        [SELFTEST_RTT] = selftest_run_rtt,
+    };
+    /* the sockets don't change until they are closed here, at least one of them is open */
+    int max_fd = -1;
+
+    for (int i = 0; i < SELFTEST_SERVICE_COUNT; i++) {
+        max_fd = MAX(max_fd, s_socks[i]);
+    }
+
+    while (selftest_close_expired()) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        for (int i = 0; i < SELFTEST_SERVICE_COUNT; i++) {
+            if (s_socks[i] >= 0) {
+                FD_SET(s_socks[i], &rfds);
+            }
+        }
+
+        struct timeval tv = {
+            .tv_sec = SELFTEST_SELECT_TIMEOUT_MS / 1000,
+        };
+        int ret = select(max_fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "select failed (%d)", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        if (ret == 0) {
+            continue;
+        }
+
+        if (s_socks[SELFTEST_ECHO_UDP] >= 0 && FD_ISSET(s_socks[SELFTEST_ECHO_UDP], &rfds)) {
+            selftest_echo_udp(s_socks[SELFTEST_ECHO_UDP]);
+            selftest_keep_open();
+        }
+
+        /* TCP tests are served one at a time so they don't disturb each other */
+        for (int i = 0; i < SELFTEST_ECHO_UDP; i++) {
+            if (s_socks[i] < 0 || !FD_ISSET(s_socks[i], &rfds)) {
+                continue;
+            }
+            int client = accept(s_socks[i], NULL, NULL);
+            if (client < 0) {
+                continue;
+            }
+            ESP_LOGI(TAG, "client connected to port %d", s_ports[i]);
+            tcp_handlers[i](client);
+            shutdown(client, SHUT_RDWR);
+            close(client);
+            selftest_keep_open();
+            if (i != SELFTEST_ECHO_TCP) {
+                selftest_update_ui();
+            }
+        }
+    }
+}
+
+static void selftest_task(void *arg)
+{
+    while (true) {
+        /* woken up by the "/selftest" POST handler once the ports are open */
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        selftest_serve();
+    }
+}
+
+static void selftest_add_throughput(cJSON *root, const char *name, const struct selftest_throughput *res)
+{
+    cJSON *obj = cJSON_AddObjectToObject(root, name);
+    cJSON_AddNumberToObject(obj, "runs", res->runs);
+    cJSON_AddNumberToObject(obj, "bytes", res->bytes);
+    cJSON_AddNumberToObject(obj, "durationMs", res->duration_us / 1000);
+    cJSON_AddNumberToObject(obj, "kbps", res->kbps);
+}
+
+static esp_err_t selftest_get_handler(httpd_req_t *req)
+{
+    cJSON *root = cJSON_CreateObject();
+
+    xSemaphoreTake(s_results_lock, portMAX_DELAY);
+    selftest_add_throughput(root, "sink", &s_results.sink);
+    selftest_add_throughput(root, "source", &s_results.source);
+
+    cJSON *rtt = cJSON_AddObjectToObject(root, "rtt");
+    cJSON_AddNumberToObject(rtt, "runs", s_results.rtt.runs);
+    cJSON_AddNumberToObject(rtt, "samples", s_results.rtt.samples);
+    cJSON_AddNumberToObject(rtt, "lost", s_results.rtt.lost);
+    cJSON_AddNumberToObject(rtt, "minUs", s_results.rtt.min_us);
+    cJSON_AddNumberToObject(rtt, "p50Us", s_results.rtt.p50_us);
+    cJSON_AddNumberToObject(rtt, "p90Us", s_results.rtt.p90_us);
+    cJSON_AddNumberToObject(rtt, "p99Us", s_results.rtt.p99_us);
+    cJSON_AddNumberToObject(rtt, "maxUs", s_results.rtt.max_us);
+
+    cJSON *echo = cJSON_AddObjectToObject(root, "echo");
+    cJSON_AddNumberToObject(echo, "tcpBytes", s_results.echo_tcp_bytes);
+    cJSON_AddNumberToObject(echo, "udpPackets", s_results.echo_udp_packets);
+    xSemaphoreGive(s_results_lock);
+
+    char *json_string = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_send(req, json_string, HTTPD_RESP_USE_STRLEN);
+
+    free(json_string);
+
+    return err;
+}
+
+static esp_err_t selftest_post_handler(httpd_req_t *req)
+{
+    char msg[64];
+
+    xSemaphoreTake(s_socks_lock, portMAX_DELAY);
+    bool opened = s_open;
+    if (!opened && selftest_open_sockets()) {
+        opened = s_open = true;
+        xTaskNotifyGive(s_task);
+        ESP_LOGI(TAG, "test ports opened");
+    }
+    xSemaphoreGive(s_socks_lock);
+
+    if (!opened) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No self-test port could be opened");
+        return ESP_FAIL;
+    }
+    selftest_keep_open();
+
+    snprintf(msg, sizeof(msg), "Self-test ports are open for %d s", CONFIG_NET_SELFTEST_OPEN_S);
+    httpd_resp_sendstr(req, msg);
+
+    return ESP_OK;
+}
+
+static httpd_uri_t uri_get_selftest = {
+    .uri = "/selftest",
+    .method = HTTP_GET,
+    .handler = selftest_get_handler,
+    .user_ctx = NULL
+};
+
+static httpd_uri_t uri_post_selftest = {
+    .uri = "/selftest",
+    .method = HTTP_POST,
+    .handler = selftest_post_handler,
+    .user_ctx = NULL
+};
+
+esp_err_t net_selftest_start(httpd_handle_t http_handle)
+{
+    s_results_lock = xSemaphoreCreateMutex();
+    s_socks_lock = xSemaphoreCreateMutex();
+    s_buf = malloc(SELFTEST_BUF_SIZE);
+    if (!s_results_lock || !s_socks_lock || !s_buf) {
+        ESP_LOGE(TAG, "Failed to allocate self-test resources!");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(selftest_task, "net_selftest", SELFTEST_TASK_STACK_SIZE, NULL, SELFTEST_TASK_PRIO,
+                    &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create self-test task!");
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = httpd_register_uri_handler(http_handle, &uri_get_selftest);
+    if (err == ESP_OK) {
+        err = httpd_register_uri_handler(http_handle, &uri_post_selftest);
+    }
+    return err;
+}
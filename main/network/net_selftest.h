@@ -0,0 +1,19 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Network self-test service. Offers an iperf compatible TCP sink, a TCP source,
+ * RFC 862 TCP/UDP echo and a device initiated RTT probe. A POST to the "/selftest"
+ * endpoint of the given web server opens the test ports for a while, a GET returns the results.
+ */
+esp_err_t net_selftest_start(httpd_handle_t http_handle);
+
+#ifdef __cplusplus
+}
+#endif
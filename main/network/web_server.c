@@ -12,6 +12,8 @@
 
 #include "web_server.h"
 #include "storage.h"
+#include "metrics.h"
+#include "autotune.h"
 #include "ui.h"
 #include "types.h"
 
@@ -194,6 +196,90 @@ esp_err_t get_openocd_config_handler(httpd_req_t *req)
     return err;
 }
 
+esp_err_t get_metrics_handler(httpd_req_t *req)
+{
+    char *json_string = metrics_to_json();
+    if (!json_string) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create metrics");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_send(req, json_string, HTTPD_RESP_USE_STRLEN);
+
+    free(json_string);
+
+    return err;
+}
+
+esp_err_t autotune_handler(httpd_req_t *req)
+{
+    char json[req->content_len];
+
+    cJSON *root = set_handler_start(req, json, sizeof(json));
+    if (!root) {
+        return ESP_FAIL;
+    }
+
+    /* optional RAM address for the read-back check */
+    cJSON *mem_addr = cJSON_GetObjectItem(root, "memAddr");
+    uint32_t addr = cJSON_IsString(mem_addr) ? strtoul(mem_addr->valuestring, NULL, 0) : 0;
+    cJSON_Delete(root);
+
+    /* the search takes up to a minute, the page polls GET /autotune for the result */
+    esp_err_t err = autotune_start(addr);
+    if (err == ESP_ERR_INVALID_STATE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "TCK autotune is already running");
+        return ESP_FAIL;
+    } else if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "TCK autotune couldn't be started");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_sendstr(req, "TCK autotune started");
+
+    return ESP_OK;
+}
+
+esp_err_t get_autotune_handler(httpd_req_t *req)
+{
+    static const char *const states[] = {
+        [AUTOTUNE_IDLE] = "idle",
+        [AUTOTUNE_RUNNING] = "running",
+        [AUTOTUNE_DONE] = "done",
+        [AUTOTUNE_FAILED] = "failed",
+    };
+    struct autotune_result result;
+    char msg[128] = "";
+
+    autotune_state_t state = autotune_status(&result);
+    if (state == AUTOTUNE_DONE) {
+        snprintf(msg, sizeof(msg), "Reliable up to %u kHz, %u kHz is saved for %s",
+                 (unsigned)result.best_khz, (unsigned)result.tuned_khz, g_app_params.config_file);
+    } else if (state == AUTOTUNE_FAILED) {
+        snprintf(msg, sizeof(msg), "TCK autotune failed, see the OpenOCD log");
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "state", states[state]);
+    cJSON_AddNumberToObject(root, "bestKhz", state == AUTOTUNE_DONE ? result.best_khz : 0);
+    cJSON_AddNumberToObject(root, "tunedKhz", state == AUTOTUNE_DONE ? result.tuned_khz : 0);
+    cJSON_AddStringToObject(root, "message", msg);
+    char *json_string = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (!json_string) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create the autotune status");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    esp_err_t err = httpd_resp_send(req, json_string, HTTPD_RESP_USE_STRLEN);
+
+    free(json_string);
+
+    return err;
+}
+
 static void get_filename_from_path(const char *path, char *filename)
 {
     const char *last_slash = strrchr(path, '/');
@@ -362,6 +448,27 @@ httpd_uri_t uri_get_openocd_config = {
     .user_ctx = NULL
 };
 
+httpd_uri_t uri_get_metrics = {
+    .uri = "/metrics",
+    .method = HTTP_GET,
+    .handler = get_metrics_handler,
+    .user_ctx = NULL
+};
+
+httpd_uri_t uri_autotune = {
+    .uri = "/autotune",
+    .method = HTTP_POST,
+    .handler = autotune_handler,
+    .user_ctx = NULL
+};
+
+httpd_uri_t uri_get_autotune = {
+    .uri = "/autotune",
+    .method = HTTP_GET,
+    .handler = get_autotune_handler,
+    .user_ctx = NULL
+};
+
 httpd_uri_t uri_file_upload = {
     .uri       = "/upload/*",
     .method    = HTTP_POST,
@@ -396,6 +503,9 @@ esp_err_t web_server_start(httpd_handle_t *http_handle)
     httpd_register_uri_handler(*http_handle, &uri_set_credentials);
     httpd_register_uri_handler(*http_handle, &uri_set_openocd_config);
     httpd_register_uri_handler(*http_handle, &uri_get_openocd_config);
+    httpd_register_uri_handler(*http_handle, &uri_get_metrics);
+    httpd_register_uri_handler(*http_handle, &uri_autotune);
+    httpd_register_uri_handler(*http_handle, &uri_get_autotune);
     httpd_register_uri_handler(*http_handle, &uri_file_upload);
     httpd_register_uri_handler(*http_handle, &uri_file_delete);
 
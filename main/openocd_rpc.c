@@ -0,0 +1,151 @@
+/*
+    Client of OpenOCD's tcl server. Lets the application query and steer OpenOCD at runtime.
+    Commands are terminated with 0x1a and so are the responses.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "openocd_rpc.h"
+#include "server_shim.h"
+
+#define OPENOCD_RPC_TERMINATOR      '\x1a'
+
+static const char *TAG = "openocd-rpc";
+
+static SemaphoreHandle_t s_lock;
+static int s_sock = -1;
+static portMUX_TYPE s_init_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void openocd_rpc_disconnect(void)
+{
+    if (s_sock >= 0) {
+        close(s_sock);
+        s_sock = -1;
+    }
+}
+
+static esp_err_t openocd_rpc_connect(void)
+{
+    if (s_sock >= 0) {
+        return ESP_OK;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return ESP_FAIL;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(SERVER_TCL_PORT),
+    };
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGD(TAG, "tcl server is not reachable (%d)", errno);
+        close(sock);
+        return ESP_FAIL;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    s_sock = sock;
+
+    return ESP_OK;
+}
+
+static esp_err_t openocd_rpc_transfer(const char *line, char *resp, size_t resp_len, uint32_t timeout_ms)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(s_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    size_t len = strlen(line);
+    if (send(s_sock, line, len, 0) != len) {
+        return ESP_FAIL;
+    }
+
+    /* only one command is in flight, so everything up to the terminator belongs to this response */
+    size_t pos = 0;
+    while (true) {
+        char buf[64];
+        int ret = recv(s_sock, buf, sizeof(buf), 0);
+        if (ret <= 0) {
+            return ESP_ERR_TIMEOUT;
+        }
+        char *end = memchr(buf, OPENOCD_RPC_TERMINATOR, ret);
+        size_t n = end ? (size_t)(end - buf) : (size_t)ret;
+        n = MIN(n, resp_len - 1 - pos);
+        memcpy(resp + pos, buf, n);
+        pos += n;
+        if (end) {
+            break;
+        }
+    }
+    resp[pos] = '\0';
+
+    return ESP_OK;
+}
+
+esp_err_t openocd_rpc_exec(const char *cmd, char *resp, size_t resp_len, uint32_t timeout_ms)
+{
+    if (!cmd || !resp || resp_len < 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&s_init_lock);
+    if (!s_lock) {
+        s_lock = xSemaphoreCreateMutex();
+    }
+    portEXIT_CRITICAL(&s_init_lock);
+    if (!s_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* tcl server doesn't tell errors apart from results, so let the interpreter prefix the return code */
+    size_t line_len = strlen(cmd) + 48;
+    char *line = malloc(line_len);
+    if (!line) {
+        return ESP_ERR_NO_MEM;
+    }
+    snprintf(line, line_len, "format \"%%d %%s\" [catch {%s} __rpc_res] $__rpc_res%c", cmd, OPENOCD_RPC_TERMINATOR);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    esp_err_t err = openocd_rpc_connect();
+    if (err == ESP_OK) {
+        err = openocd_rpc_transfer(line, resp, resp_len, timeout_ms);
+        if (err != ESP_OK) {
+            /* response may still arrive later, start over with a new connection */
+            openocd_rpc_disconnect();
+        }
+    }
+
+    xSemaphoreGive(s_lock);
+
+    free(line);
+
+    if (err != ESP_OK) {
+        resp[0] = '\0';
+        return err;
+    }
+
+    int rc = atoi(resp);
+    char *res = strchr(resp, ' ');
+    if (res) {
+        memmove(resp, res + 1, strlen(res + 1) + 1);
+    } else {
+        resp[0] = '\0';
+    }
+
+    return rc == 0 ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define OPENOCD_RPC_TIMEOUT_MS      1000
+
+/*
+ * Runs a command in the OpenOCD interpreter through its tcl server (loopback connection).
+ * Result of the command is copied into resp. ESP_FAIL is returned when the command itself fails,
+ * in that case resp holds the error message.
+ */
+esp_err_t openocd_rpc_exec(const char *cmd, char *resp, size_t resp_len, uint32_t timeout_ms);
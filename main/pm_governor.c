@@ -0,0 +1,242 @@
+/*
+    Session aware power and performance governor.
+
+    idle profile    : Wi-Fi modem sleep, CPU and APB frequencies are scaled down by DFS
+    session profile : no Wi-Fi power save, CPU and APB frequency locks are held
+
+    Session profile is selected while a client is connected to one of OpenOCD's servers and
+    either the target is halted (user is interacting) or the packet rate shows activity.
+*/
+#include <string.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "pm_governor.h"
+#include "server_shim.h"
+#include "openocd_rpc.h"
+#include "metrics.h"
+
+#define PM_GOVERNOR_TASK_STACK_SIZE     3072
+#define PM_GOVERNOR_TASK_PRIO           (tskIDLE_PRIORITY + 1)
+
+static const char *TAG = "pm-governor";
+
+typedef enum {
+    PM_PROFILE_IDLE,
+    PM_PROFILE_SESSION,
+    PM_PROFILE_MAX,
+} pm_profile_t;
+
+typedef enum {
+    PM_TARGET_UNKNOWN,
+    PM_TARGET_RUNNING,
+    PM_TARGET_HALTED,
+} pm_target_state_t;
+
+static const char *s_profile_names[PM_PROFILE_MAX] = {
+    [PM_PROFILE_IDLE] = "idle",
+    [PM_PROFILE_SESSION] = "session",
+};
+
+static struct {
+    pm_profile_t profile;
+    esp_pm_lock_handle_t cpu_lock;
+    esp_pm_lock_handle_t apb_lock;
+    int64_t profile_since_us;
+    int64_t residency_us[PM_PROFILE_MAX];
+    int64_t last_activity_us;
+    uint32_t transitions;
+    uint32_t last_transition_us;
+    uint32_t max_transition_us;
+    uint32_t packet_rate;
+    pm_target_state_t target_state;
+} s_gov;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static pm_target_state_t pm_governor_target_state(void)
+{
+    char resp[32];
+
+    /* curstate returns the cached state, it doesn't cost any JTAG transaction */
+    if (openocd_rpc_exec("[target current] curstate", resp, sizeof(resp), OPENOCD_RPC_TIMEOUT_MS) != ESP_OK) {
+        return PM_TARGET_UNKNOWN;
+    }
+    if (!strcmp(resp, "running")) {
+        return PM_TARGET_RUNNING;
+    }
+    if (!strcmp(resp, "halted")) {
+        return PM_TARGET_HALTED;
+    }
+    return PM_TARGET_UNKNOWN;
+}
+
+static void pm_governor_apply(pm_profile_t profile)
+{
+    int64_t start = esp_timer_get_time();
+
+    if (profile == PM_PROFILE_SESSION) {
+        esp_pm_lock_acquire(s_gov.cpu_lock);
+        esp_pm_lock_acquire(s_gov.apb_lock);
+        esp_wifi_set_ps(WIFI_PS_NONE);
+    } else {
+        esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+        esp_pm_lock_release(s_gov.apb_lock);
+        esp_pm_lock_release(s_gov.cpu_lock);
+    }
+
+    int64_t now = esp_timer_get_time();
+    uint32_t latency = (uint32_t)(now - start);
+
+    portENTER_CRITICAL(&s_lock);
+    s_gov.residency_us[s_gov.profile] += now - s_gov.profile_since_us;
+    s_gov.profile_since_us = now;
+    s_gov.profile = profile;
+    s_gov.transitions++;
+    s_gov.last_transition_us = latency;
+    if (latency > s_gov.max_transition_us) {
+        s_gov.max_transition_us = latency;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(TAG, "%s profile (transition %" PRIu32 " us)", s_profile_names[profile], latency);
+}
+
+static pm_profile_t pm_governor_decide(const struct server_shim_stats *stats, int64_t now)
+{
+    bool clients = false;
+    for (size_t i = 0; i < SERVER_CONN_TYPE_MAX; i++) {
+        clients |= stats->clients[i] > 0;
+    }
+
+    if (s_gov.packet_rate >= CONFIG_PM_GOVERNOR_ACTIVE_PACKET_RATE) {
+        s_gov.last_activity_us = now;
+    }
+
+    if (!clients) {
+        s_gov.target_state = PM_TARGET_UNKNOWN;
+        return PM_PROFILE_IDLE;
+    }
+
+    s_gov.target_state = pm_governor_target_state();
+    if (s_gov.target_state != PM_TARGET_RUNNING) {
+        /* halted target means someone is stepping through the code, unknown is treated the same */
+        return PM_PROFILE_SESSION;
+    }
+
+    if (now - s_gov.last_activity_us < (int64_t)CONFIG_PM_GOVERNOR_IDLE_TIMEOUT_MS * 1000) {
+        return PM_PROFILE_SESSION;
+    }
+
+    return PM_PROFILE_IDLE;
+}
+
+static void pm_governor_task(void *arg)
+{
+    struct server_shim_stats prev, cur;
+
+    server_shim_get_stats(&prev);
+
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_PM_GOVERNOR_PERIOD_MS));
+
+        server_shim_get_stats(&cur);
+        uint32_t packets = (cur.rx_packets - prev.rx_packets) + (cur.tx_packets - prev.tx_packets);
+        prev = cur;
+        s_gov.packet_rate = packets * 1000 / CONFIG_PM_GOVERNOR_PERIOD_MS;
+
+        int64_t now = esp_timer_get_time();
+        pm_profile_t profile = pm_governor_decide(&cur, now);
+
+        /* leave the session profile only after the idle timeout to avoid flapping */
+        if (profile == PM_PROFILE_IDLE && s_gov.profile == PM_PROFILE_SESSION &&
+                now - s_gov.profile_since_us < (int64_t)CONFIG_PM_GOVERNOR_IDLE_TIMEOUT_MS * 1000) {
+            continue;
+        }
+
+        if (profile != s_gov.profile) {
+            pm_governor_apply(profile);
+        }
+    }
+}
+
+static void pm_governor_metrics(cJSON *obj)
+{
+    int64_t residency[PM_PROFILE_MAX];
+
+    portENTER_CRITICAL(&s_lock);
+    memcpy(residency, s_gov.residency_us, sizeof(residency));
+    residency[s_gov.profile] += esp_timer_get_time() - s_gov.profile_since_us;
+    pm_profile_t profile = s_gov.profile;
+    uint32_t transitions = s_gov.transitions;
+    uint32_t last_transition_us = s_gov.last_transition_us;
+    uint32_t max_transition_us = s_gov.max_transition_us;
+    portEXIT_CRITICAL(&s_lock);
+
+    int64_t total = residency[PM_PROFILE_IDLE] + residency[PM_PROFILE_SESSION];
+    double idle_ratio = total > 0 ? (double)residency[PM_PROFILE_IDLE] / total : 0;
+    /* estimations are based on the nominal currents given in menuconfig */
+    double avg_ma = idle_ratio * CONFIG_PM_GOVERNOR_IDLE_CURRENT_MA +
+                    (1 - idle_ratio) * CONFIG_PM_GOVERNOR_SESSION_CURRENT_MA;
+    double saved_mah = (double)residency[PM_PROFILE_IDLE] / 3600e6 *
+                       (CONFIG_PM_GOVERNOR_SESSION_CURRENT_MA - CONFIG_PM_GOVERNOR_IDLE_CURRENT_MA);
+
+    cJSON_AddStringToObject(obj, "profile", s_profile_names[profile]);
+    cJSON_AddNumberToObject(obj, "transitions", transitions);
+    cJSON_AddNumberToObject(obj, "lastTransitionUs", last_transition_us);
+    cJSON_AddNumberToObject(obj, "maxTransitionUs", max_transition_us);
+    cJSON_AddNumberToObject(obj, "idleMs", residency[PM_PROFILE_IDLE] / 1000);
+    cJSON_AddNumberToObject(obj, "sessionMs", residency[PM_PROFILE_SESSION] / 1000);
+    cJSON_AddNumberToObject(obj, "idlePercent", idle_ratio * 100);
+    cJSON_AddNumberToObject(obj, "estAvgCurrentMa", avg_ma);
+    cJSON_AddNumberToObject(obj, "estSavedMah", saved_mah);
+    cJSON_AddNumberToObject(obj, "packetRate", s_gov.packet_rate);
+}
+
+esp_err_t pm_governor_start(void)
+{
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_PM_GOVERNOR_IDLE_CPU_FREQ_MHZ,
+        .light_sleep_enable = false,
+    };
+
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "session_cpu", &s_gov.cpu_lock);
+    if (err == ESP_OK) {
+        err = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "session_apb", &s_gov.apb_lock);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create pm locks (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    /* start in the session profile, OpenOCD examines the target right after the start */
+    s_gov.profile = PM_PROFILE_SESSION;
+    s_gov.profile_since_us = esp_timer_get_time();
+    s_gov.last_activity_us = s_gov.profile_since_us;
+    esp_pm_lock_acquire(s_gov.cpu_lock);
+    esp_pm_lock_acquire(s_gov.apb_lock);
+    esp_wifi_set_ps(WIFI_PS_NONE);
+
+    metrics_register("pm", pm_governor_metrics);
+
+    if (xTaskCreate(pm_governor_task, "pm_governor", PM_GOVERNOR_TASK_STACK_SIZE, NULL,
+                    PM_GOVERNOR_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create governor task!");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_err.h"
+
+/* Switches between the idle and session power profiles depending on the OpenOCD server activity */
+esp_err_t pm_governor_start(void);
@@ -0,0 +1,275 @@
+/*
+    Adaptive target polling.
+
+    OpenOCD polls the targets every 100 ms whatever the debugger is doing, and with SMP
+    (ESP_ONLYCPU 3) a poll reads the state of every core. The scheduler samples the server
+    activity and the target state every POLL_SCHED_PERIOD_MS and decides how far apart the polls are:
+
+    off     : no remote client, polling is turned off in OpenOCD (`poll off`)
+    fast    : OpenOCD's own period. After a client connected or the target resumed, while packets
+              are flowing, and as long as a gdb client waits for a running target to stop
+    backoff : after POLL_SCHED_BACKOFF_AFTER_MS without any of the above (halted target, running
+              target with only telnet/tcl clients), the period doubles every
+              POLL_SCHED_BACKOFF_AFTER_MS up to POLL_SCHED_MAX_PERIOD_MS
+
+    The period is set with OpenOCD's `polling_period` command, so only the polling timer moves and
+    OpenOCD's other timers keep their own period. The polls avoided
+    compared to OpenOCD's fixed period, and the adapter queue runs they would have cost, are
+    reported under `poll` in /metrics.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "poll_sched.h"
+#include "activity.h"
+#include "server_shim.h"
+#include "openocd_rpc.h"
+#include "metrics.h"
+
+#define POLL_SCHED_TASK_STACK_SIZE      3072
+#define POLL_SCHED_TASK_PRIO            (tskIDLE_PRIORITY + 1)
+
+/* polling_interval of OpenOCD's target.c */
+#define OPENOCD_POLL_PERIOD_MS          100
+
+static const char *TAG = "poll-sched";
+
+typedef enum {
+    POLL_MODE_OFF,
+    POLL_MODE_FAST,
+    POLL_MODE_BACKOFF,
+    POLL_MODE_MAX,
+} poll_mode_t;
+
+static const char *s_mode_names[POLL_MODE_MAX] = {
+    [POLL_MODE_OFF] = "off",
+    [POLL_MODE_FAST] = "fast",
+    [POLL_MODE_BACKOFF] = "backoff",
+};
+
+static struct {
+    poll_mode_t mode;
+    uint32_t period_ms;                 /* effective polling period, 0 while off */
+    bool polling;                       /* polling state applied in OpenOCD */
+    uint32_t applied_period_ms;         /* polling period applied in OpenOCD */
+    bool running;
+    int64_t last_activity_us;
+    int64_t residency_us[POLL_MODE_MAX];
+    double polls;                       /* estimated polls done */
+    double baseline_polls;              /* polls OpenOCD would have done with its fixed period */
+    double quiet_polls;                 /* polls of the periods without any other adapter traffic */
+    uint32_t quiet_queue_runs;
+} s_sched;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool poll_sched_rpc(const char *cmd, char *resp, size_t len)
+{
+    esp_err_t err = openocd_rpc_exec(cmd, resp, len, OPENOCD_RPC_TIMEOUT_MS);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "%s failed (%s)", cmd, err == ESP_FAIL ? resp : esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+static bool poll_sched_set_polling(bool enable)
+{
+    char resp[64];
+
+    if (s_sched.polling == enable) {
+        return true;
+    }
+    if (!poll_sched_rpc(enable ? "poll on" : "poll off", resp, sizeof(resp))) {
+        return false;
+    }
+    s_sched.polling = enable;
+    if (enable) {
+        /* the state may have changed while nobody was looking, poll right away */
+        server_loop_wakeup();
+    }
+    return true;
+}
+
+static bool poll_sched_set_period(uint32_t period_ms)
+{
+    char cmd[32];
+    char resp[64];
+
+    if (s_sched.applied_period_ms == period_ms) {
+        return true;
+    }
+    snprintf(cmd, sizeof(cmd), "polling_period %" PRIu32, period_ms);
+    if (!poll_sched_rpc(cmd, resp, sizeof(resp))) {
+        return false;
+    }
+    s_sched.applied_period_ms = period_ms;
+    return true;
+}
+
+static uint32_t poll_sched_backoff_period(int64_t idle_us)
+{
+    int64_t steps = idle_us / ((int64_t)CONFIG_POLL_SCHED_BACKOFF_AFTER_MS * 1000);
+    uint32_t period = OPENOCD_POLL_PERIOD_MS;
+
+    while (steps-- > 0 && period < CONFIG_POLL_SCHED_MAX_PERIOD_MS) {
+        period *= 2;
+    }
+    return MIN(period, CONFIG_POLL_SCHED_MAX_PERIOD_MS);
+}
+
+static poll_mode_t poll_sched_decide(const struct server_shim_stats *stats, uint32_t packets, int64_t now,
+                                     uint32_t *period_ms)
+{
+    bool clients = false;
+    for (size_t i = 0; i < SERVER_CONN_TYPE_MAX; i++) {
+        clients |= stats->clients[i] > 0;
+    }
+
+    if (!clients) {
+        *period_ms = 0;
+        return POLL_MODE_OFF;
+    }
+
+    char resp[32];
+    bool running = s_sched.running;
+    /* curstate returns the cached state, it doesn't cost any JTAG transaction */
+    if (poll_sched_rpc("[target current] curstate", resp, sizeof(resp))) {
+        running = !strcmp(resp, "running");
+    }
+
+    bool resumed = running && !s_sched.running;
+    s_sched.running = running;
+
+    if (s_sched.mode == POLL_MODE_OFF || resumed || packets) {
+        s_sched.last_activity_us = now;
+    }
+
+    /* a running target is only seen halting by polling it, gdb is waiting for that */
+    if (running && stats->clients[SERVER_CONN_GDB]) {
+        s_sched.last_activity_us = now;
+    }
+
+    int64_t idle_us = now - s_sched.last_activity_us;
+    if (idle_us < (int64_t)CONFIG_POLL_SCHED_BACKOFF_AFTER_MS * 1000) {
+        *period_ms = OPENOCD_POLL_PERIOD_MS;
+        return POLL_MODE_FAST;
+    }
+
+    *period_ms = poll_sched_backoff_period(idle_us);
+    return POLL_MODE_BACKOFF;
+}
+
+static void poll_sched_account(int64_t elapsed_us, bool quiet, uint32_t queue_runs)
+{
+    double polls = s_sched.period_ms ? (double)elapsed_us / 1000 / s_sched.period_ms : 0;
+
+    portENTER_CRITICAL(&s_lock);
+    s_sched.residency_us[s_sched.mode] += elapsed_us;
+    s_sched.polls += polls;
+    s_sched.baseline_polls += (double)elapsed_us / 1000 / OPENOCD_POLL_PERIOD_MS;
+    /* without packets the adapter only runs for the polls, which gives their cost */
+    if (quiet && polls > 0) {
+        s_sched.quiet_polls += polls;
+        s_sched.quiet_queue_runs += queue_runs;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void poll_sched_task(void *arg)
+{
+    struct server_shim_stats prev, cur;
+    uint32_t prev_queue_runs = activity_queue_runs();
+    int64_t prev_us = esp_timer_get_time();
+
+    server_shim_get_stats(&prev);
+
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_POLL_SCHED_PERIOD_MS));
+
+        int64_t now = esp_timer_get_time();
+        uint32_t queue_runs = activity_queue_runs();
+        server_shim_get_stats(&cur);
+        uint32_t packets = (cur.rx_packets - prev.rx_packets) + (cur.tx_packets - prev.tx_packets);
+        prev = cur;
+
+        bool was_running = s_sched.running;
+        uint32_t period_ms;
+        poll_mode_t mode = poll_sched_decide(&cur, packets, now, &period_ms);
+
+        poll_sched_account(now - prev_us, !packets && was_running == s_sched.running,
+                           queue_runs - prev_queue_runs);
+        prev_us = now;
+        prev_queue_runs = queue_runs;
+
+        if (!poll_sched_set_polling(mode != POLL_MODE_OFF) ||
+                (mode != POLL_MODE_OFF && !poll_sched_set_period(period_ms))) {
+            /* OpenOCD isn't serving tcl yet, try again with the next sample */
+            continue;
+        }
+
+        if (mode != s_sched.mode) {
+            ESP_LOGD(TAG, "%s -> %s", s_mode_names[s_sched.mode], s_mode_names[mode]);
+        }
+        portENTER_CRITICAL(&s_lock);
+        s_sched.mode = mode;
+        s_sched.period_ms = period_ms;
+        portEXIT_CRITICAL(&s_lock);
+    }
+}
+
+static void poll_sched_metrics(cJSON *obj)
+{
+    portENTER_CRITICAL(&s_lock);
+    poll_mode_t mode = s_sched.mode;
+    uint32_t period_ms = s_sched.period_ms;
+    double polls = s_sched.polls;
+    double baseline_polls = s_sched.baseline_polls;
+    double quiet_polls = s_sched.quiet_polls;
+    uint32_t quiet_queue_runs = s_sched.quiet_queue_runs;
+    int64_t residency[POLL_MODE_MAX];
+    memcpy(residency, s_sched.residency_us, sizeof(residency));
+    portEXIT_CRITICAL(&s_lock);
+
+    double saved = baseline_polls - polls;
+    double runs_per_poll = quiet_polls >= 1 ? quiet_queue_runs / quiet_polls : 0;
+
+    cJSON_AddStringToObject(obj, "mode", s_mode_names[mode]);
+    cJSON_AddNumberToObject(obj, "periodMs", period_ms);
+    cJSON_AddNumberToObject(obj, "offMs", residency[POLL_MODE_OFF] / 1000);
+    cJSON_AddNumberToObject(obj, "fastMs", residency[POLL_MODE_FAST] / 1000);
+    cJSON_AddNumberToObject(obj, "backoffMs", residency[POLL_MODE_BACKOFF] / 1000);
+    cJSON_AddNumberToObject(obj, "polls", (uint32_t)polls);
+    cJSON_AddNumberToObject(obj, "pollsSaved", (uint32_t)saved);
+    cJSON_AddNumberToObject(obj, "savedPercent", baseline_polls > 0 ? saved * 100 / baseline_polls : 0);
+    /* adapter queue runs are only counted with ACTIVITY_ENABLE */
+    cJSON_AddNumberToObject(obj, "queueRunsPerPoll", runs_per_poll);
+    cJSON_AddNumberToObject(obj, "queueRunsSaved", (uint32_t)(saved * runs_per_poll));
+}
+
+esp_err_t poll_sched_start(void)
+{
+    /* OpenOCD starts with polling on and examines the target, nothing is reclaimed until then */
+    s_sched.mode = POLL_MODE_FAST;
+    s_sched.period_ms = OPENOCD_POLL_PERIOD_MS;
+    s_sched.polling = true;
+    s_sched.applied_period_ms = OPENOCD_POLL_PERIOD_MS;
+    s_sched.last_activity_us = esp_timer_get_time();
+
+    metrics_register("poll", poll_sched_metrics);
+
+    if (xTaskCreate(poll_sched_task, "poll_sched", POLL_SCHED_TASK_STACK_SIZE, NULL,
+                    POLL_SCHED_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create scheduler task!");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_err.h"
+
+/* Adapts OpenOCD's target polling to the server activity and the target state */
+esp_err_t poll_sched_start(void);
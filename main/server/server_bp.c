@@ -0,0 +1,419 @@
+/*
+    Software breakpoints of the gdb connections, batched between resumes.
+
+    gdb removes all its breakpoints when the target stops and inserts them again before it resumes.
+    On the Espressif targets a software breakpoint in flash is a read, erase and write of its sector
+    by the flasher stub, so every stop and continue costs two sector rewrites per breakpoint.
+
+    Here gdb's `z0` is answered at once and the breakpoint stays in OpenOCD. If gdb inserts it again
+    before the next resume, as it does, nothing is sent at all. The removals still pending when gdb
+    resumes, writes memory or sends a monitor command are sent first. Inserts are sent right away,
+    gdb has to know if one fails.
+
+    Only the changes gdb undoes before resuming are saved. Each change sent is still a sector
+    rewrite of its own: grouping them by sector would have to be done by OpenOCD's flash breakpoint
+    code.
+
+    gdb's memory reads are given the original instructions where a breakpoint it removed is still in
+    place: they are read before the breakpoint is inserted.
+
+    When gdb goes away, the breakpoints it removed which are still in place are removed with `rbp`
+    through the tcl server. This runs in a task of its own, OpenOCD can't serve the tcl connection
+    while it is closing the gdb one.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+#define BP_MAX_KIND             4
+
+static const char *TAG = "server-bp";
+
+struct bp_entry {
+    uint32_t addr;
+    uint8_t kind;
+    bool in_target;                     /* inserted in OpenOCD */
+    bool wanted;                        /* inserted for gdb */
+    bool orig_known;
+    uint8_t orig[BP_MAX_KIND];          /* instruction under the breakpoint */
+};
+
+struct bp_conn {
+    struct bp_entry *bps;
+    size_t count;
+    char *held;                         /* client packet sent on after the reads or the removals */
+    size_t held_len;
+    size_t flushing;                    /* removals not answered yet */
+    uint32_t saved;                     /* since the last resume */
+};
+
+static struct bp_conn s_bp[SERVER_SHIM_MAX_CONNS];
+
+static struct {
+    uint32_t resumes;
+    uint32_t requested;                 /* z0 and Z0 of gdb */
+    uint32_t sent;
+    uint32_t saved;
+    uint32_t saved_last;                /* at the last resume */
+    uint32_t removals_last;             /* sent at the last resume */
+} s_stats;
+
+static struct bp_entry *bp_find(struct bp_conn *bc, uint32_t addr)
+{
+    for (size_t i = 0; i < bc->count; i++) {
+        if (bc->bps[i].addr == addr) {
+            return &bc->bps[i];
+        }
+    }
+    return NULL;
+}
+
+static void bp_forget(struct bp_conn *bc, struct bp_entry *bp)
+{
+    *bp = bc->bps[--bc->count];
+}
+
+/* Z0,<addr>,<kind> */
+static bool bp_parse(const char *pkt, size_t len, uint32_t *addr, uint32_t *kind)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + 3;
+
+    *addr = server_rsp_parse_hex(&p, end);
+    if (p == end || *p++ != ',') {
+        return false;
+    }
+    *kind = server_rsp_parse_hex(&p, end);
+    return true;
+}
+
+/* packets before which OpenOCD has to hold the breakpoints gdb asked for */
+static bool bp_needs_flush(const char *pkt, size_t len)
+{
+    return server_rsp_is_resume(pkt, len) || pkt[0] == 'M' || pkt[0] == 'X' ||
+           server_rsp_starts_with(pkt, len, "vFlash") || server_rsp_starts_with(pkt, len, "qRcmd") ||
+           server_rsp_starts_with(pkt, len, "vRun") || server_rsp_starts_with(pkt, len, "vAttach");
+}
+
+static void bp_send_held(struct rsp_conn *conn, struct bp_conn *bc)
+{
+    char *held = bc->held;
+
+    bc->held = NULL;
+    server_rsp_pass(conn, &server_bp_feature, held, bc->held_len);
+    free(held);
+}
+
+static void bp_orig_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+    struct bp_entry *bp = bp_find(bc, (uint32_t)(uintptr_t)arg);
+
+    if (!reply) {
+        return;
+    }
+    if (bp && len == bp->kind * 2u && reply[0] != 'E') {
+        for (size_t i = 0; i < bp->kind; i++) {
+            const char *digit = reply + 2 * i;
+            bp->orig[i] = server_rsp_parse_hex(&digit, reply + 2 * i + 2);
+        }
+        bp->orig_known = true;
+    }
+    bp_send_held(conn, bc);
+}
+
+static rsp_action_t bp_insert(struct rsp_conn *conn, struct bp_conn *bc, const char *pkt, size_t len)
+{
+    uint32_t addr, kind;
+    char req[32];
+
+    if (!bp_parse(pkt, len, &addr, &kind) || !kind || kind > BP_MAX_KIND) {
+        return RSP_PASS;
+    }
+    s_stats.requested++;
+
+    struct bp_entry *bp = bp_find(bc, addr);
+    if (bp && bp->in_target) {
+        if (!bp->wanted) {
+            /* the removal and this insert are never sent */
+            bp->wanted = true;
+            bc->saved += 2;
+        }
+        server_rsp_reply(conn, "OK", 2);
+        return RSP_DONE;
+    }
+
+    if (!bc->bps) {
+        bc->bps = calloc(CONFIG_SERVER_BP_MAX_BREAKPOINTS, sizeof(*bc->bps));
+    }
+    if (!bp && (!bc->bps || bc->count == CONFIG_SERVER_BP_MAX_BREAKPOINTS)) {
+        /* not tracked, its removal goes to OpenOCD too */
+        s_stats.sent++;
+        return RSP_PASS;
+    }
+    if (!bp) {
+        bp = &bc->bps[bc->count++];
+    }
+    *bp = (struct bp_entry) {
+        .addr = addr, .kind = kind,
+    };
+
+    /* the instruction is read first, the Z0 follows with the reply */
+    int n = snprintf(req, sizeof(req), "m%" PRIx32 ",%" PRIx32, addr, kind);
+    free(bc->held);
+    bc->held = server_rsp_dup(pkt, len);
+    if (!bc->held || server_rsp_request(conn, req, n, bp_orig_cb, (void *)(uintptr_t)addr) != ESP_OK) {
+        free(bc->held);
+        bc->held = NULL;
+        s_stats.sent++;
+        return RSP_PASS;
+    }
+    bc->held_len = len;
+    s_stats.sent++;
+    return RSP_DONE;
+}
+
+static rsp_action_t bp_remove(struct rsp_conn *conn, struct bp_conn *bc, const char *pkt, size_t len)
+{
+    uint32_t addr, kind;
+
+    if (!bp_parse(pkt, len, &addr, &kind)) {
+        return RSP_PASS;
+    }
+    s_stats.requested++;
+
+    struct bp_entry *bp = bp_find(bc, addr);
+    if (!bp || !bp->in_target) {
+        s_stats.sent++;
+        return RSP_PASS;
+    }
+    /* left in place until it has to go */
+    bp->wanted = false;
+    server_rsp_reply(conn, "OK", 2);
+    return RSP_DONE;
+}
+
+static void bp_removed_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+    struct bp_entry *bp = bp_find(bc, (uint32_t)(uintptr_t)arg);
+
+    if (!reply) {
+        return;
+    }
+    if (len != 2 || memcmp(reply, "OK", 2)) {
+        ESP_LOGW(TAG, "breakpoint at 0x%" PRIx32 " not removed (%.*s)", (uint32_t)(uintptr_t)arg, (int)len, reply);
+    }
+    if (bp) {
+        bp_forget(bc, bp);
+    }
+    if (--bc->flushing == 0) {
+        bp_send_held(conn, bc);
+    }
+}
+
+/* sends the removals gdb asked for, then `pkt` */
+static rsp_action_t bp_flush(struct rsp_conn *conn, struct bp_conn *bc, const char *pkt, size_t len)
+{
+    uint32_t addrs[CONFIG_SERVER_BP_MAX_BREAKPOINTS];
+    size_t count = 0;
+    bool resume = server_rsp_is_resume(pkt, len);
+
+    for (size_t i = 0; i < bc->count; i++) {
+        if (bc->bps[i].in_target && !bc->bps[i].wanted) {
+            addrs[count++] = bc->bps[i].addr;
+        }
+    }
+    if (resume) {
+        s_stats.resumes++;
+        s_stats.saved += bc->saved;
+        s_stats.saved_last = bc->saved;
+        s_stats.removals_last = count;
+        bc->saved = 0;
+    }
+    if (!count) {
+        return RSP_PASS;
+    }
+
+    bc->held = server_rsp_dup(pkt, len);
+    if (!bc->held) {
+        return RSP_PASS;
+    }
+    bc->held_len = len;
+
+    for (size_t i = 0; i < count; i++) {
+        struct bp_entry *bp = bp_find(bc, addrs[i]);
+        char req[32];
+        int n = snprintf(req, sizeof(req), "z0,%" PRIx32 ",%x", bp->addr, bp->kind);
+
+        if (server_rsp_request(conn, req, n, bp_removed_cb, (void *)(uintptr_t)bp->addr) == ESP_OK) {
+            bc->flushing++;
+            s_stats.sent++;
+        }
+    }
+    if (!bc->flushing) {
+        bp_send_held(conn, bc);
+    }
+    return RSP_DONE;
+}
+
+/* the original instructions in a memory read, where gdb removed a breakpoint still in place */
+static void bp_patch_read(struct rsp_conn *conn, struct bp_conn *bc, const char *req, size_t req_len,
+                          const char *pkt, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p = req + 1;
+    const char *end = req + req_len;
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    char *copy = NULL;
+
+    for (size_t i = 0; i < bc->count; i++) {
+        const struct bp_entry *bp = &bc->bps[i];
+        if (!bp->in_target || bp->wanted || !bp->orig_known) {
+            continue;
+        }
+        for (size_t j = 0; j < bp->kind; j++) {
+            uint32_t at = bp->addr + j;
+            if (at < addr || (at - addr) * 2 + 2 > len) {
+                continue;
+            }
+            if (!copy && !(copy = server_rsp_dup(pkt, len))) {
+                server_rsp_release(conn, &server_bp_feature, req, req_len, pkt, len);
+                return;
+            }
+            copy[(at - addr) * 2] = hex[bp->orig[j] >> 4];
+            copy[(at - addr) * 2 + 1] = hex[bp->orig[j] & 0xf];
+        }
+    }
+    server_rsp_release(conn, &server_bp_feature, req, req_len, copy ? copy : pkt, len);
+    free(copy);
+}
+
+static rsp_action_t bp_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+
+    if (!len) {
+        return RSP_PASS;
+    }
+    if (len > 3 && pkt[0] == 'Z' && pkt[1] == '0' && pkt[2] == ',') {
+        return bp_insert(conn, bc, pkt, len);
+    }
+    if (len > 3 && pkt[0] == 'z' && pkt[1] == '0' && pkt[2] == ',') {
+        return bp_remove(conn, bc, pkt, len);
+    }
+    if (bp_needs_flush(pkt, len)) {
+        return bp_flush(conn, bc, pkt, len);
+    }
+    return RSP_PASS;
+}
+
+static rsp_action_t bp_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                  size_t len)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+    uint32_t addr, kind;
+
+    if (req_len > 3 && req[0] == 'Z' && req[1] == '0' && req[2] == ',' && bp_parse(req, req_len, &addr, &kind)) {
+        struct bp_entry *bp = bp_find(bc, addr);
+        if (bp && len == 2 && !memcmp(pkt, "OK", 2)) {
+            bp->in_target = true;
+            bp->wanted = true;
+        } else if (bp && !bp->in_target) {
+            bp_forget(bc, bp);
+        }
+        return RSP_PASS;
+    }
+    if (req_len && req[0] == 'm' && len && pkt[0] != 'E') {
+        for (size_t i = 0; i < bc->count; i++) {
+            if (bc->bps[i].in_target && !bc->bps[i].wanted) {
+                bp_patch_read(conn, bc, req, req_len, pkt, len);
+                return RSP_DONE;
+            }
+        }
+    }
+    return RSP_PASS;
+}
+
+static void bp_open(struct rsp_conn *conn)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+
+    memset(bc, 0, sizeof(*bc));
+}
+
+/* removes the breakpoints gdb removed but which are still in OpenOCD */
+static void bp_cleanup(struct rsp_conn *conn, struct bp_conn *bc)
+{
+    if (!bc->count) {
+        return;
+    }
+
+    uint32_t *addrs = malloc(bc->count * sizeof(uint32_t));
+    size_t count = 0;
+
+    if (!addrs) {
+        ESP_LOGW(TAG, "No memory to remove the breakpoints gdb left");
+        return;
+    }
+    for (size_t i = 0; i < bc->count; i++) {
+        if (bc->bps[i].in_target && !bc->bps[i].wanted) {
+            addrs[count++] = bc->bps[i].addr;
+        }
+    }
+    server_rsp_remove_bps(conn, addrs, count, "breakpoints gdb removed");
+    free(addrs);
+}
+
+static void bp_close(struct rsp_conn *conn)
+{
+    struct bp_conn *bc = &s_bp[server_rsp_index(conn)];
+
+    bp_cleanup(conn, bc);
+    free(bc->bps);
+    free(bc->held);
+    memset(bc, 0, sizeof(*bc));
+}
+
+bool server_bp_lookup(struct rsp_conn *conn, uint32_t addr, bool *wanted)
+{
+    struct bp_entry *bp = bp_find(&s_bp[server_rsp_index(conn)], addr);
+
+    if (!bp) {
+        return false;
+    }
+    *wanted = bp->wanted;
+    return true;
+}
+
+const struct rsp_feature server_bp_feature = {
+    .open = bp_open,
+    .close = bp_close,
+    .request = bp_request_hook,
+    .reply = bp_reply_hook,
+};
+
+static void server_bp_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "resumes", s_stats.resumes);
+    cJSON_AddNumberToObject(obj, "requested", s_stats.requested);
+    cJSON_AddNumberToObject(obj, "sent", s_stats.sent);
+    cJSON_AddNumberToObject(obj, "saved", s_stats.saved);
+    cJSON_AddNumberToObject(obj, "savedLastResume", s_stats.saved_last);
+    cJSON_AddNumberToObject(obj, "savedPerResume", s_stats.resumes ? (double)s_stats.saved / s_stats.resumes : 0);
+    cJSON_AddNumberToObject(obj, "removalsLastResume", s_stats.removals_last);
+}
+
+void server_bp_init(void)
+{
+    metrics_register("breakpoints", server_bp_metrics);
+}
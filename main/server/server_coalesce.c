@@ -0,0 +1,234 @@
+/*
+    Output aggregation of the debug server connections.
+
+    OpenOCD answers a command with several small writes (gdb ack + packet, telnet echo + log
+    lines + prompt, tcl result + terminator). They are collected into one buffer per connection
+    and sent together when OpenOCD waits for the next command (select or read on the connection),
+    when the buffer is full or, for long running commands, at the first write after the deadline
+    of the oldest buffered byte.
+
+    Buffers are only flushed from the OpenOCD task. The deadline timer runs in the esp_timer task,
+    which mustn't block on a socket, so it only wakes the server loop up.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "server_priv.h"
+#include "metrics.h"
+
+#define SERVER_COALESCE_SEND_RETRIES    100
+
+static const char *TAG = "server-coalesce";
+
+struct server_out {
+    int fd;                     /* -1 when the slot is not used */
+    uint8_t *buf;
+    size_t len;
+    int64_t first_us;           /* when the oldest buffered byte was written */
+    int err;                    /* errno of a failed flush, returned by the next write */
+    esp_timer_handle_t timer;   /* deadline of the buffered data */
+};
+
+static struct server_out s_out[SERVER_SHIM_MAX_CONNS];
+static SemaphoreHandle_t s_mutex;
+
+static struct {
+    uint32_t writes;
+    uint32_t flushes;
+    uint32_t deadline_flushes;
+    uint64_t hold_us;
+    uint32_t max_hold_us;
+} s_stats;
+
+static int server_coalesce_send_all(int fd, const uint8_t *data, size_t len)
+{
+    int retries = 0;
+
+    while (len > 0) {
+        ssize_t ret = __real_lwip_send(fd, data, len, 0);
+        if (ret < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && retries++ < SERVER_COALESCE_SEND_RETRIES) {
+                vTaskDelay(1);
+                continue;
+            }
+            return errno;
+        }
+        server_conn_count(fd, ret, false);
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void server_coalesce_flush_locked(struct server_out *out, bool deadline)
+{
+    if (out->len == 0) {
+        return;
+    }
+
+    esp_timer_stop(out->timer);
+
+    uint32_t hold_us = (uint32_t)(esp_timer_get_time() - out->first_us);
+    if (!out->err) {
+        out->err = server_coalesce_send_all(out->fd, out->buf, out->len);
+    }
+    out->len = 0;
+
+    s_stats.flushes++;
+    s_stats.hold_us += hold_us;
+    if (hold_us > s_stats.max_hold_us) {
+        s_stats.max_hold_us = hold_us;
+    }
+    if (deadline) {
+        s_stats.deadline_flushes++;
+    }
+}
+
+static void server_coalesce_deadline_cb(void *arg)
+{
+    /* the loop flushes every buffer before it waits again */
+    server_loop_wakeup();
+}
+
+ssize_t server_coalesce_write(int slot, int fd, const void *data, size_t size)
+{
+    struct server_out *out = &s_out[slot];
+    ssize_t ret = size;
+
+    if (out->fd < 0) {
+        /* the connection got no output buffer */
+        ret = __real_lwip_send(fd, data, size, 0);
+        server_conn_count(fd, ret, false);
+        return ret;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+
+    if (out->len && esp_timer_get_time() - out->first_us >= CONFIG_SERVER_COALESCE_DEADLINE_MS * 1000) {
+        server_coalesce_flush_locked(out, true);
+    } else if (out->len + size > CONFIG_SERVER_COALESCE_BUF_SIZE) {
+        server_coalesce_flush_locked(out, false);
+    }
+
+    if (!out->err) {
+        if (size >= CONFIG_SERVER_COALESCE_BUF_SIZE) {
+            /* large replies (memory reads) don't gain anything from a copy */
+            out->err = server_coalesce_send_all(out->fd, data, size);
+        } else {
+            if (out->len == 0) {
+                out->first_us = esp_timer_get_time();
+                esp_timer_start_once(out->timer, CONFIG_SERVER_COALESCE_DEADLINE_MS * 1000);
+            }
+            memcpy(out->buf + out->len, data, size);
+            out->len += size;
+            s_stats.writes++;
+        }
+    }
+
+    if (out->err) {
+        errno = out->err;
+        ret = -1;
+    }
+
+    xSemaphoreGive(s_mutex);
+
+    return ret;
+}
+
+void server_coalesce_flush(int slot)
+{
+    struct server_out *out = &s_out[slot];
+
+    /* called before every read, keep it cheap when there is nothing to send */
+    if (out->len == 0) {
+        return;
+    }
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    server_coalesce_flush_locked(out, false);
+    xSemaphoreGive(s_mutex);
+}
+
+void server_coalesce_flush_all(void)
+{
+    for (int i = 0; i < SERVER_SHIM_MAX_CONNS; i++) {
+        if (s_out[i].fd >= 0) {
+            server_coalesce_flush(i);
+        }
+    }
+}
+
+void server_coalesce_open(int slot, int fd)
+{
+    struct server_out *out = &s_out[slot];
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (!out->buf) {
+        /* buffers are kept after the connection is closed, the next client reuses them */
+        out->buf = malloc(CONFIG_SERVER_COALESCE_BUF_SIZE);
+    }
+    out->fd = out->buf ? fd : -1;
+    out->len = 0;
+    out->err = 0;
+    xSemaphoreGive(s_mutex);
+
+    if (out->fd < 0) {
+        ESP_LOGW(TAG, "No memory for the output buffer, writes of (%d) are not coalesced", fd);
+    }
+}
+
+void server_coalesce_close(int slot)
+{
+    struct server_out *out = &s_out[slot];
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    if (out->fd >= 0) {
+        server_coalesce_flush_locked(out, false);
+        out->fd = -1;
+    }
+    xSemaphoreGive(s_mutex);
+}
+
+static void server_coalesce_metrics(cJSON *obj)
+{
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    uint32_t writes = s_stats.writes;
+    uint32_t flushes = s_stats.flushes;
+    uint32_t deadline_flushes = s_stats.deadline_flushes;
+    uint64_t hold_us = s_stats.hold_us;
+    uint32_t max_hold_us = s_stats.max_hold_us;
+    xSemaphoreGive(s_mutex);
+
+    cJSON_AddNumberToObject(obj, "coalescedWrites", writes);
+    cJSON_AddNumberToObject(obj, "flushes", flushes);
+    cJSON_AddNumberToObject(obj, "framesSaved", writes > flushes ? writes - flushes : 0);
+    cJSON_AddNumberToObject(obj, "deadlineFlushes", deadline_flushes);
+    cJSON_AddNumberToObject(obj, "avgHoldUs", flushes ? (double)hold_us / flushes : 0);
+    cJSON_AddNumberToObject(obj, "maxHoldUs", max_hold_us);
+}
+
+void server_coalesce_init(void)
+{
+    s_mutex = xSemaphoreCreateMutex();
+    assert(s_mutex);
+
+    for (int i = 0; i < SERVER_SHIM_MAX_CONNS; i++) {
+        esp_timer_create_args_t args = {
+            .callback = server_coalesce_deadline_cb,
+            .arg = &s_out[i],
+            .name = "server_out",
+        };
+        s_out[i].fd = -1;
+        ESP_ERROR_CHECK(esp_timer_create(&args, &s_out[i].timer));
+    }
+
+    metrics_register("coalesce", server_coalesce_metrics);
+}
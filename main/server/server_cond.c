@@ -0,0 +1,791 @@
+/*
+    Breakpoint conditions of the gdb connections, evaluated here.
+
+    gdb evaluates the condition of a breakpoint itself: every hit is a stop reply over Wi-Fi, reads
+    of the registers and variables of the condition, and a continue. When the stub says it supports
+    ConditionalBreakpoints, gdb compiles the conditions to agent expressions (bytecode) and sends them
+    with the `Z0`/`Z1` packets. OpenOCD doesn't support them, so they are added to its qSupported
+    reply and stripped from the breakpoint packets before OpenOCD sees them.
+
+    The stop replies of a continue (SIGTRAP, no watchpoint) are held. The pc is read, and if the
+    target stopped at a breakpoint with conditions, they are evaluated with the registers and memory
+    read from OpenOCD, in the same select loop, without a round trip to gdb. If none is true, the
+    target is resumed with gdb's continue packet and gdb never sees the stop.
+
+    Fetches are asynchronous: the evaluation starts over once a register or memory value it needs
+    has been read, the values read since the stop are kept. The pc register is the candidate which
+    matches a breakpoint first.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+#define COND_MAX_CONDITIONS     4
+#define COND_MAX_BYTECODE       256
+#define COND_STACK_DEPTH        32
+#define COND_MAX_STEPS          1024
+#define COND_MAX_FETCHES        16
+#define COND_RATE_WINDOW_US     1000000
+
+static const char *TAG = "server-cond";
+
+/* gdb/common/ax.def */
+enum {
+    AX_ADD = 0x02,
+    AX_SUB = 0x03,
+    AX_MUL = 0x04,
+    AX_DIV_SIGNED = 0x05,
+    AX_DIV_UNSIGNED = 0x06,
+    AX_REM_SIGNED = 0x07,
+    AX_REM_UNSIGNED = 0x08,
+    AX_LSH = 0x09,
+    AX_RSH_SIGNED = 0x0a,
+    AX_RSH_UNSIGNED = 0x0b,
+    AX_LOG_NOT = 0x0e,
+    AX_BIT_AND = 0x0f,
+    AX_BIT_OR = 0x10,
+    AX_BIT_XOR = 0x11,
+    AX_BIT_NOT = 0x12,
+    AX_EQUAL = 0x13,
+    AX_LESS_SIGNED = 0x14,
+    AX_LESS_UNSIGNED = 0x15,
+    AX_EXT = 0x16,
+    AX_REF8 = 0x17,
+    AX_REF16 = 0x18,
+    AX_REF32 = 0x19,
+    AX_REF64 = 0x1a,
+    AX_IF_GOTO = 0x20,
+    AX_GOTO = 0x21,
+    AX_CONST8 = 0x22,
+    AX_CONST16 = 0x23,
+    AX_CONST32 = 0x24,
+    AX_CONST64 = 0x25,
+    AX_REG = 0x26,
+    AX_END = 0x27,
+    AX_DUP = 0x28,
+    AX_POP = 0x29,
+    AX_ZERO_EXT = 0x2a,
+    AX_SWAP = 0x2b,
+    AX_PICK = 0x32,
+    AX_ROT = 0x33,
+};
+
+typedef enum {
+    COND_FALSE,
+    COND_TRUE,
+    COND_FETCH,                         /* a value has to be read first */
+    COND_ERROR,                         /* unsupported or broken bytecode, the stop is reported */
+} cond_result_t;
+
+struct cond_expr {
+    uint8_t *code;
+    size_t len;
+};
+
+struct cond_bp {
+    char type;                          /* '0' software, '1' hardware, 0 when the slot is free */
+    uint32_t addr;
+    struct cond_expr conds[COND_MAX_CONDITIONS];
+    size_t cond_count;
+};
+
+struct cond_fetch {
+    bool reg;
+    uint32_t key;                       /* register number or address */
+    uint8_t size;
+    uint64_t value;
+};
+
+struct cond_conn {
+    struct cond_bp *bps;
+    bool conditional;                   /* a breakpoint has conditions */
+    char *resume;                       /* gdb's continue, sent again when no condition is true */
+    size_t resume_len;
+    char *stop;                         /* stop reply held while the conditions are evaluated */
+    size_t stop_len;
+    const struct cond_bp *hit;
+    int pc_try;                         /* candidate pc register being read */
+    struct cond_fetch fetches[COND_MAX_FETCHES];
+    size_t fetch_count;
+    struct cond_fetch want;             /* value the evaluation is waiting for */
+    int64_t stop_us;
+};
+
+static struct cond_conn s_cond[SERVER_SHIM_MAX_CONNS];
+
+static const int s_pc_regs[] = RSP_PC_REG_CANDIDATES;
+
+static struct {
+    uint32_t evaluations;
+    uint32_t resumed;                   /* hits no condition was true for */
+    uint32_t reported;
+    uint32_t errors;
+    uint32_t fetches;
+    int64_t window_start;
+    uint32_t window_evaluations;
+    double rate;
+    uint32_t max_decision_us;           /* from the stop to the resume or the report */
+} s_stats;
+
+static void cond_free_bp(struct cond_bp *bp)
+{
+    for (size_t i = 0; i < bp->cond_count; i++) {
+        free(bp->conds[i].code);
+    }
+    memset(bp, 0, sizeof(*bp));
+}
+
+static void cond_update_conditional(struct cond_conn *cc)
+{
+    cc->conditional = false;
+    for (size_t i = 0; cc->bps && i < CONFIG_SERVER_COND_MAX_BREAKPOINTS; i++) {
+        if (cc->bps[i].type && cc->bps[i].cond_count) {
+            cc->conditional = true;
+        }
+    }
+}
+
+static struct cond_bp *cond_find(struct cond_conn *cc, char type, uint32_t addr)
+{
+    for (size_t i = 0; cc->bps && i < CONFIG_SERVER_COND_MAX_BREAKPOINTS; i++) {
+        if (cc->bps[i].type == type && cc->bps[i].addr == addr) {
+            return &cc->bps[i];
+        }
+    }
+    return NULL;
+}
+
+static struct cond_bp *cond_add(struct cond_conn *cc, char type, uint32_t addr)
+{
+    if (!cc->bps) {
+        cc->bps = calloc(CONFIG_SERVER_COND_MAX_BREAKPOINTS, sizeof(*cc->bps));
+        if (!cc->bps) {
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < CONFIG_SERVER_COND_MAX_BREAKPOINTS; i++) {
+        if (!cc->bps[i].type) {
+            cc->bps[i].type = type;
+            cc->bps[i].addr = addr;
+            return &cc->bps[i];
+        }
+    }
+    return NULL;
+}
+
+/* the `;X<len>,<bytecode>` list of a Z packet, false if it can't be stored */
+static bool cond_parse_conditions(struct cond_bp *bp, const char *p, const char *end)
+{
+    while (p < end && *p == ';' && p + 1 < end && p[1] == 'X') {
+        p += 2;
+        uint32_t len = server_rsp_parse_hex(&p, end);
+        if (p == end || *p != ',' || !len || len > COND_MAX_BYTECODE || bp->cond_count == COND_MAX_CONDITIONS ||
+                (size_t)(end - p - 1) < len * 2) {
+            return false;
+        }
+        p++;
+
+        uint8_t *code = malloc(len);
+        if (!code) {
+            return false;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            const char *digit = p;
+            code[i] = server_rsp_parse_hex(&digit, p + 2);
+            p += 2;
+        }
+        bp->conds[bp->cond_count].code = code;
+        bp->conds[bp->cond_count].len = len;
+        bp->cond_count++;
+    }
+    return p == end;
+}
+
+/* Z0/Z1: the conditions are kept, OpenOCD gets the plain breakpoint once */
+static rsp_action_t cond_insert(struct rsp_conn *conn, struct cond_conn *cc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + 3;
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (p == end || *p != ',') {
+        return RSP_PASS;
+    }
+    p++;
+    server_rsp_parse_hex(&p, end);
+    const char *plain_end = p;
+
+    struct cond_bp *bp = cond_find(cc, pkt[1], addr);
+    bool inserted = bp != NULL;
+    if (bp) {
+        /* gdb sends the breakpoint again when its conditions change */
+        char type = bp->type;
+        cond_free_bp(bp);
+        bp->type = type;
+        bp->addr = addr;
+    } else {
+        bp = cond_add(cc, pkt[1], addr);
+    }
+
+    if (!bp) {
+        if (p == end) {
+            /* no room to track it, without conditions OpenOCD can have it anyway */
+            return RSP_PASS;
+        }
+        ESP_LOGW(TAG, "No room for the conditions of the breakpoint at 0x%" PRIx32, addr);
+        server_rsp_reply(conn, "E01", 3);
+        return RSP_DONE;
+    }
+
+    bool parsed = cond_parse_conditions(bp, p, end);
+    if (!parsed) {
+        /* the breakpoint stays as OpenOCD has it, without conditions */
+        char type = bp->type;
+        cond_free_bp(bp);
+        bp->type = inserted ? type : 0;
+        bp->addr = addr;
+        ESP_LOGW(TAG, "Can't keep the conditions of the breakpoint at 0x%" PRIx32, addr);
+    }
+    cond_update_conditional(cc);
+
+    if (!parsed) {
+        server_rsp_reply(conn, "E01", 3);
+    } else if (inserted) {
+        server_rsp_reply(conn, "OK", 2);
+    } else {
+        server_rsp_pass(conn, &server_cond_feature, pkt, plain_end - pkt);
+    }
+    return RSP_DONE;
+}
+
+static void cond_remove(struct cond_conn *cc, const char *pkt, size_t len)
+{
+    const char *p = pkt + 3;
+    uint32_t addr = server_rsp_parse_hex(&p, pkt + len);
+
+    struct cond_bp *bp = cond_find(cc, pkt[1], addr);
+    if (bp) {
+        cond_free_bp(bp);
+        cond_update_conditional(cc);
+    }
+}
+
+static bool cond_fetched(const struct cond_conn *cc, bool reg, uint32_t key, uint8_t size, uint64_t *value)
+{
+    for (size_t i = 0; i < cc->fetch_count; i++) {
+        const struct cond_fetch *f = &cc->fetches[i];
+        if (f->reg == reg && f->key == key && (reg || f->size == size)) {
+            *value = f->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t cond_sign_extend(uint64_t value, unsigned bits)
+{
+    if (bits >= 64) {
+        return value;
+    }
+    uint64_t sign = 1ULL << (bits - 1);
+    value &= (1ULL << bits) - 1;
+    return (value ^ sign) - sign;
+}
+
+static uint64_t cond_operand(const uint8_t *code, size_t *pc, size_t size)
+{
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        value = (value << 8) | code[(*pc)++];
+    }
+    return value;
+}
+
+static bool cond_is_binary(uint8_t op)
+{
+    return (op >= AX_ADD && op <= AX_RSH_UNSIGNED) || (op >= AX_BIT_AND && op <= AX_BIT_XOR) ||
+           op == AX_EQUAL || op == AX_LESS_SIGNED || op == AX_LESS_UNSIGNED;
+}
+
+/* `*a op b`, the operand below the top of the stack is the left one */
+static bool cond_binary(uint8_t op, uint64_t *a, uint64_t b)
+{
+    switch (op) {
+    case AX_ADD:
+        *a += b;
+        break;
+    case AX_SUB:
+        *a -= b;
+        break;
+    case AX_MUL:
+        *a *= b;
+        break;
+    case AX_DIV_SIGNED:
+    case AX_DIV_UNSIGNED:
+    case AX_REM_SIGNED:
+    case AX_REM_UNSIGNED:
+        if (!b) {
+            return false;
+        }
+        if (op == AX_DIV_SIGNED) {
+            *a = (int64_t)*a / (int64_t)b;
+        } else if (op == AX_DIV_UNSIGNED) {
+            *a /= b;
+        } else if (op == AX_REM_SIGNED) {
+            *a = (int64_t)*a % (int64_t)b;
+        } else {
+            *a %= b;
+        }
+        break;
+    case AX_LSH:
+        *a = b < 64 ? *a << b : 0;
+        break;
+    case AX_RSH_SIGNED:
+        *a = (int64_t)*a >> (b < 64 ? b : 63);
+        break;
+    case AX_RSH_UNSIGNED:
+        *a = b < 64 ? *a >> b : 0;
+        break;
+    case AX_BIT_AND:
+        *a &= b;
+        break;
+    case AX_BIT_OR:
+        *a |= b;
+        break;
+    case AX_BIT_XOR:
+        *a ^= b;
+        break;
+    case AX_EQUAL:
+        *a = *a == b;
+        break;
+    case AX_LESS_SIGNED:
+        *a = (int64_t)*a < (int64_t)b;
+        break;
+    case AX_LESS_UNSIGNED:
+        *a = *a < b;
+        break;
+    }
+    return true;
+}
+
+/* runs one expression, values gdb asks for that weren't read yet are put in cc->want */
+static cond_result_t cond_eval(struct cond_conn *cc, const struct cond_expr *expr)
+{
+    static const uint8_t operand_size[256] = {
+        [AX_EXT] = 1, [AX_ZERO_EXT] = 1, [AX_PICK] = 1, [AX_CONST8] = 1,
+        [AX_CONST16] = 2, [AX_IF_GOTO] = 2, [AX_GOTO] = 2, [AX_REG] = 2,
+        [AX_CONST32] = 4, [AX_CONST64] = 8,
+    };
+    uint64_t stack[COND_STACK_DEPTH];
+    size_t sp = 0;
+    size_t pc = 0;
+    const uint8_t *code = expr->code;
+
+    for (int steps = 0; steps < COND_MAX_STEPS; steps++) {
+        if (pc >= expr->len) {
+            return COND_ERROR;
+        }
+        uint8_t op = code[pc++];
+        if (pc + operand_size[op] > expr->len) {
+            return COND_ERROR;
+        }
+        uint64_t arg = cond_operand(code, &pc, operand_size[op]);
+
+        /* operands on the stack */
+        if (cond_is_binary(op) || op == AX_SWAP) {
+            if (sp < 2) {
+                return COND_ERROR;
+            }
+        } else if (op == AX_ROT) {
+            if (sp < 3) {
+                return COND_ERROR;
+            }
+        } else if (op == AX_LOG_NOT || op == AX_BIT_NOT || op == AX_EXT || op == AX_ZERO_EXT ||
+                   (op >= AX_REF8 && op <= AX_REF64) || op == AX_IF_GOTO || op == AX_END || op == AX_DUP ||
+                   op == AX_POP) {
+            if (sp < 1) {
+                return COND_ERROR;
+            }
+        }
+        if (sp >= COND_STACK_DEPTH - 1) {
+            return COND_ERROR;
+        }
+
+        uint64_t *top = sp ? &stack[sp - 1] : NULL;
+        uint64_t *next = sp > 1 ? &stack[sp - 2] : NULL;
+
+        if (cond_is_binary(op)) {
+            if (!cond_binary(op, next, *top)) {
+                return COND_ERROR;
+            }
+            sp--;
+            continue;
+        }
+
+        switch (op) {
+        case AX_LOG_NOT:
+            *top = !*top;
+            break;
+        case AX_BIT_NOT:
+            *top = ~*top;
+            break;
+        case AX_EXT:
+            if (!arg || arg > 64) {
+                return COND_ERROR;
+            }
+            *top = cond_sign_extend(*top, arg);
+            break;
+        case AX_ZERO_EXT:
+            if (arg < 64) {
+                *top &= (1ULL << arg) - 1;
+            }
+            break;
+        case AX_REF8:
+        case AX_REF16:
+        case AX_REF32:
+        case AX_REF64: {
+            uint8_t size = 1 << (op - AX_REF8);
+            if (!cond_fetched(cc, false, *top, size, top)) {
+                cc->want = (struct cond_fetch) { .reg = false, .key = *top, .size = size };
+                return COND_FETCH;
+            }
+            break;
+        }
+        case AX_IF_GOTO:
+            if (stack[--sp]) {
+                pc = arg;
+            }
+            break;
+        case AX_GOTO:
+            pc = arg;
+            break;
+        case AX_CONST8:
+        case AX_CONST16:
+        case AX_CONST32:
+        case AX_CONST64:
+            stack[sp++] = arg;
+            break;
+        case AX_REG:
+            if (!cond_fetched(cc, true, arg, 0, &stack[sp])) {
+                cc->want = (struct cond_fetch) { .reg = true, .key = arg };
+                return COND_FETCH;
+            }
+            sp++;
+            break;
+        case AX_END:
+            return *top ? COND_TRUE : COND_FALSE;
+        case AX_DUP:
+            stack[sp] = *top;
+            sp++;
+            break;
+        case AX_POP:
+            sp--;
+            break;
+        case AX_SWAP: {
+            uint64_t tmp = *top;
+            *top = *next;
+            *next = tmp;
+            break;
+        }
+        case AX_PICK:
+            if (arg >= sp) {
+                return COND_ERROR;
+            }
+            stack[sp] = stack[sp - 1 - arg];
+            sp++;
+            break;
+        case AX_ROT: {
+            /* a b c -> c a b */
+            uint64_t c = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = stack[sp - 3];
+            stack[sp - 3] = c;
+            break;
+        }
+        default:
+            /* floats, tracing and printf have no place in a condition */
+            return COND_ERROR;
+        }
+    }
+    return COND_ERROR;
+}
+
+static void cond_count_evaluation(const struct cond_conn *cc)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t us = now - cc->stop_us;
+
+    s_stats.evaluations++;
+    if (us > s_stats.max_decision_us) {
+        s_stats.max_decision_us = us;
+    }
+    if (!s_stats.window_start) {
+        s_stats.window_start = now;
+        s_stats.window_evaluations = s_stats.evaluations - 1;
+    } else if (now - s_stats.window_start >= COND_RATE_WINDOW_US) {
+        s_stats.rate = (double)(s_stats.evaluations - s_stats.window_evaluations) * 1000000 /
+                       (now - s_stats.window_start);
+        s_stats.window_start = now;
+        s_stats.window_evaluations = s_stats.evaluations;
+    }
+}
+
+static void cond_report(struct rsp_conn *conn, struct cond_conn *cc)
+{
+    char *stop = cc->stop;
+    size_t stop_len = cc->stop_len;
+
+    cc->stop = NULL;
+    cc->hit = NULL;
+    server_rsp_release(conn, &server_cond_feature, cc->resume, cc->resume_len, stop, stop_len);
+    free(stop);
+}
+
+static void cond_resumed_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+static void cond_fetch_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+
+static void cond_run(struct rsp_conn *conn, struct cond_conn *cc)
+{
+    cond_result_t result = COND_FALSE;
+
+    /* the breakpoint is reported if any of its conditions is true */
+    for (size_t i = 0; i < cc->hit->cond_count && result == COND_FALSE; i++) {
+        result = cond_eval(cc, &cc->hit->conds[i]);
+    }
+
+    if (result == COND_FETCH && cc->fetch_count < COND_MAX_FETCHES) {
+        char req[32];
+        int n = cc->want.reg ? snprintf(req, sizeof(req), "p%" PRIx32, cc->want.key) :
+                snprintf(req, sizeof(req), "m%" PRIx32 ",%x", cc->want.key, cc->want.size);
+        if (server_rsp_request(conn, req, n, cond_fetch_cb, NULL) == ESP_OK) {
+            s_stats.fetches++;
+            return;
+        }
+    }
+
+    cond_count_evaluation(cc);
+    if (result == COND_FALSE) {
+        free(cc->stop);
+        cc->stop = NULL;
+        cc->hit = NULL;
+        if (server_rsp_request(conn, cc->resume, cc->resume_len, cond_resumed_cb, NULL) == ESP_OK) {
+            s_stats.resumed++;
+            return;
+        }
+    } else if (result != COND_TRUE) {
+        s_stats.errors++;
+    }
+    s_stats.reported++;
+    cond_report(conn, cc);
+}
+
+/* target byte order, little endian on every Espressif chip */
+static uint64_t cond_parse_le(const char *hex, size_t len)
+{
+    uint64_t value = 0;
+
+    for (size_t i = 0; i + 2 <= len && i < 16; i += 2) {
+        const char *digit = hex + i;
+        value |= (uint64_t)server_rsp_parse_hex(&digit, hex + i + 2) << (i * 4);
+    }
+    return value;
+}
+
+static void cond_fetch_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    if (!cc->stop) {
+        return;
+    }
+    if (!reply || !len || reply[0] == 'E' || (!cc->want.reg && len != cc->want.size * 2u)) {
+        s_stats.errors++;
+        s_stats.reported++;
+        cond_report(conn, cc);
+        return;
+    }
+
+    cc->want.value = cond_parse_le(reply, len);
+    cc->fetches[cc->fetch_count++] = cc->want;
+    cond_run(conn, cc);
+}
+
+static void cond_pc_request(struct rsp_conn *conn, struct cond_conn *cc);
+
+static void cond_pc_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+    int reg = (int)(intptr_t)arg;
+
+    if (!cc->stop) {
+        return;
+    }
+    if (reply && len && reply[0] != 'E') {
+        uint32_t pc = cond_parse_le(reply, len);
+        for (size_t i = 0; cc->bps && i < CONFIG_SERVER_COND_MAX_BREAKPOINTS; i++) {
+            const struct cond_bp *bp = &cc->bps[i];
+            if (bp->type && bp->cond_count && bp->addr == pc) {
+                server_rsp_set_pc_reg(reg);
+                cc->hit = bp;
+                cc->fetches[0] = (struct cond_fetch) { .reg = true, .key = reg, .value = pc };
+                cc->fetch_count = 1;
+                cond_run(conn, cc);
+                return;
+            }
+        }
+    }
+
+    /* not a conditional breakpoint, or not the pc */
+    if (server_rsp_pc_reg() < 0 && ++cc->pc_try < (int)(sizeof(s_pc_regs) / sizeof(s_pc_regs[0]))) {
+        cond_pc_request(conn, cc);
+        return;
+    }
+    cond_report(conn, cc);
+}
+
+static void cond_pc_request(struct rsp_conn *conn, struct cond_conn *cc)
+{
+    int reg = server_rsp_pc_reg() >= 0 ? server_rsp_pc_reg() : s_pc_regs[cc->pc_try];
+    char req[16];
+    int n = snprintf(req, sizeof(req), "p%x", reg);
+
+    if (server_rsp_request(conn, req, n, cond_pc_cb, (void *)(intptr_t)reg) != ESP_OK) {
+        cond_report(conn, cc);
+    }
+}
+
+static void cond_check(struct rsp_conn *conn, struct cond_conn *cc, const char *pkt, size_t len)
+{
+    cc->stop = server_rsp_dup(pkt, len);
+    if (!cc->stop) {
+        server_rsp_release(conn, &server_cond_feature, cc->resume, cc->resume_len, pkt, len);
+        return;
+    }
+    cc->stop_len = len;
+    cc->stop_us = esp_timer_get_time();
+    cc->pc_try = 0;
+    cc->fetch_count = 0;
+    cond_pc_request(conn, cc);
+}
+
+/* reply of OpenOCD to the continue sent after a false condition */
+static void cond_resumed_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    if (!reply) {
+        return;
+    }
+    if (cc->conditional && server_rsp_is_break(reply, len)) {
+        cond_check(conn, cc, reply, len);
+        return;
+    }
+    server_rsp_release(conn, &server_cond_feature, cc->resume, cc->resume_len, reply, len);
+}
+
+/* adds ConditionalBreakpoints+ to OpenOCD's features */
+static void cond_supported(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt, size_t len)
+{
+    static const char feature[] = ";ConditionalBreakpoints+";
+    char *reply = malloc(len + sizeof(feature));
+
+    if (!reply) {
+        server_rsp_release(conn, &server_cond_feature, req, req_len, pkt, len);
+        return;
+    }
+    memcpy(reply, pkt, len);
+    memcpy(reply + len, feature, sizeof(feature));
+    server_rsp_release(conn, &server_cond_feature, req, req_len, reply, len + sizeof(feature) - 1);
+    free(reply);
+}
+
+static rsp_action_t cond_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    if (len > 3 && (pkt[0] == 'Z' || pkt[0] == 'z') && (pkt[1] == '0' || pkt[1] == '1') && pkt[2] == ',') {
+        if (pkt[0] == 'Z') {
+            return cond_insert(conn, cc, pkt, len);
+        }
+        cond_remove(cc, pkt, len);
+        return RSP_PASS;
+    }
+    if (server_rsp_is_resume(pkt, len) && !server_rsp_is_step(pkt, len)) {
+        free(cc->resume);
+        cc->resume = server_rsp_dup(pkt, len);
+        cc->resume_len = cc->resume ? len : 0;
+    }
+    return RSP_PASS;
+}
+
+static rsp_action_t cond_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                    size_t len)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    if (server_rsp_starts_with(req, req_len, "qSupported") && len && pkt[0] != 'E') {
+        cond_supported(conn, req, req_len, pkt, len);
+        return RSP_DONE;
+    }
+    if (!cc->conditional || !cc->resume || !server_rsp_is_resume(req, req_len) || server_rsp_is_step(req, req_len) ||
+            !server_rsp_is_break(pkt, len)) {
+        return RSP_PASS;
+    }
+    cond_check(conn, cc, pkt, len);
+    return RSP_DONE;
+}
+
+static void cond_open(struct rsp_conn *conn)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    memset(cc, 0, sizeof(*cc));
+}
+
+static void cond_close(struct rsp_conn *conn)
+{
+    struct cond_conn *cc = &s_cond[server_rsp_index(conn)];
+
+    for (size_t i = 0; cc->bps && i < CONFIG_SERVER_COND_MAX_BREAKPOINTS; i++) {
+        cond_free_bp(&cc->bps[i]);
+    }
+    free(cc->bps);
+    free(cc->resume);
+    free(cc->stop);
+    memset(cc, 0, sizeof(*cc));
+}
+
+const struct rsp_feature server_cond_feature = {
+    .open = cond_open,
+    .close = cond_close,
+    .request = cond_request_hook,
+    .reply = cond_reply_hook,
+};
+
+static void server_cond_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "evaluations", s_stats.evaluations);
+    /* the rate is updated by the evaluations, it is stale once they stop */
+    bool recent = esp_timer_get_time() - s_stats.window_start < 2 * COND_RATE_WINDOW_US;
+    cJSON_AddNumberToObject(obj, "evaluationsPerSecond", recent ? s_stats.rate : 0);
+    cJSON_AddNumberToObject(obj, "resumed", s_stats.resumed);
+    cJSON_AddNumberToObject(obj, "reported", s_stats.reported);
+    cJSON_AddNumberToObject(obj, "errors", s_stats.errors);
+    cJSON_AddNumberToObject(obj, "fetches", s_stats.fetches);
+    cJSON_AddNumberToObject(obj, "maxDecisionUs", s_stats.max_decision_us);
+}
+
+void server_cond_init(void)
+{
+    metrics_register("cond", server_cond_metrics);
+}
@@ -0,0 +1,394 @@
+/*
+    Flash image staging of gdb's `load`.
+
+    gdb loads an image as vFlashErase packets, many vFlashWrite packets of at most PacketSize, then
+    vFlashDone. OpenOCD only keeps the writes in its image buffer and programs the flash at vFlashDone,
+    but each packet waits for its turn in OpenOCD's loop before gdb sends the next one.
+
+    Here the writes are answered at once and kept in PSRAM, so gdb streams the image at the speed of
+    the network. Writes to the same or adjacent sectors are merged into one region, gaps in a sector
+    are filled with 0xff (gdb erased it, programming 0xff leaves erased flash as it is), and later
+    writes replace earlier ones. When vFlashDone arrives the regions are sent to OpenOCD in large
+    writes, one after the other, then vFlashDone itself. The flasher stub still gets the data
+    compressed, by OpenOCD's flash driver.
+
+    If the image doesn't fit in SERVER_FLASH_STAGE_KB, what is staged is sent and the rest of the
+    load goes to OpenOCD packet by packet. The load time and rate are logged and reported.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+#define STAGE_SECTOR_SIZE       4096
+#define STAGE_SECTOR_DOWN(a)    ((a) & ~(STAGE_SECTOR_SIZE - 1))
+#define STAGE_SECTOR_UP(a)      STAGE_SECTOR_DOWN((a) + STAGE_SECTOR_SIZE - 1)
+/* raw bytes per vFlashWrite to OpenOCD, escaped they stay below its 16 KB packet buffer */
+#define STAGE_CHUNK             7168
+#define STAGE_MAX_REGIONS       64
+
+static const char *TAG = "server-flash";
+
+struct stage_region {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *data;
+};
+
+struct stage_conn {
+    struct stage_region regions[STAGE_MAX_REGIONS];
+    size_t count;
+    size_t staged;                      /* bytes of the regions */
+    bool loading;                       /* between the first vFlash packet and vFlashDone */
+    bool bypass;                        /* the image didn't fit, the rest goes to OpenOCD */
+    char *held;                         /* client packet sent on after the regions */
+    size_t held_len;
+    bool failed;                        /* OpenOCD refused a write */
+    size_t send_region;
+    uint32_t send_off;
+    char *send_buf;
+    uint32_t received;                  /* bytes of gdb's writes */
+    int64_t start_us;
+    int64_t done_us;                    /* vFlashDone received */
+};
+
+static struct stage_conn s_stage[SERVER_SHIM_MAX_CONNS];
+
+static struct {
+    uint32_t loads;
+    uint32_t writes;                    /* vFlashWrite of gdb */
+    uint32_t sent;                      /* vFlashWrite to OpenOCD */
+    uint32_t overflows;
+    uint32_t last_bytes;
+    double last_kbps;                   /* from the first vFlash packet to the reply of vFlashDone */
+    double last_receive_kbps;           /* to vFlashDone */
+    uint32_t last_program_ms;           /* from vFlashDone to its reply */
+    size_t peak_staged;
+} s_stats;
+
+static uint8_t *stage_alloc(uint8_t *data, size_t size)
+{
+    /* the image is kept in PSRAM, internal RAM is for Wi-Fi and the JTAG buffers */
+    uint8_t *mem = heap_caps_realloc(data, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    return mem ? mem : realloc(data, size);
+}
+
+static void stage_free(struct stage_conn *sc)
+{
+    for (size_t i = 0; i < sc->count; i++) {
+        free(sc->regions[i].data);
+    }
+    sc->count = 0;
+    sc->staged = 0;
+}
+
+/* region `i` covers [lo, hi), its new bytes are erased flash */
+static bool stage_grow(struct stage_conn *sc, size_t i, uint32_t lo, uint32_t hi)
+{
+    struct stage_region *r = &sc->regions[i];
+    uint32_t len = hi - lo;
+    uint32_t shift = r->addr - lo;
+
+    if (sc->staged + len - r->len > CONFIG_SERVER_FLASH_STAGE_KB * 1024) {
+        return false;
+    }
+    if (len > r->cap) {
+        uint32_t cap = r->cap ? r->cap : STAGE_SECTOR_SIZE;
+        while (cap < len) {
+            cap *= 2;
+        }
+        uint8_t *data = stage_alloc(r->data, cap);
+        if (!data) {
+            return false;
+        }
+        r->data = data;
+        r->cap = cap;
+    }
+    if (shift) {
+        memmove(r->data + shift, r->data, r->len);
+        memset(r->data, 0xff, shift);
+    }
+    memset(r->data + shift + r->len, 0xff, len - shift - r->len);
+    sc->staged += len - r->len;
+    r->addr = lo;
+    r->len = len;
+    return true;
+}
+
+/* regions are sorted, two of them never share a sector */
+static bool stage_add(struct stage_conn *sc, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    uint32_t end = addr + len;
+    size_t i = 0;
+
+    while (i < sc->count && STAGE_SECTOR_UP(sc->regions[i].addr + sc->regions[i].len) < addr) {
+        i++;
+    }
+    size_t j = i;
+    while (j < sc->count && STAGE_SECTOR_DOWN(sc->regions[j].addr) <= end) {
+        j++;
+    }
+
+    if (i == j) {
+        if (sc->count == STAGE_MAX_REGIONS) {
+            return false;
+        }
+        memmove(&sc->regions[i + 1], &sc->regions[i], (sc->count - i) * sizeof(sc->regions[0]));
+        sc->regions[i] = (struct stage_region) {
+            .addr = addr,
+        };
+        sc->count++;
+        j = i + 1;
+    }
+
+    /* regions i..j-1 become one */
+    struct stage_region *first = &sc->regions[i];
+    struct stage_region *last = &sc->regions[j - 1];
+    uint32_t lo = addr < first->addr ? addr : first->addr;
+    uint32_t hi = end > last->addr + last->len ? end : last->addr + last->len;
+    if (!stage_grow(sc, i, lo, hi)) {
+        if (!first->len) {
+            memmove(first, first + 1, (sc->count - i - 1) * sizeof(sc->regions[0]));
+            sc->count--;
+        }
+        return false;
+    }
+    for (size_t k = i + 1; k < j; k++) {
+        struct stage_region *r = &sc->regions[k];
+        memcpy(first->data + (r->addr - lo), r->data, r->len);
+        sc->staged -= r->len;
+        free(r->data);
+    }
+    memmove(&sc->regions[i + 1], &sc->regions[j], (sc->count - j) * sizeof(sc->regions[0]));
+    sc->count -= j - i - 1;
+
+    memcpy(first->data + (addr - lo), data, len);
+    if (sc->staged > s_stats.peak_staged) {
+        s_stats.peak_staged = sc->staged;
+    }
+    return true;
+}
+
+static void stage_send_next(struct rsp_conn *conn, struct stage_conn *sc);
+
+static void stage_sent_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct stage_conn *sc = &s_stage[server_rsp_index(conn)];
+
+    if (!reply) {
+        return;
+    }
+    if (len != 2 || memcmp(reply, "OK", 2)) {
+        ESP_LOGE(TAG, "OpenOCD refused the flash write (%.*s)", (int)len, reply);
+        sc->failed = true;
+    }
+    stage_send_next(conn, sc);
+}
+
+/* the regions go to OpenOCD one write at a time, then the held packet */
+static void stage_send_next(struct rsp_conn *conn, struct stage_conn *sc)
+{
+    while (!sc->failed && sc->send_region < sc->count) {
+        const struct stage_region *r = &sc->regions[sc->send_region];
+        if (sc->send_off >= r->len) {
+            sc->send_region++;
+            sc->send_off = 0;
+            continue;
+        }
+
+        uint32_t count = r->len - sc->send_off < STAGE_CHUNK ? r->len - sc->send_off : STAGE_CHUNK;
+        int n = sprintf(sc->send_buf, "vFlashWrite:%" PRIx32 ":", r->addr + sc->send_off);
+        n += server_rsp_escape(r->data + sc->send_off, count, sc->send_buf + n);
+        sc->send_off += count;
+        if (server_rsp_request(conn, sc->send_buf, n, stage_sent_cb, NULL) != ESP_OK) {
+            sc->failed = true;
+            break;
+        }
+        s_stats.sent++;
+        return;
+    }
+
+    char *held = sc->held;
+    size_t held_len = sc->held_len;
+    bool failed = sc->failed;
+
+    sc->held = NULL;
+    sc->failed = false;
+    free(sc->send_buf);
+    sc->send_buf = NULL;
+    stage_free(sc);
+    if (failed && server_rsp_starts_with(held, held_len, "vFlash")) {
+        /* gdb's load fails as it would have with the write */
+        server_rsp_reply(conn, "E01", 3);
+        sc->loading = false;
+    } else {
+        server_rsp_pass(conn, &server_flash_feature, held, held_len);
+    }
+    free(held);
+}
+
+/* sends what is staged, then `pkt` */
+static rsp_action_t stage_flush(struct rsp_conn *conn, struct stage_conn *sc, const char *pkt, size_t len)
+{
+    if (!sc->count) {
+        return RSP_PASS;
+    }
+    sc->held = server_rsp_dup(pkt, len);
+    sc->send_buf = malloc(STAGE_CHUNK * 2 + 32);
+    if (!sc->held || !sc->send_buf) {
+        ESP_LOGE(TAG, "No memory to send the staged image, dropped");
+        free(sc->held);
+        sc->held = NULL;
+        free(sc->send_buf);
+        sc->send_buf = NULL;
+        stage_free(sc);
+        server_rsp_reply(conn, "E01", 3);
+        return RSP_DONE;
+    }
+    sc->held_len = len;
+    sc->send_region = 0;
+    sc->send_off = 0;
+    stage_send_next(conn, sc);
+    return RSP_DONE;
+}
+
+static void stage_begin(struct stage_conn *sc)
+{
+    if (!sc->loading) {
+        sc->loading = true;
+        sc->bypass = false;
+        sc->received = 0;
+        sc->start_us = esp_timer_get_time();
+    }
+}
+
+/* vFlashWrite:<addr>:<binary> */
+static rsp_action_t stage_write(struct rsp_conn *conn, struct stage_conn *sc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("vFlashWrite:");
+
+    stage_begin(sc);
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (p == end || *p++ != ':') {
+        return RSP_PASS;
+    }
+    s_stats.writes++;
+    if (sc->bypass) {
+        sc->received += end - p;
+        return RSP_PASS;
+    }
+
+    /* the unescaped data is never longer than the packet's */
+    uint8_t *data = malloc(end - p);
+    if (data) {
+        size_t n = server_rsp_unescape(p, end - p, data);
+        bool staged = stage_add(sc, addr, data, n);
+        sc->received += n;
+        free(data);
+        if (staged) {
+            server_rsp_reply(conn, "OK", 2);
+            return RSP_DONE;
+        }
+    }
+
+    ESP_LOGW(TAG, "image larger than the staging area, the rest of the load isn't staged");
+    s_stats.overflows++;
+    sc->bypass = true;
+    return stage_flush(conn, sc, pkt, len);
+}
+
+static rsp_action_t stage_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct stage_conn *sc = &s_stage[server_rsp_index(conn)];
+
+    if (server_rsp_starts_with(pkt, len, "vFlashWrite:")) {
+        return stage_write(conn, sc, pkt, len);
+    }
+    if (server_rsp_starts_with(pkt, len, "vFlashErase:")) {
+        /* OpenOCD erases right away, the writes are programmed at vFlashDone, the order doesn't matter */
+        stage_begin(sc);
+        return RSP_PASS;
+    }
+    if (server_rsp_starts_with(pkt, len, "vFlashDone")) {
+        sc->done_us = esp_timer_get_time();
+    }
+    return stage_flush(conn, sc, pkt, len);
+}
+
+static rsp_action_t stage_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                     size_t len)
+{
+    struct stage_conn *sc = &s_stage[server_rsp_index(conn)];
+
+    if (!sc->loading || !server_rsp_starts_with(req, req_len, "vFlashDone")) {
+        return RSP_PASS;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t total_us = now - sc->start_us;
+    int64_t receive_us = sc->done_us - sc->start_us;
+
+    sc->loading = false;
+    s_stats.loads++;
+    s_stats.last_bytes = sc->received;
+    s_stats.last_kbps = total_us > 0 ? (double)sc->received * 1000000 / 1024 / total_us : 0;
+    s_stats.last_receive_kbps = receive_us > 0 ? (double)sc->received * 1000000 / 1024 / receive_us : 0;
+    s_stats.last_program_ms = (now - sc->done_us) / 1000;
+    ESP_LOGI(TAG, "load of %" PRIu32 " KB in %" PRIu32 " ms, %.1f KB/s (received at %.1f KB/s)",
+             sc->received / 1024, (uint32_t)(total_us / 1000), s_stats.last_kbps, s_stats.last_receive_kbps);
+    return RSP_PASS;
+}
+
+static void stage_open(struct rsp_conn *conn)
+{
+    struct stage_conn *sc = &s_stage[server_rsp_index(conn)];
+
+    memset(sc, 0, sizeof(*sc));
+}
+
+static void stage_close(struct rsp_conn *conn)
+{
+    struct stage_conn *sc = &s_stage[server_rsp_index(conn)];
+
+    stage_free(sc);
+    free(sc->held);
+    free(sc->send_buf);
+    memset(sc, 0, sizeof(*sc));
+}
+
+const struct rsp_feature server_flash_feature = {
+    .open = stage_open,
+    .close = stage_close,
+    .request = stage_request_hook,
+    .reply = stage_reply_hook,
+};
+
+static void server_flash_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "loads", s_stats.loads);
+    cJSON_AddNumberToObject(obj, "writesReceived", s_stats.writes);
+    cJSON_AddNumberToObject(obj, "writesSent", s_stats.sent);
+    cJSON_AddNumberToObject(obj, "overflows", s_stats.overflows);
+    cJSON_AddNumberToObject(obj, "peakStagedKB", s_stats.peak_staged / 1024);
+    cJSON_AddNumberToObject(obj, "lastLoadBytes", s_stats.last_bytes);
+    cJSON_AddNumberToObject(obj, "lastLoadKBps", s_stats.last_kbps);
+    cJSON_AddNumberToObject(obj, "lastReceiveKBps", s_stats.last_receive_kbps);
+    cJSON_AddNumberToObject(obj, "lastProgramMs", s_stats.last_program_ms);
+}
+
+void server_flash_init(void)
+{
+    metrics_register("flashLoad", server_flash_metrics);
+}
@@ -0,0 +1,191 @@
+/*
+    Wait of OpenOCD's server loop.
+
+    OpenOCD's server_loop() sleeps in select() until a socket is readable or its next timer
+    (target polling) is due. The select call of the OpenOCD task is extended with:
+
+    - a loopback wakeup socket, so the application can make OpenOCD run its timers right away
+      instead of waiting for the timeout (server_loop_wakeup)
+    - a longer timeout while no remote client is connected, so an unattended debugger doesn't
+      wake up every polling period. Sockets still wake it up immediately.
+    - wakeup statistics, including how late the timer wakeups are
+*/
+#include <string.h>
+#include <sys/param.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "server_priv.h"
+#include "metrics.h"
+
+static const char *TAG = "server-loop";
+
+static TaskHandle_t s_loop_task;
+static int s_wake_fd = -1;
+static struct sockaddr_in s_wake_addr;
+static bool s_wake_pending;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+    uint32_t selects;
+    uint32_t socket_wakeups;
+    uint32_t timer_wakeups;
+    uint32_t idle_timer_wakeups;
+    uint32_t internal_wakeups;
+    uint32_t stretched_waits;
+    uint64_t overshoot_us;
+    uint32_t max_overshoot_us;
+} s_stats;
+
+static void server_loop_drain_wakeup(void)
+{
+    char buf[8];
+
+    portENTER_CRITICAL(&s_lock);
+    s_wake_pending = false;
+    portEXIT_CRITICAL(&s_lock);
+
+    while (__real_lwip_recv(s_wake_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+}
+
+void server_loop_wakeup(void)
+{
+    if (s_wake_fd < 0) {
+        return;
+    }
+
+    /* one datagram is enough to wake the loop up, don't queue more */
+    portENTER_CRITICAL(&s_lock);
+    bool pending = s_wake_pending;
+    s_wake_pending = true;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (!pending) {
+        lwip_sendto(s_wake_fd, "w", 1, 0, (struct sockaddr *)&s_wake_addr, sizeof(s_wake_addr));
+    }
+}
+
+int server_loop_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
+                       struct timeval *timeout)
+{
+    struct timeval tv;
+    bool idle = !server_shim_has_remote_clients();
+
+    if (timeout && idle) {
+        int64_t requested_ms = (int64_t)timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+        if (requested_ms < CONFIG_SERVER_LOOP_IDLE_TIMEOUT_MS) {
+            tv.tv_sec = CONFIG_SERVER_LOOP_IDLE_TIMEOUT_MS / 1000;
+            tv.tv_usec = (CONFIG_SERVER_LOOP_IDLE_TIMEOUT_MS % 1000) * 1000;
+            timeout = &tv;
+            s_stats.stretched_waits++;
+        }
+    }
+
+    /* a gdb packet may be waiting for OpenOCD in the interposer while the socket is empty */
+    fd_set want;
+    if (readset) {
+        want = *readset;
+        if (server_rsp_select_pending(&want)) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            timeout = &tv;
+        }
+    }
+
+    bool wake = readset && s_wake_fd >= 0;
+    if (wake) {
+        FD_SET(s_wake_fd, readset);
+        maxfdp1 = MAX(maxfdp1, s_wake_fd + 1);
+    }
+
+    int64_t start = esp_timer_get_time();
+    int ret = __real_lwip_select(maxfdp1, readset, writeset, exceptset, timeout);
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    s_stats.selects++;
+
+    if (readset) {
+        ret = server_rsp_select_done(&want, readset, ret);
+    }
+
+    if (wake && ret > 0 && FD_ISSET(s_wake_fd, readset)) {
+        FD_CLR(s_wake_fd, readset);
+        server_loop_drain_wakeup();
+        s_stats.internal_wakeups++;
+        /* nothing else is ready, OpenOCD handles it as a timeout and runs its timers */
+        ret--;
+    } else if (ret > 0) {
+        s_stats.socket_wakeups++;
+    } else if (ret == 0 && timeout) {
+        int64_t overshoot = elapsed - ((int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec);
+        if (overshoot < 0) {
+            overshoot = 0;
+        }
+        s_stats.timer_wakeups++;
+        if (idle) {
+            s_stats.idle_timer_wakeups++;
+        }
+        s_stats.overshoot_us += overshoot;
+        if (overshoot > s_stats.max_overshoot_us) {
+            s_stats.max_overshoot_us = overshoot;
+        }
+    }
+
+    return ret;
+}
+
+bool server_loop_is_loop_task(void)
+{
+    return s_loop_task && xTaskGetCurrentTaskHandle() == s_loop_task;
+}
+
+static void server_loop_metrics(cJSON *obj)
+{
+    /* counters are only written by the loop task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "selects", s_stats.selects);
+    cJSON_AddNumberToObject(obj, "socketWakeups", s_stats.socket_wakeups);
+    cJSON_AddNumberToObject(obj, "timerWakeups", s_stats.timer_wakeups);
+    cJSON_AddNumberToObject(obj, "idleTimerWakeups", s_stats.idle_timer_wakeups);
+    cJSON_AddNumberToObject(obj, "internalWakeups", s_stats.internal_wakeups);
+    cJSON_AddNumberToObject(obj, "stretchedWaits", s_stats.stretched_waits);
+    cJSON_AddNumberToObject(obj, "avgTimerOvershootUs",
+                            s_stats.timer_wakeups ? (double)s_stats.overshoot_us / s_stats.timer_wakeups : 0);
+    cJSON_AddNumberToObject(obj, "maxTimerOvershootUs", s_stats.max_overshoot_us);
+}
+
+void server_loop_attach(void)
+{
+    s_loop_task = xTaskGetCurrentTaskHandle();
+
+    if (s_wake_fd >= 0) {
+        return;
+    }
+
+    int fd = lwip_socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        ESP_LOGW(TAG, "Failed to create the wakeup socket (%d)", errno);
+        return;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t len = sizeof(addr);
+    if (lwip_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            lwip_getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        ESP_LOGW(TAG, "Failed to bind the wakeup socket (%d)", errno);
+        __real_lwip_close(fd);
+        return;
+    }
+
+    s_wake_addr = addr;
+    s_wake_fd = fd;
+
+    metrics_register("loop", server_loop_metrics);
+}
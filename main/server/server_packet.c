@@ -0,0 +1,402 @@
+/*
+    Large gdb packets.
+
+    gdb sizes its memory reads and writes by the PacketSize of the qSupported reply. OpenOCD gives
+    the size of its 16 KB packet buffer, so a dump of 1 MB is 128 `m` round trips over Wi-Fi, where
+    the latency is paid for each one. Here gdb is told SERVER_PACKET_SIZE instead and the packets
+    larger than OpenOCD takes are split:
+
+    - `m` and `x` are read in chunks and the replies joined. A failure after the first chunk ends
+      the reply early, gdb asks again for the rest and gets the error then.
+    - `X` and `vFlashWrite` are unescaped and written in chunks, the first error is the reply.
+
+    The chunks go to OpenOCD back to back inside the debugger, only gdb's packet crosses the
+    network. The features before this one see gdb's packets and the joined replies. The buffers are
+    in PSRAM, allocated on the first large packet of a connection and kept until it closes.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+/* room for the command and the address of a chunk in OpenOCD's buffer */
+#define PACKET_HEADROOM         64
+
+static const char *TAG = "server-packet";
+
+typedef enum {
+    PACKET_IDLE,
+    PACKET_READ_HEX,            /* m */
+    PACKET_READ_BINARY,         /* x */
+    PACKET_WRITE_MEMORY,        /* X */
+    PACKET_WRITE_FLASH,         /* vFlashWrite */
+} packet_op_t;
+
+struct packet_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct packet_conn {
+    uint32_t oocd_size;                 /* OpenOCD's PacketSize, 0 until its qSupported reply */
+    packet_op_t op;
+    char req[RSP_REQ_HEAD_SIZE];        /* gdb's packet, the joined reply goes to it */
+    size_t req_len;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t off;                       /* bytes read or written */
+    uint32_t chunk;                     /* bytes of the chunk OpenOCD has */
+    struct packet_buf reply;            /* joined reply, or the unescaped data of a write */
+    struct packet_buf out;              /* chunk sent to OpenOCD */
+};
+
+static struct packet_conn s_packet[SERVER_SHIM_MAX_CONNS];
+
+static struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t chunks;
+    uint32_t short_reads;               /* reads ended early by an error */
+    uint32_t largest;                   /* bytes of the largest split packet */
+    uint32_t buffers;                   /* bytes of PSRAM held by the connections */
+    uint32_t oocd_size;
+} s_stats;
+
+static bool packet_reserve(struct packet_buf *buf, size_t size)
+{
+    if (size <= buf->cap) {
+        return true;
+    }
+
+    char *data = heap_caps_realloc(buf->data, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!data) {
+        ESP_LOGW(TAG, "No memory for a buffer of %u bytes", (unsigned)size);
+        return false;
+    }
+    s_stats.buffers += size - buf->cap;
+    buf->data = data;
+    buf->cap = size;
+    return true;
+}
+
+static void packet_buf_free(struct packet_buf *buf)
+{
+    s_stats.buffers -= buf->cap;
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/* bytes of one chunk, its escaped or hex form fits in OpenOCD's buffer */
+static uint32_t packet_chunk_size(const struct packet_conn *pc)
+{
+    return ((pc->oocd_size - PACKET_HEADROOM) / 2) & ~3u;
+}
+
+static void packet_finish(struct rsp_conn *conn, struct packet_conn *pc, const char *pkt, size_t len)
+{
+    pc->op = PACKET_IDLE;
+    server_rsp_deliver(conn, pc->req, pc->req_len, pkt, len);
+}
+
+static void packet_read_next(struct rsp_conn *conn, struct packet_conn *pc);
+static void packet_write_next(struct rsp_conn *conn, struct packet_conn *pc);
+
+static void packet_read_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+    bool binary = pc->op == PACKET_READ_BINARY;
+
+    if (!reply) {
+        /* the connection is closing */
+        pc->op = PACKET_IDLE;
+        return;
+    }
+
+    bool ok = len && reply[0] != 'E' && (!binary || reply[0] == 'b');
+    if (!ok) {
+        if (!pc->off) {
+            packet_finish(conn, pc, reply, len);
+            return;
+        }
+        s_stats.short_reads++;
+        packet_finish(conn, pc, pc->reply.data, pc->reply.len);
+        return;
+    }
+
+    uint32_t got;
+    if (binary) {
+        memcpy(pc->reply.data + pc->reply.len, reply + 1, len - 1);
+        pc->reply.len += len - 1;
+        got = len - 1;
+        for (size_t i = 1; i < len; i++) {
+            if (reply[i] == '}') {
+                got--;
+                i++;
+            }
+        }
+    } else {
+        memcpy(pc->reply.data + pc->reply.len, reply, len);
+        pc->reply.len += len;
+        got = len / 2;
+    }
+    pc->off += got;
+
+    if (got < pc->chunk) {
+        /* OpenOCD read less, gdb asks for the rest */
+        s_stats.short_reads++;
+        pc->off = pc->len;
+    }
+    if (pc->off >= pc->len) {
+        packet_finish(conn, pc, pc->reply.data, pc->reply.len);
+        return;
+    }
+    packet_read_next(conn, pc);
+}
+
+static void packet_read_next(struct rsp_conn *conn, struct packet_conn *pc)
+{
+    char req[32];
+
+    pc->chunk = pc->len - pc->off < packet_chunk_size(pc) ? pc->len - pc->off : packet_chunk_size(pc);
+    int n = snprintf(req, sizeof(req), "%c%" PRIx32 ",%" PRIx32, pc->op == PACKET_READ_BINARY ? 'x' : 'm',
+                     pc->addr + pc->off, pc->chunk);
+    if (server_rsp_request(conn, req, n, packet_read_cb, NULL) != ESP_OK) {
+        packet_finish(conn, pc, "E01", 3);
+        return;
+    }
+    s_stats.chunks++;
+}
+
+static rsp_action_t packet_read(struct rsp_conn *conn, struct packet_conn *pc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + 1;
+
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (p == end || *p != ',') {
+        return RSP_PASS;
+    }
+    p++;
+    uint32_t size = server_rsp_parse_hex(&p, end);
+    if (size * 2 + PACKET_HEADROOM <= pc->oocd_size) {
+        return RSP_PASS;
+    }
+    /* hex, or 'b' and binary escaped at worst */
+    if (!packet_reserve(&pc->reply, (size_t)size * 2 + 1)) {
+        return RSP_PASS;
+    }
+
+    pc->op = pkt[0] == 'x' ? PACKET_READ_BINARY : PACKET_READ_HEX;
+    pc->addr = addr;
+    pc->len = size;
+    pc->off = 0;
+    pc->reply.len = 0;
+    if (pc->op == PACKET_READ_BINARY) {
+        pc->reply.data[pc->reply.len++] = 'b';
+    }
+    s_stats.reads++;
+    if (size > s_stats.largest) {
+        s_stats.largest = size;
+    }
+    packet_read_next(conn, pc);
+    return RSP_DONE;
+}
+
+static void packet_write_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+
+    if (!reply) {
+        pc->op = PACKET_IDLE;
+        return;
+    }
+    if (len != 2 || memcmp(reply, "OK", 2)) {
+        packet_finish(conn, pc, reply, len);
+        return;
+    }
+    pc->off += pc->chunk;
+    if (pc->off >= pc->len) {
+        packet_finish(conn, pc, reply, len);
+        return;
+    }
+    packet_write_next(conn, pc);
+}
+
+static void packet_write_next(struct rsp_conn *conn, struct packet_conn *pc)
+{
+    const uint8_t *data = (const uint8_t *)pc->reply.data + pc->off;
+    int n;
+
+    pc->chunk = pc->len - pc->off < packet_chunk_size(pc) ? pc->len - pc->off : packet_chunk_size(pc);
+    if (pc->op == PACKET_WRITE_FLASH) {
+        n = sprintf(pc->out.data, "vFlashWrite:%" PRIx32 ":", pc->addr + pc->off);
+    } else {
+        n = sprintf(pc->out.data, "X%" PRIx32 ",%" PRIx32 ":", pc->addr + pc->off, pc->chunk);
+    }
+    n += server_rsp_escape(data, pc->chunk, pc->out.data + n);
+    if (server_rsp_request(conn, pc->out.data, n, packet_write_cb, NULL) != ESP_OK) {
+        packet_finish(conn, pc, "E01", 3);
+        return;
+    }
+    s_stats.chunks++;
+}
+
+static rsp_action_t packet_write(struct rsp_conn *conn, struct packet_conn *pc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    bool flash = pkt[0] == 'v';
+    const char *p = pkt + (flash ? strlen("vFlashWrite:") : 1);
+
+    if (len + PACKET_HEADROOM <= pc->oocd_size) {
+        return RSP_PASS;
+    }
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (!flash) {
+        if (p == end || *p != ',') {
+            return RSP_PASS;
+        }
+        p++;
+        server_rsp_parse_hex(&p, end);
+    }
+    if (p == end || *p != ':') {
+        return RSP_PASS;
+    }
+    p++;
+    /* the unescaped data is never longer than the packet's */
+    if (!packet_reserve(&pc->reply, end - p) || !packet_reserve(&pc->out, pc->oocd_size)) {
+        return RSP_PASS;
+    }
+
+    pc->op = flash ? PACKET_WRITE_FLASH : PACKET_WRITE_MEMORY;
+    pc->addr = addr;
+    pc->len = server_rsp_unescape(p, end - p, (uint8_t *)pc->reply.data);
+    pc->off = 0;
+    s_stats.writes++;
+    if (pc->len > s_stats.largest) {
+        s_stats.largest = pc->len;
+    }
+    packet_write_next(conn, pc);
+    return RSP_DONE;
+}
+
+static rsp_action_t packet_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+
+    if (!pc->oocd_size || !len) {
+        return RSP_PASS;
+    }
+
+    rsp_action_t action = RSP_PASS;
+    if (pkt[0] == 'm' || pkt[0] == 'x') {
+        action = packet_read(conn, pc, pkt, len);
+    } else if (pkt[0] == 'X' || server_rsp_starts_with(pkt, len, "vFlashWrite:")) {
+        action = packet_write(conn, pc, pkt, len);
+    }
+    if (action == RSP_DONE) {
+        pc->req_len = len < RSP_REQ_HEAD_SIZE ? len : RSP_REQ_HEAD_SIZE;
+        memcpy(pc->req, pkt, pc->req_len);
+    }
+    return action;
+}
+
+/* OpenOCD's PacketSize is kept and gdb gets SERVER_PACKET_SIZE */
+static rsp_action_t packet_supported(struct rsp_conn *conn, struct packet_conn *pc, const char *req, size_t req_len,
+                                     const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *field = NULL;
+
+    for (const char *p = pkt; p + 11 <= end; p++) {
+        if ((p == pkt || p[-1] == ';') && !memcmp(p, "PacketSize=", 11)) {
+            field = p + 11;
+            break;
+        }
+    }
+    if (!field) {
+        return RSP_PASS;
+    }
+
+    const char *p = field;
+    uint32_t size = server_rsp_parse_hex(&p, end);
+    if (size <= PACKET_HEADROOM * 2 || size >= CONFIG_SERVER_PACKET_SIZE) {
+        return RSP_PASS;
+    }
+    pc->oocd_size = size;
+    s_stats.oocd_size = size;
+
+    char *reply = malloc(len + 16);
+    if (!reply) {
+        return RSP_PASS;
+    }
+    int n = (field - pkt);
+    memcpy(reply, pkt, n);
+    n += sprintf(reply + n, "%x", CONFIG_SERVER_PACKET_SIZE);
+    memcpy(reply + n, p, end - p);
+    n += end - p;
+    ESP_LOGD(TAG, "PacketSize 0x%" PRIx32 " of OpenOCD advertised as 0x%x", size, CONFIG_SERVER_PACKET_SIZE);
+    server_rsp_release(conn, &server_packet_feature, req, req_len, reply, n);
+    free(reply);
+    return RSP_DONE;
+}
+
+static rsp_action_t packet_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                      size_t len)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+
+    if (server_rsp_starts_with(req, req_len, "qSupported") && len && pkt[0] != 'E') {
+        return packet_supported(conn, pc, req, req_len, pkt, len);
+    }
+    return RSP_PASS;
+}
+
+static void packet_open(struct rsp_conn *conn)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+
+    memset(pc, 0, sizeof(*pc));
+}
+
+static void packet_close(struct rsp_conn *conn)
+{
+    struct packet_conn *pc = &s_packet[server_rsp_index(conn)];
+
+    packet_buf_free(&pc->reply);
+    packet_buf_free(&pc->out);
+    memset(pc, 0, sizeof(*pc));
+}
+
+const struct rsp_feature server_packet_feature = {
+    .open = packet_open,
+    .close = packet_close,
+    .request = packet_request_hook,
+    .reply = packet_reply_hook,
+};
+
+static void server_packet_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "packetSize", CONFIG_SERVER_PACKET_SIZE);
+    cJSON_AddNumberToObject(obj, "openocdPacketSize", s_stats.oocd_size);
+    cJSON_AddNumberToObject(obj, "splitReads", s_stats.reads);
+    cJSON_AddNumberToObject(obj, "splitWrites", s_stats.writes);
+    cJSON_AddNumberToObject(obj, "chunks", s_stats.chunks);
+    cJSON_AddNumberToObject(obj, "shortReads", s_stats.short_reads);
+    cJSON_AddNumberToObject(obj, "largestBytes", s_stats.largest);
+    cJSON_AddNumberToObject(obj, "bufferKB", s_stats.buffers / 1024);
+}
+
+void server_packet_init(void)
+{
+    metrics_register("packets", server_packet_metrics);
+}
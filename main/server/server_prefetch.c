@@ -0,0 +1,594 @@
+/*
+    Halt-time snapshot prefetch of the gdb connections.
+
+    When OpenOCD reports a stop, gdb asks for the registers, reads the stack to unwind it and
+    refreshes the thread list, one round trip at a time. The snapshot is requested from OpenOCD
+    right after the stop reply, while that reply is still on its way to gdb, and gdb's packets are
+    answered from it:
+
+    - `g`: the registers of the stopped thread
+    - `m`: reads inside a window around the stack pointer (SERVER_PREFETCH_STACK_BYTES)
+    - thread list: `qfThreadInfo`/`qsThreadInfo` or `qXfer:threads:read`, as gdb asked it last time
+    - `?`: the last stop reply
+
+    What is prefetched after a stop is what gdb asked for after the previous stop of the same kind
+    (continue or step), so single stepping only prefetches the registers. The stack pointer is the
+    register closest to gdb's first stack read, learned on the first stop. A packet which arrives
+    while its part of the snapshot is in flight waits for it. The snapshot is dropped on resume,
+    on any write (memory, registers, breakpoints, flash) and on monitor commands. The thread list
+    isn't prefetched when the session cache (server_session.c) has the one of the same halt.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+/* gdb's unwinders also read the few words below the stack pointer (Xtensa base save area) */
+#define PREFETCH_STACK_BELOW        64
+#define PREFETCH_THREAD_PACKETS     16
+/* a gap this long between two requests means gdb shows its prompt */
+#define PREFETCH_PROMPT_GAP_US      300000
+
+static const char *TAG = "server-prefetch";
+
+typedef enum {
+    PREFETCH_REGS = 1 << 0,
+    PREFETCH_STACK = 1 << 1,
+    PREFETCH_THREADS = 1 << 2,
+} prefetch_part_t;
+
+typedef enum {
+    PREFETCH_STOP_CONTINUE,
+    PREFETCH_STOP_STEP,
+    PREFETCH_STOP_MAX,
+} prefetch_stop_t;
+
+struct prefetch_pkt {
+    char *req;
+    size_t req_len;
+    char *reply;
+    size_t reply_len;
+};
+
+struct prefetch {
+    bool halted;
+    prefetch_stop_t stop_kind;
+    uint32_t gen;                       /* snapshot generation, replies of older ones are ignored */
+    uint32_t pending;                   /* parts in flight */
+    uint32_t valid;                     /* parts in the snapshot */
+    uint32_t asked;                     /* parts gdb asked for since the stop */
+    char *stop;                         /* last stop reply */
+    size_t stop_len;
+    char thread[24];                    /* thread of the stop reply */
+    char *regs;
+    size_t regs_len;
+    uint32_t stack_addr;
+    char *stack;                        /* hex, two chars per byte */
+    size_t stack_len;
+    struct prefetch_pkt threads[PREFETCH_THREAD_PACKETS];
+    size_t thread_count;
+    size_t thread_cursor;               /* next thread list packet gdb should ask for */
+    bool first_read;                    /* gdb's first memory read since the stop was seen */
+    bool other_thread;                  /* Hg selected another thread, `g` isn't the snapshot's */
+    char *parked;                       /* client packet waiting for the snapshot */
+    size_t parked_len;
+    uint32_t parked_wait;               /* parts it waits for */
+    int64_t stop_us;
+    int64_t last_reply_us;
+    bool prompt_measured;
+};
+
+static struct prefetch s_prefetch[SERVER_SHIM_MAX_CONNS];
+
+/* what gdb does is the same for every connection */
+static struct {
+    uint32_t want[PREFETCH_STOP_MAX];
+    int sp_reg;                         /* index of the stack pointer in the `g` reply, -1 if unknown */
+    char thread_req[48];                /* first packet of the thread list */
+} s_learn = {
+    .want = {
+        [PREFETCH_STOP_CONTINUE] = PREFETCH_REGS | PREFETCH_STACK | PREFETCH_THREADS,
+        [PREFETCH_STOP_STEP] = PREFETCH_REGS,
+    },
+    .sp_reg = -1,
+    .thread_req = "qfThreadInfo",
+};
+
+static struct {
+    uint32_t stops;
+    uint32_t requests;                  /* packets sent to OpenOCD for the snapshot */
+    uint32_t lookups;                   /* gdb packets the snapshot could answer */
+    uint32_t hits;
+    uint32_t parked;
+    uint32_t prompts;
+    uint64_t prompt_us;
+    uint32_t last_prompt_us;
+} s_stats;
+
+static void prefetch_set(char **dst, size_t *dst_len, const char *data, size_t len)
+{
+    free(*dst);
+    *dst = server_rsp_dup(data, len);
+    *dst_len = *dst ? len : 0;
+}
+
+static void prefetch_drop(struct prefetch *pf)
+{
+    pf->gen++;
+    pf->pending = 0;
+    pf->valid = 0;
+    free(pf->regs);
+    pf->regs = NULL;
+    free(pf->stack);
+    pf->stack = NULL;
+    for (size_t i = 0; i < pf->thread_count; i++) {
+        free(pf->threads[i].req);
+        free(pf->threads[i].reply);
+    }
+    memset(pf->threads, 0, sizeof(pf->threads));
+    pf->thread_count = 0;
+    pf->thread_cursor = 0;
+}
+
+static void prefetch_prompt_done(struct prefetch *pf)
+{
+    if (pf->prompt_measured || !pf->last_reply_us) {
+        return;
+    }
+    pf->prompt_measured = true;
+
+    uint32_t us = pf->last_reply_us - pf->stop_us;
+    s_stats.prompts++;
+    s_stats.prompt_us += us;
+    s_stats.last_prompt_us = us;
+}
+
+static void prefetch_replied(struct prefetch *pf)
+{
+    if (pf->halted) {
+        pf->last_reply_us = esp_timer_get_time();
+    }
+}
+
+static uint32_t prefetch_reg(const struct prefetch *pf, int index, bool *ok)
+{
+    const char *p = pf->regs + index * 8;
+    uint32_t value = 0;
+
+    *ok = (size_t)(index + 1) * 8 <= pf->regs_len;
+    /* registers are sent in target byte order, little endian on every Espressif chip */
+    for (int i = 0; *ok && i < 4; i++) {
+        const char *digit = p + i * 2;
+        uint32_t byte = server_rsp_parse_hex(&digit, p + i * 2 + 2);
+        *ok = digit == p + i * 2 + 2;
+        value |= byte << (i * 8);
+    }
+    return value;
+}
+
+/* the stack pointer is the register closest to the first stack read of gdb */
+static void prefetch_learn_sp(const struct prefetch *pf, uint32_t addr)
+{
+    int best = -1;
+    uint32_t best_dist = CONFIG_SERVER_PREFETCH_STACK_BYTES;
+
+    for (int i = 0; (size_t)(i + 1) * 8 <= pf->regs_len; i++) {
+        bool ok;
+        uint32_t value = prefetch_reg(pf, i, &ok);
+        uint32_t dist = addr >= value ? addr - value : value - addr;
+        if (ok && dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    if (best >= 0 && best != s_learn.sp_reg) {
+        ESP_LOGD(TAG, "stack pointer is register %d", best);
+        s_learn.sp_reg = best;
+    }
+}
+
+/* the callbacks get the part and the generation of the snapshot */
+#define PREFETCH_ARG(part, gen)     ((void *)(uintptr_t)((part) | (((gen) & 0xffffff) << 8)))
+
+static void prefetch_request(struct rsp_conn *conn, const char *pkt, size_t len, rsp_reply_cb_t cb, uint32_t part)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+
+    if (server_rsp_request(conn, pkt, len, cb, PREFETCH_ARG(part, pf->gen)) == ESP_OK) {
+        pf->pending |= part;
+        s_stats.requests++;
+    }
+}
+
+/* state of the connection, NULL if the reply belongs to a dropped snapshot */
+static struct prefetch *prefetch_reply_state(struct rsp_conn *conn, void *arg)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+    uint32_t part = (uintptr_t)arg & 0xff;
+
+    if (((uintptr_t)arg >> 8) != (pf->gen & 0xffffff)) {
+        return NULL;
+    }
+    pf->pending &= ~part;
+    return pf;
+}
+
+static bool prefetch_lookup(struct rsp_conn *conn, struct prefetch *pf, const char *pkt, size_t len);
+
+static void prefetch_unpark(struct rsp_conn *conn, struct prefetch *pf)
+{
+    if (!pf->parked || (pf->pending & pf->parked_wait)) {
+        return;
+    }
+
+    char *pkt = pf->parked;
+    size_t len = pf->parked_len;
+    pf->parked = NULL;
+
+    if (!prefetch_lookup(conn, pf, pkt, len)) {
+        server_rsp_forward(conn, pkt, len);
+    }
+    free(pkt);
+}
+
+static void prefetch_thread_next(struct rsp_conn *conn, struct prefetch *pf, const char *reply, size_t len);
+
+static void prefetch_threads_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct prefetch *pf = prefetch_reply_state(conn, arg);
+    if (!pf) {
+        return;
+    }
+
+    if (reply && len && reply[0] != 'E') {
+        struct prefetch_pkt *entry = &pf->threads[pf->thread_count - 1];
+        prefetch_set(&entry->reply, &entry->reply_len, reply, len);
+        prefetch_thread_next(conn, pf, reply, len);
+    }
+    prefetch_unpark(conn, pf);
+}
+
+static void prefetch_thread_request(struct rsp_conn *conn, struct prefetch *pf, const char *req, size_t len)
+{
+    struct prefetch_pkt *entry = &pf->threads[pf->thread_count];
+
+    prefetch_set(&entry->req, &entry->req_len, req, len);
+    if (!entry->req) {
+        return;
+    }
+    pf->thread_count++;
+    prefetch_request(conn, req, len, prefetch_threads_cb, PREFETCH_THREADS);
+}
+
+/* the list continues while OpenOCD answers with 'm' */
+static void prefetch_thread_next(struct rsp_conn *conn, struct prefetch *pf, const char *reply, size_t len)
+{
+    const struct prefetch_pkt *prev = &pf->threads[pf->thread_count - 1];
+    char req[64];
+
+    if (reply[0] != 'm' || pf->thread_count == PREFETCH_THREAD_PACKETS) {
+        pf->valid |= PREFETCH_THREADS;
+        return;
+    }
+
+    if (server_rsp_starts_with(prev->req, prev->req_len, "qXfer:threads:read::")) {
+        /* qXfer:threads:read::offset,length, the data is escaped */
+        const char *p = prev->req + strlen("qXfer:threads:read::");
+        const char *end = prev->req + prev->req_len;
+        uint32_t offset = server_rsp_parse_hex(&p, end);
+        p++;
+        uint32_t length = server_rsp_parse_hex(&p, end);
+        size_t data_len = 0;
+        for (size_t i = 1; i < len; i++) {
+            if (reply[i] == '}') {
+                i++;
+            }
+            data_len++;
+        }
+        int n = snprintf(req, sizeof(req), "qXfer:threads:read::%" PRIx32 ",%" PRIx32, offset + (uint32_t)data_len, length);
+        prefetch_thread_request(conn, pf, req, n);
+    } else {
+        prefetch_thread_request(conn, pf, "qsThreadInfo", strlen("qsThreadInfo"));
+    }
+}
+
+static void prefetch_stack_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct prefetch *pf = prefetch_reply_state(conn, arg);
+    if (!pf) {
+        return;
+    }
+    if (reply && len == CONFIG_SERVER_PREFETCH_STACK_BYTES * 2) {
+        prefetch_set(&pf->stack, &pf->stack_len, reply, len);
+        if (pf->stack) {
+            pf->valid |= PREFETCH_STACK;
+        }
+    }
+    prefetch_unpark(conn, pf);
+}
+
+static void prefetch_regs_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct prefetch *pf = prefetch_reply_state(conn, arg);
+    if (!pf) {
+        return;
+    }
+    if (reply && len && reply[0] != 'E') {
+        prefetch_set(&pf->regs, &pf->regs_len, reply, len);
+        if (pf->regs) {
+            pf->valid |= PREFETCH_REGS;
+        }
+    }
+
+    bool ok = false;
+    uint32_t sp = 0;
+    if ((pf->valid & PREFETCH_REGS) && (s_learn.want[pf->stop_kind] & PREFETCH_STACK) && s_learn.sp_reg >= 0) {
+        sp = prefetch_reg(pf, s_learn.sp_reg, &ok);
+    }
+    if (ok && sp >= PREFETCH_STACK_BELOW) {
+        char req[32];
+        pf->stack_addr = sp - PREFETCH_STACK_BELOW;
+        int n = snprintf(req, sizeof(req), "m%" PRIx32 ",%x", pf->stack_addr, CONFIG_SERVER_PREFETCH_STACK_BYTES);
+        prefetch_request(conn, req, n, prefetch_stack_cb, PREFETCH_STACK);
+    }
+    prefetch_unpark(conn, pf);
+}
+
+static void prefetch_start(struct rsp_conn *conn, struct prefetch *pf)
+{
+    uint32_t want = s_learn.want[pf->stop_kind];
+
+    s_stats.stops++;
+    if (want & (PREFETCH_REGS | PREFETCH_STACK)) {
+        prefetch_request(conn, "g", 1, prefetch_regs_cb, PREFETCH_REGS);
+    }
+    /* a new connection to a target which stayed halted gets the thread list from the session */
+    if ((want & PREFETCH_THREADS) && !server_session_has_threads(conn, pf->stop, pf->stop_len)) {
+        prefetch_thread_request(conn, pf, s_learn.thread_req, strlen(s_learn.thread_req));
+    }
+}
+
+static void prefetch_resume(struct rsp_conn *conn, struct prefetch *pf, const char *pkt, size_t len)
+{
+    if (pf->halted) {
+        prefetch_prompt_done(pf);
+        /* what gdb wanted after this kind of stop is prefetched after the next one */
+        if (pf->asked) {
+            s_learn.want[pf->stop_kind] = pf->asked;
+        }
+    }
+    pf->halted = false;
+    pf->stop_kind = server_rsp_is_step(pkt, len) ? PREFETCH_STOP_STEP : PREFETCH_STOP_CONTINUE;
+    server_rsp_cancel_requests(conn);
+    prefetch_drop(pf);
+}
+
+static bool prefetch_lookup_mem(struct prefetch *pf, const char *pkt, size_t len, const char **data, size_t *data_len)
+{
+    const char *p = pkt + 1;
+    const char *end = pkt + len;
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (p == end || *p != ',') {
+        return false;
+    }
+    p++;
+    uint32_t size = server_rsp_parse_hex(&p, end);
+
+    if (pf->first_read && (pf->valid & PREFETCH_REGS) && !pf->other_thread) {
+        pf->first_read = false;
+        if (!(pf->valid & PREFETCH_STACK) || addr < pf->stack_addr ||
+                addr - pf->stack_addr >= CONFIG_SERVER_PREFETCH_STACK_BYTES) {
+            prefetch_learn_sp(pf, addr);
+        }
+    }
+
+    if (!(pf->valid & PREFETCH_STACK) || addr < pf->stack_addr || size == 0 ||
+            addr - pf->stack_addr + size > CONFIG_SERVER_PREFETCH_STACK_BYTES) {
+        return false;
+    }
+    *data = pf->stack + (addr - pf->stack_addr) * 2;
+    *data_len = size * 2;
+    return true;
+}
+
+/* answers `pkt` from the snapshot, false if it can't */
+static bool prefetch_lookup(struct rsp_conn *conn, struct prefetch *pf, const char *pkt, size_t len)
+{
+    const char *data = NULL;
+    size_t data_len = 0;
+
+    if (len == 1 && pkt[0] == '?') {
+        if (pf->stop) {
+            data = pf->stop;
+            data_len = pf->stop_len;
+        }
+    } else if (len == 1 && pkt[0] == 'g') {
+        if (pf->valid & PREFETCH_REGS) {
+            data = pf->regs;
+            data_len = pf->regs_len;
+        }
+    } else if (pkt[0] == 'm') {
+        prefetch_lookup_mem(pf, pkt, len, &data, &data_len);
+    } else {
+        /* thread list, gdb asks for it in the same order */
+        size_t i = pf->thread_cursor;
+        if (i >= pf->thread_count || pf->threads[i].req_len != len || memcmp(pf->threads[i].req, pkt, len)) {
+            i = 0;
+        }
+        if (i < pf->thread_count && pf->threads[i].reply && pf->threads[i].req_len == len &&
+                !memcmp(pf->threads[i].req, pkt, len)) {
+            data = pf->threads[i].reply;
+            data_len = pf->threads[i].reply_len;
+            pf->thread_cursor = i + 1;
+        }
+    }
+
+    if (!data) {
+        return false;
+    }
+    /* the features after this one see the answer as if OpenOCD sent it */
+    server_rsp_release(conn, &server_prefetch_feature, pkt, len, data, data_len);
+    prefetch_replied(pf);
+    s_stats.hits++;
+    return true;
+}
+
+static uint32_t prefetch_part(const char *pkt, size_t len)
+{
+    if (len == 1 && (pkt[0] == 'g' || pkt[0] == '?')) {
+        return PREFETCH_REGS;
+    }
+    if (pkt[0] == 'm') {
+        return PREFETCH_STACK;
+    }
+    if (server_rsp_starts_with(pkt, len, "qfThreadInfo") || server_rsp_starts_with(pkt, len, "qsThreadInfo") ||
+            server_rsp_starts_with(pkt, len, "qXfer:threads:read::")) {
+        return PREFETCH_THREADS;
+    }
+    return 0;
+}
+
+static rsp_action_t prefetch_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+    int64_t now = esp_timer_get_time();
+
+    if (!len) {
+        return RSP_PASS;
+    }
+    if (pf->halted && pf->last_reply_us && now - pf->last_reply_us > PREFETCH_PROMPT_GAP_US) {
+        prefetch_prompt_done(pf);
+    }
+    if (server_rsp_is_resume(pkt, len)) {
+        prefetch_resume(conn, pf, pkt, len);
+        return RSP_PASS;
+    }
+    if (server_rsp_is_write(pkt, len)) {
+        server_rsp_cancel_requests(conn);
+        prefetch_drop(pf);
+        return RSP_PASS;
+    }
+    if (pkt[0] == 'H' && len > 1 && pkt[1] == 'g') {
+        /* the snapshot has the registers of the stopped thread, memory is the same for all */
+        bool same = (len == 3 && pkt[2] == '0') || (len - 2 == strlen(pf->thread) && !memcmp(pkt + 2, pf->thread, len - 2));
+        pf->other_thread = !same;
+        return RSP_PASS;
+    }
+
+    uint32_t part = prefetch_part(pkt, len);
+    if (!part || !pf->halted || (pf->other_thread && pkt[0] == 'g')) {
+        return RSP_PASS;
+    }
+
+    pf->asked |= part;
+    if (part == PREFETCH_STACK) {
+        pf->asked |= PREFETCH_REGS;
+    }
+    if (part == PREFETCH_THREADS && (server_rsp_starts_with(pkt, len, "qfThreadInfo") ||
+                                     server_rsp_starts_with(pkt, len, "qXfer:threads:read::0,")) &&
+            len < sizeof(s_learn.thread_req)) {
+        memcpy(s_learn.thread_req, pkt, len);
+        s_learn.thread_req[len] = '\0';
+    }
+
+    s_stats.lookups++;
+
+    if (prefetch_lookup(conn, pf, pkt, len)) {
+        return RSP_DONE;
+    }
+
+    /* the stack is requested once the registers are there */
+    uint32_t waiting = part == PREFETCH_STACK ? PREFETCH_REGS | PREFETCH_STACK : part;
+    if ((pf->pending & waiting) && !pf->parked) {
+        pf->parked = server_rsp_dup(pkt, len);
+        if (pf->parked) {
+            pf->parked_len = len;
+            pf->parked_wait = waiting;
+            s_stats.parked++;
+            return RSP_DONE;
+        }
+    }
+    return RSP_PASS;
+}
+
+static rsp_action_t prefetch_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                        size_t len)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+
+    prefetch_replied(pf);
+
+    if (!server_rsp_is_stop(pkt, len) || !req_len || !(server_rsp_is_resume(req, req_len) || req[0] == '?')) {
+        return RSP_PASS;
+    }
+
+    prefetch_drop(pf);
+    prefetch_set(&pf->stop, &pf->stop_len, pkt, len);
+    server_rsp_stop_thread(pkt, len, pf->thread, sizeof(pf->thread));
+    pf->halted = true;
+    pf->asked = 0;
+    pf->first_read = true;
+    pf->other_thread = false;
+    pf->stop_us = esp_timer_get_time();
+    pf->last_reply_us = 0;
+    pf->prompt_measured = false;
+    prefetch_start(conn, pf);
+    return RSP_PASS;
+}
+
+static void prefetch_open(struct rsp_conn *conn)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+
+    memset(pf, 0, sizeof(*pf));
+}
+
+static void prefetch_close(struct rsp_conn *conn)
+{
+    struct prefetch *pf = &s_prefetch[server_rsp_index(conn)];
+
+    prefetch_drop(pf);
+    free(pf->stop);
+    free(pf->parked);
+    memset(pf, 0, sizeof(*pf));
+}
+
+const struct rsp_feature server_prefetch_feature = {
+    .open = prefetch_open,
+    .close = prefetch_close,
+    .request = prefetch_request_hook,
+    .reply = prefetch_reply_hook,
+};
+
+static void server_prefetch_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    uint32_t lookups = s_stats.lookups;
+    uint32_t hits = s_stats.hits;
+    uint32_t prompts = s_stats.prompts;
+    uint64_t prompt_us = s_stats.prompt_us;
+    uint32_t last_prompt_us = s_stats.last_prompt_us;
+
+    cJSON_AddNumberToObject(obj, "stops", s_stats.stops);
+    cJSON_AddNumberToObject(obj, "requests", s_stats.requests);
+    cJSON_AddNumberToObject(obj, "lookups", lookups);
+    cJSON_AddNumberToObject(obj, "hits", hits);
+    cJSON_AddNumberToObject(obj, "hitRate", lookups ? (double)hits / lookups : 0);
+    cJSON_AddNumberToObject(obj, "parked", s_stats.parked);
+    cJSON_AddNumberToObject(obj, "spRegister", s_learn.sp_reg);
+    cJSON_AddNumberToObject(obj, "avgStopToPromptMs", prompts ? (double)prompt_us / prompts / 1000 : 0);
+    cJSON_AddNumberToObject(obj, "lastStopToPromptMs", last_prompt_us / 1000.0);
+}
+
+void server_prefetch_init(void)
+{
+    metrics_register("prefetch", server_prefetch_metrics);
+}
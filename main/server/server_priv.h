@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "lwip/sockets.h"
+#include "server_shim.h"
+
+/* Internal interface between the socket wrappers and the server modules */
+
+int __real_lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int __real_lwip_close(int s);
+ssize_t __real_lwip_read(int s, void *mem, size_t len);
+ssize_t __real_lwip_recv(int s, void *mem, size_t len, int flags);
+ssize_t __real_lwip_write(int s, const void *dataptr, size_t size);
+ssize_t __real_lwip_send(int s, const void *dataptr, size_t size, int flags);
+int __real_lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
+                       struct timeval *timeout);
+
+/* Slot index of a tracked remote connection, -1 for any other socket */
+int server_conn_slot(int fd);
+void server_conn_count(int fd, ssize_t len, bool rx);
+/* Sends to a tracked connection, through the output buffer when coalescing is enabled */
+ssize_t server_conn_send(int slot, int fd, const void *data, size_t size);
+
+bool server_loop_is_loop_task(void);
+int server_loop_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
+                       struct timeval *timeout);
+
+#if CONFIG_SERVER_COALESCE_ENABLE
+void server_coalesce_init(void);
+void server_coalesce_open(int slot, int fd);
+void server_coalesce_close(int slot);
+ssize_t server_coalesce_write(int slot, int fd, const void *data, size_t size);
+void server_coalesce_flush(int slot);
+void server_coalesce_flush_all(void);
+#else
+static inline void server_coalesce_init(void) {}
+static inline void server_coalesce_open(int slot, int fd) {}
+static inline void server_coalesce_close(int slot) {}
+static inline void server_coalesce_flush(int slot) {}
+static inline void server_coalesce_flush_all(void) {}
+#endif
+
+#if CONFIG_SERVER_RSP_ENABLE
+void server_rsp_init(void);
+void server_rsp_open(int slot, int fd, int target);
+void server_rsp_close(int slot);
+bool server_rsp_is_open(int slot);
+ssize_t server_rsp_read(int slot, void *mem, size_t len);
+ssize_t server_rsp_write(int slot, const void *data, size_t size);
+/* Whether a socket of `readset` has a packet ready for OpenOCD, select mustn't wait then */
+bool server_rsp_select_pending(const fd_set *readset);
+/* Pulls the readable sockets of `want` and reports them readable only when OpenOCD has something to read */
+int server_rsp_select_done(const fd_set *want, fd_set *readset, int ret);
+#else
+static inline void server_rsp_init(void) {}
+static inline void server_rsp_open(int slot, int fd, int target) {}
+static inline void server_rsp_close(int slot) {}
+static inline bool server_rsp_is_open(int slot)
+{
+    return false;
+}
+static inline ssize_t server_rsp_read(int slot, void *mem, size_t len)
+{
+    return -1;
+}
+static inline ssize_t server_rsp_write(int slot, const void *data, size_t size)
+{
+    return -1;
+}
+static inline bool server_rsp_select_pending(const fd_set *readset)
+{
+    return false;
+}
+static inline int server_rsp_select_done(const fd_set *want, fd_set *readset, int ret)
+{
+    return ret;
+}
+#endif
+
+#if CONFIG_SERVER_SESSION_CACHE_ENABLE
+/* The target may have been changed outside the gdb connections (telnet or tcl input) */
+void server_session_touch(void);
+#else
+static inline void server_session_touch(void) {}
+#endif
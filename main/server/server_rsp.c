@@ -0,0 +1,947 @@
+/*
+    gdb remote protocol interposer.
+
+    The byte streams of the remote gdb connections are parsed in the socket wrappers, so features
+    can answer packets in place of OpenOCD, hold them back, or send OpenOCD packets of their own.
+
+    - acks are terminated on both sides: client packets are acked when they are received, OpenOCD's
+      packets are acked by the interposer as soon as they are written, the '+' of both peers are
+      dropped. Both sides switch to no-ack mode together (QStartNoAckMode). Until then the checksum
+      of the client packets is verified, a bad one gets a '-' and the packet is dropped.
+    - OpenOCD gets one packet at a time: the next one, from the client or from a feature, is only
+      given when the previous one is answered. Client packets go first. ^C passes at any time.
+    - the client's bytes are pulled from the socket when OpenOCD's select reports it readable, and
+      the socket is reported readable to OpenOCD only when a packet is ready for it.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "openocd_rpc.h"
+#include "metrics.h"
+
+/* bytes pulled from a socket per select, the rest waits for the next one */
+#define RSP_PULL_MAX            (16 * 1024)
+#define RSP_PULL_CHUNK          1460
+#define RSP_CLEANUP_TASK_STACK_SIZE 3072
+#define RSP_CLEANUP_TASK_PRIO   (tskIDLE_PRIORITY + 1)
+
+static const char *TAG = "server-rsp";
+
+struct rsp_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+typedef enum {
+    RSP_STATE_IDLE,
+    RSP_STATE_DATA,
+    RSP_STATE_CSUM1,
+    RSP_STATE_CSUM2,
+} rsp_state_t;
+
+struct rsp_parser {
+    rsp_state_t state;
+    int csum;                   /* checksum received, -1 if it isn't hex */
+    struct rsp_buf pkt;
+};
+
+struct rsp_item {
+    struct rsp_item *next;
+    rsp_reply_cb_t cb;          /* NULL for a client packet */
+    void *arg;
+    size_t len;
+    char data[];                /* payload */
+};
+
+struct rsp_queue {
+    struct rsp_item *head;
+    struct rsp_item *tail;
+};
+
+struct rsp_conn {
+    int fd;                     /* -1 when the slot is not used */
+    int target;                 /* index of the gdb port */
+    bool noack;
+    bool eof;
+    int err;                    /* errno of the failed pull */
+    struct rsp_parser in;       /* client to OpenOCD */
+    struct rsp_parser out;      /* OpenOCD to client */
+    struct rsp_queue client;
+    struct rsp_queue app;
+    struct rsp_buf feed;        /* framed packet OpenOCD is reading */
+    size_t feed_off;
+    uint32_t acks;              /* '+' owed to OpenOCD */
+    uint32_t interrupts;        /* ^C to pass to OpenOCD */
+    uint32_t interrupts_total;
+    struct {
+        bool active;            /* a packet waits for its reply */
+        bool app;
+        rsp_reply_cb_t cb;
+        void *arg;
+        char req[RSP_REQ_HEAD_SIZE];
+        size_t req_len;
+    } wait;
+    struct rsp_buf tx;          /* framing of the packets to the client */
+};
+
+static struct rsp_conn s_rsp[SERVER_SHIM_MAX_CONNS] = {
+    [0 ... SERVER_SHIM_MAX_CONNS - 1] = { .fd = -1 }
+};
+static char s_pull_buf[RSP_PULL_CHUNK];
+static int s_pc_reg = -1;
+
+static const struct rsp_feature *s_features[] = {
+#if CONFIG_SERVER_TRACE_ENABLE
+    /* first, it answers the reads of a trace frame and hides the tracepoint hits from the others */
+    &server_trace_feature,
+#endif
+#if CONFIG_SERVER_COND_ENABLE
+    /* the others only see the stops reported to gdb */
+    &server_cond_feature,
+#endif
+#if CONFIG_SERVER_BP_ENABLE
+    /* after the conditions are stripped, the features after it see the breakpoints OpenOCD gets */
+    &server_bp_feature,
+#endif
+#if CONFIG_SERVER_FLASH_STAGE_ENABLE
+    &server_flash_feature,
+#endif
+#if CONFIG_SERVER_THREAD_CACHE_ENABLE
+    /* before the prefetch, which answers `g` for the stopped thread only */
+    &server_threads_feature,
+#endif
+#if CONFIG_SERVER_PREFETCH_ENABLE
+    &server_prefetch_feature,
+#endif
+#if CONFIG_SERVER_SESSION_CACHE_ENABLE
+    /* after the prefetch, it keeps what the snapshot answers too */
+    &server_session_feature,
+#endif
+#if CONFIG_SERVER_LARGE_PACKETS_ENABLE
+    /* the features before it see gdb's packets whole, its chunks go straight to OpenOCD */
+    &server_packet_feature,
+#endif
+#if CONFIG_SERVER_STEP_ENABLE
+    /* last, the others see gdb's vCont;r, then the stop it ends with */
+    &server_step_feature,
+#endif
+    NULL
+};
+
+static struct {
+    uint32_t client_packets;
+    uint32_t answered;          /* client packets which didn't reach OpenOCD */
+    uint32_t app_requests;
+    uint32_t cancelled;
+    uint32_t dropped_replies;
+    uint32_t nacks;
+    uint32_t bad_checksums;
+} s_stats;
+
+static bool rsp_buf_append(struct rsp_buf *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+        /* large packets (memory transfers) end up in PSRAM, see SPIRAM_MALLOC_ALWAYSINTERNAL */
+        char *data = realloc(buf->data, cap);
+        if (!data) {
+            return false;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static void rsp_buf_free(struct rsp_buf *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static uint8_t rsp_checksum(const char *data, size_t len)
+{
+    uint8_t sum = 0;
+
+    while (len--) {
+        sum += (uint8_t)*data++;
+    }
+    return sum;
+}
+
+static int rsp_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool rsp_frame(struct rsp_buf *buf, const char *pkt, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t sum = rsp_checksum(pkt, len);
+    char tail[3] = { '#', hex[sum >> 4], hex[sum & 0xf] };
+
+    return rsp_buf_append(buf, "$", 1) && rsp_buf_append(buf, pkt, len) && rsp_buf_append(buf, tail, 3);
+}
+
+static void rsp_queue_push(struct rsp_queue *queue, struct rsp_item *item)
+{
+    item->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = item;
+    } else {
+        queue->head = item;
+    }
+    queue->tail = item;
+}
+
+static struct rsp_item *rsp_queue_pop(struct rsp_queue *queue)
+{
+    struct rsp_item *item = queue->head;
+    if (item) {
+        queue->head = item->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+    }
+    return item;
+}
+
+static struct rsp_item *rsp_item_new(const char *pkt, size_t len, rsp_reply_cb_t cb, void *arg)
+{
+    struct rsp_item *item = malloc(sizeof(*item) + len);
+    if (item) {
+        item->cb = cb;
+        item->arg = arg;
+        item->len = len;
+        memcpy(item->data, pkt, len);
+    }
+    return item;
+}
+
+static void rsp_send_client(struct rsp_conn *conn, const char *data, size_t len)
+{
+    if (server_conn_send(conn - s_rsp, conn->fd, data, len) < 0) {
+        ESP_LOGD(TAG, "send to (%d) failed (%d)", conn->fd, errno);
+    }
+}
+
+static void rsp_send_packet(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    conn->tx.len = 0;
+    if (rsp_frame(&conn->tx, pkt, len)) {
+        rsp_send_client(conn, conn->tx.data, conn->tx.len);
+    } else {
+        ESP_LOGE(TAG, "No memory for a packet of %u bytes", (unsigned)len);
+    }
+}
+
+/* packets which OpenOCD doesn't answer */
+static bool rsp_no_reply(const char *pkt, size_t len)
+{
+    return len > 0 && (pkt[0] == 'k' || pkt[0] == 'R');
+}
+
+/* OpenOCD gets its next packet if it isn't busy with the previous one */
+static bool rsp_next_packet(struct rsp_conn *conn)
+{
+    if (conn->wait.active) {
+        return false;
+    }
+
+    struct rsp_item *item = rsp_queue_pop(&conn->client);
+    if (!item) {
+        item = rsp_queue_pop(&conn->app);
+    }
+    if (!item) {
+        return false;
+    }
+
+    conn->feed.len = 0;
+    conn->feed_off = 0;
+    if (!rsp_frame(&conn->feed, item->data, item->len)) {
+        ESP_LOGE(TAG, "No memory for a packet of %u bytes", (unsigned)item->len);
+        if (item->cb) {
+            item->cb(conn, item->arg, NULL, 0);
+        }
+        free(item);
+        return false;
+    }
+
+    conn->wait.active = !rsp_no_reply(item->data, item->len);
+    conn->wait.app = item->cb != NULL;
+    conn->wait.cb = item->cb;
+    conn->wait.arg = item->arg;
+    conn->wait.req_len = item->len < RSP_REQ_HEAD_SIZE ? item->len : RSP_REQ_HEAD_SIZE;
+    memcpy(conn->wait.req, item->data, conn->wait.req_len);
+    free(item);
+    return true;
+}
+
+static bool rsp_feedable(struct rsp_conn *conn)
+{
+    return conn->acks || conn->interrupts || conn->feed_off < conn->feed.len ||
+           (!conn->wait.active && (conn->client.head || conn->app.head));
+}
+
+static size_t rsp_feed(struct rsp_conn *conn, char *mem, size_t len)
+{
+    size_t n = 0;
+
+    while (n < len) {
+        /* acks and ^C only go between packets, never into one OpenOCD is partway through */
+        if (conn->feed_off < conn->feed.len) {
+            size_t chunk = conn->feed.len - conn->feed_off;
+            if (chunk > len - n) {
+                chunk = len - n;
+            }
+            memcpy(mem + n, conn->feed.data + conn->feed_off, chunk);
+            conn->feed_off += chunk;
+            n += chunk;
+        } else if (conn->acks) {
+            mem[n++] = '+';
+            conn->acks--;
+        } else if (conn->interrupts) {
+            mem[n++] = 0x03;
+            conn->interrupts--;
+        } else if (!rsp_next_packet(conn)) {
+            break;
+        }
+    }
+    return n;
+}
+
+/* gives the packet to the features from `first` on, then to OpenOCD */
+static void rsp_request_hooks(struct rsp_conn *conn, size_t first, const char *pkt, size_t len)
+{
+    for (size_t i = first; s_features[i]; i++) {
+        if (s_features[i]->request && s_features[i]->request(conn, pkt, len) == RSP_DONE) {
+            s_stats.answered++;
+            return;
+        }
+    }
+
+    struct rsp_item *item = rsp_item_new(pkt, len, NULL, NULL);
+    if (!item) {
+        ESP_LOGE(TAG, "No memory for a packet of %u bytes", (unsigned)len);
+        return;
+    }
+    rsp_queue_push(&conn->client, item);
+}
+
+static void rsp_client_packet(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    if (!conn->noack) {
+        rsp_send_client(conn, "+", 1);
+    }
+    s_stats.client_packets++;
+    rsp_request_hooks(conn, 0, pkt, len);
+}
+
+/* console output of monitor commands and of a running target: 'O' followed by hex */
+static bool rsp_is_console(const char *pkt, size_t len)
+{
+    if (len < 2 || pkt[0] != 'O') {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!((pkt[i] >= '0' && pkt[i] <= '9') || (pkt[i] >= 'a' && pkt[i] <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* gives the reply to the features from `first` on, then to the client */
+static void rsp_reply_hooks(struct rsp_conn *conn, size_t first, const char *req, size_t req_len, const char *pkt,
+                            size_t len)
+{
+    for (size_t i = first; s_features[i]; i++) {
+        if (s_features[i]->reply && s_features[i]->reply(conn, req, req_len, pkt, len) == RSP_DONE) {
+            s_stats.dropped_replies++;
+            return;
+        }
+    }
+    rsp_send_packet(conn, pkt, len);
+}
+
+static void rsp_server_packet(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    bool waiting = conn->wait.active && !rsp_is_console(pkt, len);
+
+    if (!conn->noack) {
+        /* OpenOCD switches before it sends the OK, it doesn't wait for an ack of it */
+        if (waiting && server_rsp_starts_with(conn->wait.req, conn->wait.req_len, "QStartNoAckMode") &&
+                len == 2 && !memcmp(pkt, "OK", 2)) {
+            conn->noack = true;
+        } else {
+            conn->acks++;
+        }
+    }
+
+    if (!waiting) {
+        rsp_send_packet(conn, pkt, len);
+        return;
+    }
+
+    conn->wait.active = false;
+    if (conn->wait.app) {
+        conn->wait.cb(conn, conn->wait.arg, pkt, len);
+        return;
+    }
+
+    rsp_reply_hooks(conn, 0, conn->wait.req, conn->wait.req_len, pkt, len);
+}
+
+typedef void (*rsp_packet_fn_t)(struct rsp_conn *conn, const char *pkt, size_t len);
+
+/* splits a stream into packets, ^C of the client is counted */
+static void rsp_parse(struct rsp_conn *conn, struct rsp_parser *parser, const char *data, size_t len,
+                      rsp_packet_fn_t packet, bool client)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        int digit;
+
+        switch (parser->state) {
+        case RSP_STATE_IDLE:
+            if (c == '$') {
+                parser->pkt.len = 0;
+                parser->state = RSP_STATE_DATA;
+            } else if (c == '-') {
+                /* TCP doesn't lose bytes, nothing is retransmitted */
+                s_stats.nacks++;
+            } else if (c == 0x03 && client) {
+                conn->interrupts++;
+                conn->interrupts_total++;
+            }
+            /* '+' are dropped, acks are generated on both sides */
+            break;
+        case RSP_STATE_DATA:
+            if (c == '#') {
+                parser->state = RSP_STATE_CSUM1;
+            } else if (!rsp_buf_append(&parser->pkt, &c, 1)) {
+                ESP_LOGE(TAG, "No memory for the packet, dropped");
+                parser->state = RSP_STATE_IDLE;
+            }
+            break;
+        case RSP_STATE_CSUM1:
+            digit = rsp_hex_digit(c);
+            parser->csum = digit < 0 ? -1 : digit << 4;
+            parser->state = RSP_STATE_CSUM2;
+            break;
+        case RSP_STATE_CSUM2:
+            parser->state = RSP_STATE_IDLE;
+            digit = rsp_hex_digit(c);
+            parser->csum = digit < 0 || parser->csum < 0 ? -1 : parser->csum | digit;
+            /* in no-ack mode gdb doesn't resend a packet, it is taken as it is, like OpenOCD does */
+            if (client && !conn->noack && parser->csum != rsp_checksum(parser->pkt.data, parser->pkt.len)) {
+                s_stats.bad_checksums++;
+                rsp_send_client(conn, "-", 1);
+                break;
+            }
+            packet(conn, parser->pkt.data ? parser->pkt.data : "", parser->pkt.len);
+            break;
+        }
+    }
+}
+
+static void rsp_pull(struct rsp_conn *conn)
+{
+    size_t total = 0;
+
+    while (!conn->eof && total < RSP_PULL_MAX) {
+        ssize_t ret = __real_lwip_recv(conn->fd, s_pull_buf, sizeof(s_pull_buf), MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->err = errno;
+                conn->eof = true;
+            }
+            break;
+        }
+        if (ret == 0) {
+            conn->eof = true;
+            break;
+        }
+        server_conn_count(conn->fd, ret, true);
+        rsp_parse(conn, &conn->in, s_pull_buf, ret, rsp_client_packet, true);
+        total += ret;
+    }
+}
+
+static struct rsp_conn *rsp_conn_get(int slot)
+{
+    return slot >= 0 && s_rsp[slot].fd >= 0 ? &s_rsp[slot] : NULL;
+}
+
+bool server_rsp_is_open(int slot)
+{
+    return rsp_conn_get(slot) != NULL;
+}
+
+void server_rsp_open(int slot, int fd, int target)
+{
+    struct rsp_conn *conn = &s_rsp[slot];
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->target = target;
+
+    for (size_t i = 0; s_features[i]; i++) {
+        if (s_features[i]->open) {
+            s_features[i]->open(conn);
+        }
+    }
+}
+
+void server_rsp_close(int slot)
+{
+    struct rsp_conn *conn = rsp_conn_get(slot);
+    if (!conn) {
+        return;
+    }
+
+    server_rsp_cancel_requests(conn);
+    for (size_t i = 0; s_features[i]; i++) {
+        if (s_features[i]->close) {
+            s_features[i]->close(conn);
+        }
+    }
+
+    struct rsp_item *item;
+    while ((item = rsp_queue_pop(&conn->client))) {
+        free(item);
+    }
+    rsp_buf_free(&conn->in.pkt);
+    rsp_buf_free(&conn->out.pkt);
+    rsp_buf_free(&conn->feed);
+    rsp_buf_free(&conn->tx);
+    conn->fd = -1;
+}
+
+ssize_t server_rsp_read(int slot, void *mem, size_t len)
+{
+    struct rsp_conn *conn = rsp_conn_get(slot);
+
+    if (!rsp_feedable(conn)) {
+        rsp_pull(conn);
+    }
+    size_t n = rsp_feed(conn, mem, len);
+    if (n > 0) {
+        return n;
+    }
+    if (conn->eof) {
+        if (conn->err) {
+            errno = conn->err;
+            return -1;
+        }
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t server_rsp_write(int slot, const void *data, size_t size)
+{
+    struct rsp_conn *conn = rsp_conn_get(slot);
+
+    rsp_parse(conn, &conn->out, data, size, rsp_server_packet, false);
+    return size;
+}
+
+bool server_rsp_select_pending(const fd_set *readset)
+{
+    for (int i = 0; i < SERVER_SHIM_MAX_CONNS; i++) {
+        struct rsp_conn *conn = &s_rsp[i];
+        if (conn->fd >= 0 && FD_ISSET(conn->fd, readset) && (rsp_feedable(conn) || conn->eof)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int server_rsp_select_done(const fd_set *want, fd_set *readset, int ret)
+{
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (int i = 0; i < SERVER_SHIM_MAX_CONNS; i++) {
+        struct rsp_conn *conn = &s_rsp[i];
+        if (conn->fd < 0 || !FD_ISSET(conn->fd, want)) {
+            continue;
+        }
+        bool readable = ret > 0 && FD_ISSET(conn->fd, readset);
+        if (readable) {
+            rsp_pull(conn);
+        }
+        bool ready = rsp_feedable(conn) || conn->eof;
+        if (readable && !ready) {
+            FD_CLR(conn->fd, readset);
+            ret--;
+        } else if (!readable && ready) {
+            FD_SET(conn->fd, readset);
+            ret++;
+        }
+    }
+    return ret;
+}
+
+int server_rsp_index(const struct rsp_conn *conn)
+{
+    return conn - s_rsp;
+}
+
+int server_rsp_target(const struct rsp_conn *conn)
+{
+    return conn->target;
+}
+
+bool server_rsp_noack(const struct rsp_conn *conn)
+{
+    return conn->noack;
+}
+
+uint32_t server_rsp_interrupts(const struct rsp_conn *conn)
+{
+    return conn->interrupts_total;
+}
+
+int server_rsp_pc_reg(void)
+{
+    return s_pc_reg;
+}
+
+void server_rsp_set_pc_reg(int reg)
+{
+    if (reg != s_pc_reg) {
+        ESP_LOGD(TAG, "pc is register %d", reg);
+        s_pc_reg = reg;
+    }
+}
+
+esp_err_t server_rsp_request(struct rsp_conn *conn, const char *pkt, size_t len, rsp_reply_cb_t cb, void *arg)
+{
+    struct rsp_item *item = rsp_item_new(pkt, len, cb, arg);
+    if (!item) {
+        return ESP_ERR_NO_MEM;
+    }
+    rsp_queue_push(&conn->app, item);
+    s_stats.app_requests++;
+    return ESP_OK;
+}
+
+void server_rsp_cancel_requests(struct rsp_conn *conn)
+{
+    struct rsp_item *item;
+
+    while ((item = rsp_queue_pop(&conn->app))) {
+        s_stats.cancelled++;
+        item->cb(conn, item->arg, NULL, 0);
+        free(item);
+    }
+}
+
+void server_rsp_reply(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    rsp_send_packet(conn, pkt, len);
+}
+
+static void rsp_cleanup_task(void *arg)
+{
+    char *cmd = arg;
+    char resp[64];
+
+    esp_err_t err = openocd_rpc_exec(cmd, resp, sizeof(resp), OPENOCD_RPC_TIMEOUT_MS);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to remove the breakpoints (%s)", err == ESP_FAIL ? resp : esp_err_to_name(err));
+    }
+    free(cmd);
+    vTaskDelete(NULL);
+}
+
+void server_rsp_remove_bps(const struct rsp_conn *conn, const uint32_t *addrs, size_t count, const char *what)
+{
+    if (!count) {
+        return;
+    }
+
+    /* the breakpoint commands work on the current target, the one of the gdb port is selected for them */
+    size_t size = 256 + count * 32;
+    char *cmd = malloc(size);
+    if (!cmd) {
+        ESP_LOGW(TAG, "No memory to remove the %s", what);
+        return;
+    }
+    int n = snprintf(cmd, size, "set _bp_t [target current]; targets [lindex [target names] %d];"
+                     " set _bp_s [[target current] curstate]; if {$_bp_s eq {running}} {catch {halt}};",
+                     conn->target >= 0 ? conn->target : 0);
+    for (size_t i = 0; i < count; i++) {
+        n += snprintf(cmd + n, size - n, " catch {rbp 0x%" PRIx32 "};", addrs[i]);
+    }
+    snprintf(cmd + n, size - n, " if {$_bp_s eq {running}} {catch {resume}}; targets $_bp_t");
+
+    ESP_LOGI(TAG, "gdb left, removing (%u) %s", (unsigned)count, what);
+    if (xTaskCreate(rsp_cleanup_task, "rsp_cleanup", RSP_CLEANUP_TASK_STACK_SIZE, cmd, RSP_CLEANUP_TASK_PRIO,
+                    NULL) != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create the breakpoint cleanup task");
+        free(cmd);
+    }
+}
+
+/* index of the feature after `feature` */
+static size_t rsp_feature_next(const struct rsp_feature *feature)
+{
+    size_t i = 0;
+
+    while (s_features[i] && s_features[i] != feature) {
+        i++;
+    }
+    return s_features[i] ? i + 1 : i;
+}
+
+void server_rsp_release(struct rsp_conn *conn, const struct rsp_feature *feature, const char *req, size_t req_len,
+                        const char *pkt, size_t len)
+{
+    rsp_reply_hooks(conn, rsp_feature_next(feature), req, req_len, pkt, len);
+}
+
+void server_rsp_deliver(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt, size_t len)
+{
+    rsp_reply_hooks(conn, 0, req, req_len, pkt, len);
+}
+
+void server_rsp_pass(struct rsp_conn *conn, const struct rsp_feature *feature, const char *pkt, size_t len)
+{
+    /* the packet was counted as answered when `feature` took it */
+    s_stats.answered--;
+    rsp_request_hooks(conn, rsp_feature_next(feature), pkt, len);
+}
+
+esp_err_t server_rsp_forward(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct rsp_item *item = rsp_item_new(pkt, len, NULL, NULL);
+    if (!item) {
+        return ESP_ERR_NO_MEM;
+    }
+    rsp_queue_push(&conn->client, item);
+    s_stats.answered--;
+    return ESP_OK;
+}
+
+bool server_rsp_starts_with(const char *pkt, size_t len, const char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    return len >= prefix_len && !memcmp(pkt, prefix, prefix_len);
+}
+
+char *server_rsp_dup(const char *data, size_t len)
+{
+    /* kept in PSRAM, internal RAM is for Wi-Fi and the JTAG buffers */
+    char *copy = heap_caps_malloc(len + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!copy) {
+        copy = malloc(len + 1);
+    }
+    if (copy) {
+        memcpy(copy, data, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+bool server_rsp_is_resume(const char *pkt, size_t len)
+{
+    if (!len) {
+        return false;
+    }
+    if (server_rsp_starts_with(pkt, len, "vCont")) {
+        return !server_rsp_starts_with(pkt, len, "vCont?");
+    }
+    return pkt[0] && strchr("cCsSkDRr", pkt[0]);
+}
+
+bool server_rsp_is_step(const char *pkt, size_t len)
+{
+    if (!len) {
+        return false;
+    }
+    if (pkt[0] == 's' || pkt[0] == 'S') {
+        return true;
+    }
+    if (!server_rsp_starts_with(pkt, len, "vCont")) {
+        return false;
+    }
+    /* any step or range step action */
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (pkt[i] == ';' && (pkt[i + 1] == 's' || pkt[i + 1] == 'S' || pkt[i + 1] == 'r')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool server_rsp_is_write(const char *pkt, size_t len)
+{
+    if (!len) {
+        return false;
+    }
+    return (pkt[0] && strchr("MXGPZzQ", pkt[0])) || server_rsp_starts_with(pkt, len, "vFlash") ||
+           server_rsp_starts_with(pkt, len, "qRcmd") || server_rsp_starts_with(pkt, len, "vRun") ||
+           server_rsp_starts_with(pkt, len, "vAttach");
+}
+
+bool server_rsp_is_stop(const char *pkt, size_t len)
+{
+    return len && (pkt[0] == 'T' || pkt[0] == 'S');
+}
+
+bool server_rsp_is_break(const char *pkt, size_t len)
+{
+    if (len < 3 || pkt[0] != 'T' || pkt[1] != '0' || pkt[2] != '5') {
+        return false;
+    }
+    for (size_t i = 3; i + 5 <= len; i++) {
+        if (!memcmp(pkt + i, "watch", 5)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void server_rsp_stop_thread(const char *pkt, size_t len, char *thread, size_t size)
+{
+    const char *end = pkt + len;
+
+    thread[0] = '\0';
+    for (const char *p = pkt; p + 7 <= end; p++) {
+        if (!memcmp(p, "thread:", 7)) {
+            p += 7;
+            size_t n = 0;
+            while (p < end && *p != ';' && n < size - 1) {
+                thread[n++] = *p++;
+            }
+            thread[n] = '\0';
+            return;
+        }
+    }
+}
+
+uint32_t server_rsp_parse_hex(const char **pkt, const char *end)
+{
+    uint32_t value = 0;
+    const char *p = *pkt;
+
+    for (; p < end; p++) {
+        int digit;
+        if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            digit = *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            digit = *p - 'A' + 10;
+        } else {
+            break;
+        }
+        value = (value << 4) | digit;
+    }
+    *pkt = p;
+    return value;
+}
+
+size_t server_rsp_unescape(const char *data, size_t len, uint8_t *out)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '}' && i + 1 < len) {
+            out[n++] = data[++i] ^ 0x20;
+        } else {
+            out[n++] = data[i];
+        }
+    }
+    return n;
+}
+
+size_t server_rsp_escape(const uint8_t *data, size_t len, char *out)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c == '$' || c == '#' || c == '}' || c == '*') {
+            out[n++] = '}';
+            out[n++] = c ^ 0x20;
+        } else {
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+static void server_rsp_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "clientPackets", s_stats.client_packets);
+    cJSON_AddNumberToObject(obj, "answeredLocally", s_stats.answered);
+    cJSON_AddNumberToObject(obj, "appRequests", s_stats.app_requests);
+    cJSON_AddNumberToObject(obj, "cancelledRequests", s_stats.cancelled);
+    cJSON_AddNumberToObject(obj, "droppedReplies", s_stats.dropped_replies);
+    cJSON_AddNumberToObject(obj, "nacks", s_stats.nacks);
+    cJSON_AddNumberToObject(obj, "badChecksums", s_stats.bad_checksums);
+}
+
+void server_rsp_init(void)
+{
+#if CONFIG_SERVER_TRACE_ENABLE
+    server_trace_init();
+#endif
+#if CONFIG_SERVER_COND_ENABLE
+    server_cond_init();
+#endif
+#if CONFIG_SERVER_BP_ENABLE
+    server_bp_init();
+#endif
+#if CONFIG_SERVER_FLASH_STAGE_ENABLE
+    server_flash_init();
+#endif
+#if CONFIG_SERVER_THREAD_CACHE_ENABLE
+    server_threads_init();
+#endif
+#if CONFIG_SERVER_PREFETCH_ENABLE
+    server_prefetch_init();
+#endif
+#if CONFIG_SERVER_SESSION_CACHE_ENABLE
+    server_session_init();
+#endif
+#if CONFIG_SERVER_LARGE_PACKETS_ENABLE
+    server_packet_init();
+#endif
+#if CONFIG_SERVER_STEP_ENABLE
+    server_step_init();
+#endif
+    metrics_register("rsp", server_rsp_metrics);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+/*
+ * Internal interface between the gdb remote protocol interposer (server_rsp.c) and its features.
+ * Everything runs in the OpenOCD task, from the socket wrappers, no locking is needed.
+ * Packets are passed as payloads, without the '$' and '#xx' framing, binary data still escaped.
+ */
+
+struct rsp_conn;
+
+typedef enum {
+    RSP_PASS,       /* the packet goes on to OpenOCD (request) or to the client (reply) */
+    RSP_DONE,       /* the feature took care of it */
+} rsp_action_t;
+
+/* Reply of OpenOCD to an application request, NULL if the request was cancelled before it was sent */
+typedef void (*rsp_reply_cb_t)(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+
+struct rsp_feature {
+    void (*open)(struct rsp_conn *conn);
+    void (*close)(struct rsp_conn *conn);
+    /* packet of the client. RSP_DONE if it is answered now, or later with server_rsp_reply() */
+    rsp_action_t (*request)(struct rsp_conn *conn, const char *pkt, size_t len);
+    /* reply of OpenOCD to a client packet, `req` is the start of that packet. RSP_DONE drops it */
+    rsp_action_t (*reply)(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt, size_t len);
+};
+
+#if CONFIG_SERVER_TRACE_ENABLE
+extern const struct rsp_feature server_trace_feature;
+void server_trace_init(void);
+#endif
+#if CONFIG_SERVER_COND_ENABLE
+extern const struct rsp_feature server_cond_feature;
+void server_cond_init(void);
+#endif
+#if CONFIG_SERVER_BP_ENABLE
+extern const struct rsp_feature server_bp_feature;
+void server_bp_init(void);
+/*
+ * Whether gdb has its software breakpoint at `addr` inserted, in *wanted. false if server_bp
+ * doesn't track it: its Z0 and z0 then reach the features after server_bp.
+ */
+bool server_bp_lookup(struct rsp_conn *conn, uint32_t addr, bool *wanted);
+#else
+static inline bool server_bp_lookup(struct rsp_conn *conn, uint32_t addr, bool *wanted)
+{
+    return false;
+}
+#endif
+#if CONFIG_SERVER_FLASH_STAGE_ENABLE
+extern const struct rsp_feature server_flash_feature;
+void server_flash_init(void);
+#endif
+#if CONFIG_SERVER_THREAD_CACHE_ENABLE
+extern const struct rsp_feature server_threads_feature;
+void server_threads_init(void);
+#endif
+#if CONFIG_SERVER_SESSION_CACHE_ENABLE
+extern const struct rsp_feature server_session_feature;
+void server_session_init(void);
+/* The session of the connection's target has the thread list of the halt `stop` reports */
+bool server_session_has_threads(struct rsp_conn *conn, const char *stop, size_t len);
+#else
+static inline bool server_session_has_threads(struct rsp_conn *conn, const char *stop, size_t len)
+{
+    return false;
+}
+#endif
+#if CONFIG_SERVER_LARGE_PACKETS_ENABLE
+extern const struct rsp_feature server_packet_feature;
+void server_packet_init(void);
+#endif
+#if CONFIG_SERVER_STEP_ENABLE
+extern const struct rsp_feature server_step_feature;
+void server_step_init(void);
+#endif
+#if CONFIG_SERVER_PREFETCH_ENABLE
+extern const struct rsp_feature server_prefetch_feature;
+void server_prefetch_init(void);
+#endif
+
+/* Up to this many bytes of a client packet are kept for the reply hook */
+#define RSP_REQ_HEAD_SIZE       64
+
+/* Slot of the connection, 0..SERVER_SHIM_MAX_CONNS-1, features keep their state in arrays */
+int server_rsp_index(const struct rsp_conn *conn);
+/* Target of the connection, the index of its gdb port from SERVER_GDB_PORT */
+int server_rsp_target(const struct rsp_conn *conn);
+/* Whether the client turned acks off (QStartNoAckMode) */
+bool server_rsp_noack(const struct rsp_conn *conn);
+/* ^C received from the client since the connection was opened */
+uint32_t server_rsp_interrupts(const struct rsp_conn *conn);
+
+/*
+ * gdb's number of the pc register, -1 until a feature found it. It is 0 on Xtensa and 32 on
+ * RISC-V, features which read it try the candidates and keep the one matching what they expect.
+ */
+#define RSP_PC_REG_CANDIDATES   { 0, 32 }
+int server_rsp_pc_reg(void);
+void server_rsp_set_pc_reg(int reg);
+
+/*
+ * Queues a packet to OpenOCD on behalf of the application. It is sent when OpenOCD has answered
+ * the previous packet, client packets go first. The reply isn't forwarded to the client.
+ */
+esp_err_t server_rsp_request(struct rsp_conn *conn, const char *pkt, size_t len, rsp_reply_cb_t cb, void *arg);
+/* Drops the application requests which haven't been sent yet, their callbacks get NULL */
+void server_rsp_cancel_requests(struct rsp_conn *conn);
+/* Sends a reply to the client */
+void server_rsp_reply(struct rsp_conn *conn, const char *pkt, size_t len);
+/* Passes a reply `feature` held back, or changed, to the reply hooks of the features after it, then to the client */
+void server_rsp_release(struct rsp_conn *conn, const struct rsp_feature *feature, const char *req, size_t req_len,
+                        const char *pkt, size_t len);
+/* Hands a reply to the reply hooks of all the features, then to the client, as if OpenOCD answered `req` */
+void server_rsp_deliver(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt, size_t len);
+/* Passes a client packet `feature` held back, or changed, to the request hooks of the features after it, then to OpenOCD */
+void server_rsp_pass(struct rsp_conn *conn, const struct rsp_feature *feature, const char *pkt, size_t len);
+/* Sends a client packet a feature held back to OpenOCD, the reply hooks see its reply */
+esp_err_t server_rsp_forward(struct rsp_conn *conn, const char *pkt, size_t len);
+/*
+ * Removes breakpoints a client which went away left in its target, through the tcl server. It runs
+ * in a task of its own, the OpenOCD task can't wait for its own tcl server. A running target is
+ * halted for it and resumed. `what` names the breakpoints in the log.
+ */
+void server_rsp_remove_bps(const struct rsp_conn *conn, const uint32_t *addrs, size_t count, const char *what);
+
+/* Helpers for the features */
+bool server_rsp_starts_with(const char *pkt, size_t len, const char *prefix);
+/* Hex number at *pkt, *pkt is moved past it */
+uint32_t server_rsp_parse_hex(const char **pkt, const char *end);
+/* Copy of a packet in PSRAM, NUL terminated, NULL if there is no memory */
+char *server_rsp_dup(const char *data, size_t len);
+/* Binary data of a packet, '}' escapes the next byte. `out` takes `len` bytes, returns the bytes written */
+size_t server_rsp_unescape(const char *data, size_t len, uint8_t *out);
+/* Escapes binary data for a packet. `out` takes 2 * `len` bytes, returns the bytes written */
+size_t server_rsp_escape(const uint8_t *data, size_t len, char *out);
+/* Packets which resume the target: continue, step, vCont actions, kill, detach, restart */
+bool server_rsp_is_resume(const char *pkt, size_t len);
+/* Resume packets which step, vCont included */
+bool server_rsp_is_step(const char *pkt, size_t len);
+/* Packets after which memory, registers or breakpoints may differ from what was read before */
+bool server_rsp_is_write(const char *pkt, size_t len);
+/* Stop replies, `T` and `S` */
+bool server_rsp_is_stop(const char *pkt, size_t len);
+/* T05 without a watchpoint: a breakpoint or a step */
+bool server_rsp_is_break(const char *pkt, size_t len);
+/* Thread of a stop reply, empty if it doesn't give one */
+void server_rsp_stop_thread(const char *pkt, size_t len, char *thread, size_t size);
@@ -0,0 +1,344 @@
+/*
+    Session cache of the gdb connections.
+
+    When the Wi-Fi link drops, gdb connects again and asks for everything it had: the target
+    description (qXfer:features:read), the memory map (qXfer:memory-map:read) and the thread list.
+    OpenOCD builds them again, the thread list from JTAG reads of every task of the RTOS.
+
+    Their replies are kept per target (gdb port) in PSRAM and the next connection to it is
+    answered from them:
+    - the target description doesn't change while OpenOCD runs, it is kept until the debugger
+      restarts. The memory map isn't kept: its flash banks are probed from the application image,
+      which a load, program_esp or reset can change.
+    - the thread list (qfThreadInfo, qsThreadInfo, qThreadExtraInfo, qXfer:threads:read) belongs
+      to a halt. It is kept with the stop reply and dropped on a resume, write or monitor command
+      of any connection to the target and on input from a telnet or tcl client. A new connection
+      uses it only if its `?` gets a stop with the same signal and thread. qC isn't kept, the
+      current thread OpenOCD reports follows the connection's Hg.
+
+    Dead clients are found with TCP keepalive, set in the accept wrapper, so the gdb port is free
+    for the new connection soon after the link dropped.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "server_shim.h"
+#include "metrics.h"
+
+#define SESSION_MAX_ENTRIES     64
+
+static const char *TAG = "server-session";
+
+typedef enum {
+    SESSION_NONE,
+    SESSION_STATIC,                     /* kept while OpenOCD runs */
+    SESSION_HALT,                       /* kept while the target stays halted */
+} session_kind_t;
+
+struct session_entry {
+    char *req;                          /* NULL when the entry is free */
+    size_t req_len;
+    char *reply;
+    size_t reply_len;
+    uint32_t seq;                       /* qsThreadInfo after qfThreadInfo: 1, 2, ... */
+    session_kind_t kind;
+};
+
+struct session {
+    struct session_entry entries[SESSION_MAX_ENTRIES];
+    size_t bytes;
+    char *stop;                         /* stop reply of the halt the thread list belongs to */
+    size_t stop_len;
+    uint32_t gen;                       /* s_gen when `stop` was received */
+};
+
+struct session_conn {
+    int target;
+    bool halt_valid;                    /* the halt entries belong to this connection's halt */
+    uint32_t seq;
+};
+
+static struct session s_sessions[SERVER_GDB_PORT_COUNT];
+static struct session_conn s_conns[SERVER_SHIM_MAX_CONNS];
+/* changes of the target, a halt entry of an older generation is stale */
+static uint32_t s_gen;
+
+static struct {
+    uint32_t hits;
+    uint32_t halt_hits;
+    uint32_t stored;
+    uint32_t full;                      /* replies not kept, SERVER_SESSION_CACHE_KB reached */
+    uint32_t resumed;                   /* connections which found the halt of the previous one */
+    uint32_t bytes;
+} s_stats;
+
+static session_kind_t session_kind(const char *pkt, size_t len)
+{
+    if (server_rsp_starts_with(pkt, len, "qXfer:features:read:")) {
+        return SESSION_STATIC;
+    }
+    if (server_rsp_starts_with(pkt, len, "qfThreadInfo") || server_rsp_starts_with(pkt, len, "qsThreadInfo") ||
+            server_rsp_starts_with(pkt, len, "qThreadExtraInfo,") ||
+            server_rsp_starts_with(pkt, len, "qXfer:threads:read:")) {
+        return SESSION_HALT;
+    }
+    return SESSION_NONE;
+}
+
+/* packets after which the target may not be where the thread list was read */
+static bool session_changes_target(const char *pkt, size_t len)
+{
+    return server_rsp_is_resume(pkt, len) || (pkt[0] && strchr("MXGPR", pkt[0])) ||
+           server_rsp_starts_with(pkt, len, "vFlash") || server_rsp_starts_with(pkt, len, "qRcmd") ||
+           server_rsp_starts_with(pkt, len, "vRun") || server_rsp_starts_with(pkt, len, "vAttach");
+}
+
+/* qsThreadInfo continues the list, each one is kept with its place after qfThreadInfo */
+static uint32_t session_seq(const struct session_conn *sc, const char *pkt, size_t len)
+{
+    return server_rsp_starts_with(pkt, len, "qsThreadInfo") ? sc->seq : 0;
+}
+
+/* called once `pkt` is answered, by OpenOCD, the prefetch snapshot or the session */
+static void session_answered(struct session_conn *sc, const char *pkt, size_t len)
+{
+    if (server_rsp_starts_with(pkt, len, "qfThreadInfo")) {
+        sc->seq = 1;
+    } else if (server_rsp_starts_with(pkt, len, "qsThreadInfo")) {
+        sc->seq++;
+    }
+}
+
+static void session_entry_free(struct session *sess, struct session_entry *entry)
+{
+    sess->bytes -= entry->req_len + entry->reply_len;
+    s_stats.bytes -= entry->req_len + entry->reply_len;
+    free(entry->req);
+    free(entry->reply);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static void session_drop_halt(struct session *sess)
+{
+    for (size_t i = 0; i < SESSION_MAX_ENTRIES; i++) {
+        if (sess->entries[i].req && sess->entries[i].kind == SESSION_HALT) {
+            session_entry_free(sess, &sess->entries[i]);
+        }
+    }
+    free(sess->stop);
+    sess->stop = NULL;
+    sess->stop_len = 0;
+}
+
+static bool session_halt_valid(const struct session *sess, const struct session_conn *sc)
+{
+    return sc->halt_valid && sess->stop && sess->gen == s_gen;
+}
+
+static struct session_entry *session_find(struct session *sess, const char *pkt, size_t len, uint32_t seq)
+{
+    for (size_t i = 0; i < SESSION_MAX_ENTRIES; i++) {
+        struct session_entry *entry = &sess->entries[i];
+        if (entry->req && entry->req_len == len && entry->seq == seq && !memcmp(entry->req, pkt, len)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void session_store(struct session *sess, session_kind_t kind, const char *req, size_t req_len, uint32_t seq,
+                          const char *pkt, size_t len)
+{
+    struct session_entry *entry = session_find(sess, req, req_len, seq);
+    if (entry) {
+        session_entry_free(sess, entry);
+    } else {
+        for (size_t i = 0; i < SESSION_MAX_ENTRIES && !entry; i++) {
+            if (!sess->entries[i].req) {
+                entry = &sess->entries[i];
+            }
+        }
+    }
+    if (!entry || sess->bytes + req_len + len > CONFIG_SERVER_SESSION_CACHE_KB * 1024) {
+        s_stats.full++;
+        return;
+    }
+
+    entry->req = server_rsp_dup(req, req_len);
+    entry->reply = server_rsp_dup(pkt, len);
+    if (!entry->req || !entry->reply) {
+        free(entry->req);
+        free(entry->reply);
+        memset(entry, 0, sizeof(*entry));
+        return;
+    }
+    entry->req_len = req_len;
+    entry->reply_len = len;
+    entry->seq = seq;
+    entry->kind = kind;
+    sess->bytes += req_len + len;
+    s_stats.bytes += req_len + len;
+    s_stats.stored++;
+}
+
+static rsp_action_t session_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct session_conn *sc = &s_conns[server_rsp_index(conn)];
+    struct session *sess = &s_sessions[sc->target];
+
+    if (!len) {
+        return RSP_PASS;
+    }
+    if (session_changes_target(pkt, len)) {
+        s_gen++;
+        session_drop_halt(sess);
+        sc->halt_valid = false;
+        return RSP_PASS;
+    }
+
+    session_kind_t kind = session_kind(pkt, len);
+    if (kind == SESSION_NONE) {
+        return RSP_PASS;
+    }
+    if (kind == SESSION_HALT && !session_halt_valid(sess, sc)) {
+        return RSP_PASS;
+    }
+
+    struct session_entry *entry = session_find(sess, pkt, len, session_seq(sc, pkt, len));
+    if (!entry) {
+        return RSP_PASS;
+    }
+    server_rsp_reply(conn, entry->reply, entry->reply_len);
+    session_answered(sc, pkt, len);
+    s_stats.hits++;
+    if (kind == SESSION_HALT) {
+        s_stats.halt_hits++;
+    }
+    return RSP_DONE;
+}
+
+/* same signal and thread, the reply to `?` doesn't give the other fields of a resume's stop */
+static bool session_same_stop(const struct session *sess, const char *pkt, size_t len)
+{
+    char thread[24];
+    char stop_thread[24];
+
+    if (!sess->stop || sess->stop_len < 3 || len < 3 || memcmp(sess->stop + 1, pkt + 1, 2)) {
+        return false;
+    }
+    server_rsp_stop_thread(pkt, len, thread, sizeof(thread));
+    server_rsp_stop_thread(sess->stop, sess->stop_len, stop_thread, sizeof(stop_thread));
+    return !strcmp(thread, stop_thread);
+}
+
+static void session_halted(struct session *sess, struct session_conn *sc, const char *pkt, size_t len)
+{
+    if (sess->gen == s_gen && session_same_stop(sess, pkt, len)) {
+        if (!sc->halt_valid) {
+            /* nothing ran since the thread list was read, by this connection or the previous one */
+            ESP_LOGD(TAG, "halt of the previous session, its thread list is kept");
+            s_stats.resumed++;
+        }
+        sc->halt_valid = true;
+        return;
+    }
+
+    session_drop_halt(sess);
+    sess->stop = server_rsp_dup(pkt, len);
+    sess->stop_len = sess->stop ? len : 0;
+    sess->gen = s_gen;
+    sc->halt_valid = true;
+}
+
+static rsp_action_t session_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                       size_t len)
+{
+    struct session_conn *sc = &s_conns[server_rsp_index(conn)];
+    struct session *sess = &s_sessions[sc->target];
+
+    if (!req_len) {
+        return RSP_PASS;
+    }
+    if (server_rsp_is_stop(pkt, len) && (req[0] == '?' || server_rsp_is_resume(req, req_len))) {
+        session_halted(sess, sc, pkt, len);
+        return RSP_PASS;
+    }
+
+    session_kind_t kind = session_kind(req, req_len);
+    /* a request longer than the head kept by the interposer can't be matched */
+    if (kind == SESSION_NONE || req_len >= RSP_REQ_HEAD_SIZE || !len || pkt[0] == 'E') {
+        return RSP_PASS;
+    }
+    if (kind == SESSION_HALT && session_halt_valid(sess, sc)) {
+        session_store(sess, kind, req, req_len, session_seq(sc, req, req_len), pkt, len);
+    } else if (kind == SESSION_STATIC) {
+        session_store(sess, kind, req, req_len, 0, pkt, len);
+    }
+    session_answered(sc, req, req_len);
+    return RSP_PASS;
+}
+
+static void session_open(struct rsp_conn *conn)
+{
+    struct session_conn *sc = &s_conns[server_rsp_index(conn)];
+    int target = server_rsp_target(conn);
+
+    memset(sc, 0, sizeof(*sc));
+    sc->target = target >= 0 && target < SERVER_GDB_PORT_COUNT ? target : 0;
+}
+
+static void session_close(struct rsp_conn *conn)
+{
+    struct session_conn *sc = &s_conns[server_rsp_index(conn)];
+
+    /* the session stays with the target for the next connection */
+    memset(sc, 0, sizeof(*sc));
+}
+
+const struct rsp_feature server_session_feature = {
+    .open = session_open,
+    .close = session_close,
+    .request = session_request_hook,
+    .reply = session_reply_hook,
+};
+
+bool server_session_has_threads(struct rsp_conn *conn, const char *stop, size_t len)
+{
+    struct session *sess = &s_sessions[s_conns[server_rsp_index(conn)].target];
+
+    if (sess->gen != s_gen || !session_same_stop(sess, stop, len)) {
+        return false;
+    }
+    for (size_t i = 0; i < SESSION_MAX_ENTRIES; i++) {
+        if (sess->entries[i].req && sess->entries[i].kind == SESSION_HALT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void server_session_touch(void)
+{
+    s_gen++;
+}
+
+static void server_session_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "hits", s_stats.hits);
+    cJSON_AddNumberToObject(obj, "threadListHits", s_stats.halt_hits);
+    cJSON_AddNumberToObject(obj, "stored", s_stats.stored);
+    cJSON_AddNumberToObject(obj, "full", s_stats.full);
+    cJSON_AddNumberToObject(obj, "sessionsResumed", s_stats.resumed);
+    cJSON_AddNumberToObject(obj, "cachedKB", s_stats.bytes / 1024);
+}
+
+void server_session_init(void)
+{
+    metrics_register("session", server_session_metrics);
+}
@@ -0,0 +1,331 @@
+/*
+    Link time shim of the lwIP socket calls used by OpenOCD's servers.
+
+    Connections accepted on the gdb, telnet and tcl ports are tracked, so the rest of the
+    application can see what OpenOCD is serving without touching OpenOCD sources.
+    Every other socket (web server, self-test, ...) is passed through untouched.
+
+    Remote connections get TCP keepalive: a client gone with the Wi-Fi link is found within
+    SERVER_KEEPALIVE_IDLE_S plus the probes, and OpenOCD closes its connection and frees the port,
+    instead of waiting for a write to time out.
+*/
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "server_priv.h"
+#include "metrics.h"
+
+static const char *TAG = "server-shim";
+
+struct server_conn {
+    int fd;                     /* -1 when the slot is free */
+    server_conn_type_t type;
+    bool local;                 /* peer is on the loopback interface */
+};
+
+static struct server_conn s_conns[SERVER_SHIM_MAX_CONNS] = {
+    [0 ... SERVER_SHIM_MAX_CONNS - 1] = { .fd = -1 }
+};
+static struct server_shim_stats s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool server_conn_type_from_port(uint16_t port, server_conn_type_t *type)
+{
+    if (port >= SERVER_GDB_PORT && port < SERVER_GDB_PORT + SERVER_GDB_PORT_COUNT) {
+        *type = SERVER_CONN_GDB;
+    } else if (port == SERVER_TELNET_PORT) {
+        *type = SERVER_CONN_TELNET;
+    } else if (port == SERVER_TCL_PORT) {
+        *type = SERVER_CONN_TCL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#if CONFIG_SERVER_KEEPALIVE_ENABLE
+static void server_conn_keepalive(int fd)
+{
+    int on = 1;
+    int idle = CONFIG_SERVER_KEEPALIVE_IDLE_S;
+    int interval = CONFIG_SERVER_KEEPALIVE_INTERVAL_S;
+    int count = CONFIG_SERVER_KEEPALIVE_COUNT;
+
+    if (lwip_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0 ||
+            lwip_setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0 ||
+            lwip_setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) != 0 ||
+            lwip_setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0) {
+        ESP_LOGW(TAG, "Keepalive not set on (%d) (%d)", fd, errno);
+    }
+}
+#else
+static inline void server_conn_keepalive(int fd) {}
+#endif
+
+static struct server_conn *server_conn_find(int fd)
+{
+    for (size_t i = 0; i < SERVER_SHIM_MAX_CONNS; i++) {
+        if (s_conns[i].fd == fd) {
+            return &s_conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void server_conn_add(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    server_conn_type_t type;
+
+    if (lwip_getsockname(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET) {
+        return;
+    }
+    uint16_t port = ntohs(addr.sin_port);
+    if (!server_conn_type_from_port(port, &type)) {
+        return;
+    }
+
+    len = sizeof(addr);
+    bool local = lwip_getpeername(fd, (struct sockaddr *)&addr, &len) == 0 &&
+                 (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+
+    portENTER_CRITICAL(&s_lock);
+    struct server_conn *conn = server_conn_find(-1);
+    if (conn) {
+        conn->fd = fd;
+        conn->type = type;
+        conn->local = local;
+        if (!local) {
+            s_stats.clients[type]++;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (!conn) {
+        ESP_LOGW(TAG, "No free slot to track the connection (%d)", fd);
+    } else if (!local) {
+        server_conn_keepalive(fd);
+        server_coalesce_open(conn - s_conns, fd);
+        if (type == SERVER_CONN_GDB) {
+            server_rsp_open(conn - s_conns, fd, port - SERVER_GDB_PORT);
+        }
+    }
+}
+
+static void server_conn_remove(int fd)
+{
+    int slot = server_conn_slot(fd);
+    if (slot >= 0) {
+        server_rsp_close(slot);
+        /* pending output goes out before the connection is closed */
+        server_coalesce_close(slot);
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    struct server_conn *conn = server_conn_find(fd);
+    if (conn) {
+        if (!conn->local) {
+            s_stats.clients[conn->type]--;
+        }
+        conn->fd = -1;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+int server_conn_slot(int fd)
+{
+    int slot = -1;
+
+    portENTER_CRITICAL(&s_lock);
+    struct server_conn *conn = server_conn_find(fd);
+    if (conn && !conn->local) {
+        slot = conn - s_conns;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    return slot;
+}
+
+void server_conn_count(int fd, ssize_t len, bool rx)
+{
+    if (len <= 0) {
+        return;
+    }
+
+    bool command = false;
+
+    portENTER_CRITICAL(&s_lock);
+    struct server_conn *conn = server_conn_find(fd);
+    /* traffic of the application's own loopback clients is not interesting */
+    if (conn && !conn->local) {
+        if (rx) {
+            s_stats.rx_packets++;
+            s_stats.rx_bytes += len;
+            command = conn->type != SERVER_CONN_GDB;
+        } else {
+            s_stats.tx_packets++;
+            s_stats.tx_bytes += len;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (command) {
+        /* a telnet or tcl command can resume or reset the target behind gdb's back */
+        server_session_touch();
+    }
+}
+
+int __wrap_lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int fd = __real_lwip_accept(s, addr, addrlen);
+    if (fd >= 0) {
+        server_conn_add(fd);
+    }
+    return fd;
+}
+
+int __wrap_lwip_close(int s)
+{
+    /* forget the fd first, it can be reused by another task as soon as it is closed */
+    server_conn_remove(s);
+    return __real_lwip_close(s);
+}
+
+ssize_t server_conn_send(int slot, int fd, const void *data, size_t size)
+{
+#if CONFIG_SERVER_COALESCE_ENABLE
+    return server_coalesce_write(slot, fd, data, size);
+#else
+    ssize_t ret = __real_lwip_send(fd, data, size, 0);
+    server_conn_count(fd, ret, false);
+    return ret;
+#endif
+}
+
+static inline void server_conn_before_read(int slot)
+{
+#if CONFIG_SERVER_COALESCE_ENABLE
+    /* the peer can't answer what it hasn't received yet */
+    if (slot >= 0) {
+        server_coalesce_flush(slot);
+    }
+#endif
+}
+
+ssize_t __wrap_lwip_read(int s, void *mem, size_t len)
+{
+    int slot = server_conn_slot(s);
+    server_conn_before_read(slot);
+    if (server_rsp_is_open(slot)) {
+        return server_rsp_read(slot, mem, len);
+    }
+    ssize_t ret = __real_lwip_read(s, mem, len);
+    server_conn_count(s, ret, true);
+    return ret;
+}
+
+ssize_t __wrap_lwip_recv(int s, void *mem, size_t len, int flags)
+{
+    int slot = server_conn_slot(s);
+    server_conn_before_read(slot);
+    if (server_rsp_is_open(slot) && !(flags & MSG_PEEK)) {
+        return server_rsp_read(slot, mem, len);
+    }
+    ssize_t ret = __real_lwip_recv(s, mem, len, flags);
+    server_conn_count(s, ret, true);
+    return ret;
+}
+
+ssize_t __wrap_lwip_write(int s, const void *dataptr, size_t size)
+{
+    int slot = server_conn_slot(s);
+    if (server_rsp_is_open(slot)) {
+        return server_rsp_write(slot, dataptr, size);
+    }
+#if CONFIG_SERVER_COALESCE_ENABLE
+    if (slot >= 0) {
+        return server_coalesce_write(slot, s, dataptr, size);
+    }
+#endif
+    ssize_t ret = __real_lwip_write(s, dataptr, size);
+    server_conn_count(s, ret, false);
+    return ret;
+}
+
+ssize_t __wrap_lwip_send(int s, const void *dataptr, size_t size, int flags)
+{
+    int slot = server_conn_slot(s);
+    if (server_rsp_is_open(slot)) {
+        return server_rsp_write(slot, dataptr, size);
+    }
+#if CONFIG_SERVER_COALESCE_ENABLE
+    if (slot >= 0) {
+        if (!flags) {
+            return server_coalesce_write(slot, s, dataptr, size);
+        }
+        server_coalesce_flush(slot);
+    }
+#endif
+    ssize_t ret = __real_lwip_send(s, dataptr, size, flags);
+    server_conn_count(s, ret, false);
+    return ret;
+}
+
+int __wrap_lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
+                       struct timeval *timeout)
+{
+    if (!server_loop_is_loop_task()) {
+        return __real_lwip_select(maxfdp1, readset, writeset, exceptset, timeout);
+    }
+
+    /* OpenOCD is done with the current command when it goes back to wait for the next one */
+    server_coalesce_flush_all();
+    return server_loop_select(maxfdp1, readset, writeset, exceptset, timeout);
+}
+
+void server_shim_get_stats(struct server_shim_stats *stats)
+{
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void server_shim_metrics(cJSON *obj)
+{
+    struct server_shim_stats stats;
+
+    server_shim_get_stats(&stats);
+
+    cJSON_AddNumberToObject(obj, "gdbClients", stats.clients[SERVER_CONN_GDB]);
+    cJSON_AddNumberToObject(obj, "telnetClients", stats.clients[SERVER_CONN_TELNET]);
+    cJSON_AddNumberToObject(obj, "tclClients", stats.clients[SERVER_CONN_TCL]);
+    cJSON_AddNumberToObject(obj, "rxPackets", stats.rx_packets);
+    cJSON_AddNumberToObject(obj, "txPackets", stats.tx_packets);
+    cJSON_AddNumberToObject(obj, "rxBytes", stats.rx_bytes);
+    cJSON_AddNumberToObject(obj, "txBytes", stats.tx_bytes);
+}
+
+void server_shim_init(void)
+{
+    server_coalesce_init();
+    server_rsp_init();
+    metrics_register("server", server_shim_metrics);
+}
+
+bool server_shim_has_remote_clients(void)
+{
+    struct server_shim_stats stats;
+
+    server_shim_get_stats(&stats);
+
+    for (size_t i = 0; i < SERVER_CONN_TYPE_MAX; i++) {
+        if (stats.clients[i]) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* OpenOCD default server ports. gdb port is incremented for each target */
+#define SERVER_GDB_PORT             3333
+#define SERVER_GDB_PORT_COUNT       8
+#define SERVER_TELNET_PORT          4444
+#define SERVER_TCL_PORT             6666
+
+#define SERVER_SHIM_MAX_CONNS       8
+
+typedef enum {
+    SERVER_CONN_GDB,
+    SERVER_CONN_TELNET,
+    SERVER_CONN_TCL,
+    SERVER_CONN_TYPE_MAX,
+} server_conn_type_t;
+
+struct server_shim_stats {
+    uint32_t clients[SERVER_CONN_TYPE_MAX];     /* connected remote clients, loopback clients are not counted */
+    uint32_t rx_packets;                        /* read calls which returned data */
+    uint32_t tx_packets;                        /* write calls */
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+};
+
+/*
+ * OpenOCD's server sockets are observed by wrapping the lwIP socket calls at link time
+ * (see the --wrap options in main/CMakeLists.txt). OpenOCD sources stay untouched.
+ */
+void server_shim_init(void);
+void server_shim_get_stats(struct server_shim_stats *stats);
+bool server_shim_has_remote_clients(void);
+
+/* Must be called from the task which runs openocd_main(), before OpenOCD starts its servers */
+void server_loop_attach(void);
+/* Makes OpenOCD's server loop run its timers (target polling) without waiting for the timeout */
+void server_loop_wakeup(void);
+
+#if CONFIG_SERVER_STEP_ENABLE
+/* Definition of the `step_n` and `step_until` Tcl commands, passed to OpenOCD with -c */
+const char *server_step_tcl_script(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,381 @@
+/*
+    Step engine of the debugger.
+
+    gdb's `next`, `step` and `until` single-step through code without line info, or through every
+    instruction of a line, one `vCont;s` round trip over Wi-Fi at a time. With range stepping
+    (`r` in the vCont? reply) gdb sends `vCont;r<start>,<end>` instead: "step while the pc stays in
+    [start, end)". OpenOCD doesn't support it, so the loop is run here: `s` and a read of the pc
+    are sent to OpenOCD until the pc leaves the range, and gdb gets the last stop reply.
+
+    The loop also stops at a breakpoint gdb inserted, on a stop which isn't a step (signal other
+    than SIGTRAP, exit), on ^C from gdb and after SERVER_STEP_MAX_STEPS steps, gdb asks for
+    another range if it has to. server_bp comes first and answers most z0 itself, the software
+    breakpoints it tracks are looked up there, the others are tracked from gdb's Z and z packets.
+
+    The same loops are available from telnet and tcl as `step_n <count>` and
+    `step_until <start> <end> ?max?`, Tcl commands defined in OpenOCD at start.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "server_shim.h"
+#include "metrics.h"
+
+#define STEP_MAX_BREAKPOINTS    64
+
+#define STEP_STR2(x)            #x
+#define STEP_STR(x)             STEP_STR2(x)
+
+static const char *TAG = "server-step";
+
+static const char *s_tcl_script =
+    "proc step_pc {} {\n"
+    "    regexp {0x[0-9a-fA-F]+} [reg pc] pc\n"
+    "    return $pc\n"
+    "}\n"
+    "proc step_n {{count 1}} {\n"
+    "    for {set i 0} {$i < $count} {incr i} { step }\n"
+    "    return [step_pc]\n"
+    "}\n"
+    "proc step_until {start end {max " STEP_STR(CONFIG_SERVER_STEP_MAX_STEPS) "}} {\n"
+    "    set n 0\n"
+    "    set pc [step_pc]\n"
+    "    while {$pc >= $start && $pc < $end && $n < $max} {\n"
+    "        step\n"
+    "        incr n\n"
+    "        set pc [step_pc]\n"
+    "    }\n"
+    "    return \"$n $pc\"\n"
+    "}\n";
+
+struct step_conn {
+    bool active;
+    uint32_t start;
+    uint32_t end;
+    char *req;                          /* gdb's vCont;r, the stop reply goes to it */
+    size_t req_len;
+    char *stop;                         /* last stop reply */
+    size_t stop_len;
+    uint32_t steps;
+    uint32_t interrupts;                /* ^C count when the range started */
+    int pc_try;
+    uint32_t bps[STEP_MAX_BREAKPOINTS];
+    size_t bp_count;
+    bool bps_overflow;
+};
+
+static struct step_conn s_step[SERVER_SHIM_MAX_CONNS];
+
+static const int s_pc_regs[] = RSP_PC_REG_CANDIDATES;
+
+static struct {
+    uint32_t ranges;
+    uint32_t steps;
+    uint32_t fallbacks;                 /* ranges sent to OpenOCD as a single step */
+    uint32_t max_steps;
+    uint32_t limited;                   /* ranges stopped at SERVER_STEP_MAX_STEPS */
+} s_stats;
+
+static void step_bp_insert(struct step_conn *st, uint32_t addr)
+{
+    for (size_t i = 0; i < st->bp_count; i++) {
+        if (st->bps[i] == addr) {
+            return;
+        }
+    }
+    if (st->bp_count == STEP_MAX_BREAKPOINTS) {
+        st->bps_overflow = true;
+        return;
+    }
+    st->bps[st->bp_count++] = addr;
+}
+
+static void step_bp_remove(struct step_conn *st, uint32_t addr)
+{
+    for (size_t i = 0; i < st->bp_count; i++) {
+        if (st->bps[i] == addr) {
+            st->bps[i] = st->bps[--st->bp_count];
+            return;
+        }
+    }
+}
+
+static bool step_at_breakpoint(struct rsp_conn *conn, const struct step_conn *st, uint32_t pc)
+{
+    bool wanted;
+
+    if (server_bp_lookup(conn, pc, &wanted) && wanted) {
+        return true;
+    }
+    if (st->bps_overflow) {
+        /* not all of them are known, any could be here */
+        return true;
+    }
+    for (size_t i = 0; i < st->bp_count; i++) {
+        if (st->bps[i] == pc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void step_finish(struct rsp_conn *conn, struct step_conn *st)
+{
+    char *req = st->req;
+    size_t req_len = st->req_len;
+    char *stop = st->stop;
+    size_t stop_len = st->stop_len;
+
+    st->active = false;
+    st->req = NULL;
+    st->stop = NULL;
+    if (st->steps > s_stats.max_steps) {
+        s_stats.max_steps = st->steps;
+    }
+    if (stop) {
+        server_rsp_deliver(conn, req, req_len, stop, stop_len);
+    } else {
+        /* nothing was stepped, OpenOCD does a plain step and gdb asks for the next one */
+        s_stats.fallbacks++;
+        server_rsp_pass(conn, &server_step_feature, "s", 1);
+    }
+    free(req);
+    free(stop);
+}
+
+static uint32_t step_parse_le(const char *hex, size_t len)
+{
+    uint32_t value = 0;
+
+    for (size_t i = 0; i + 2 <= len && i < 8; i += 2) {
+        const char *digit = hex + i;
+        value |= server_rsp_parse_hex(&digit, hex + i + 2) << (i * 4);
+    }
+    return value;
+}
+
+static void step_pc_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+
+static void step_read_pc(struct rsp_conn *conn, struct step_conn *st)
+{
+    int reg = server_rsp_pc_reg() >= 0 ? server_rsp_pc_reg() : s_pc_regs[st->pc_try];
+    char req[16];
+    int n = snprintf(req, sizeof(req), "p%x", reg);
+
+    if (server_rsp_request(conn, req, n, step_pc_cb, (void *)(intptr_t)reg) != ESP_OK) {
+        step_finish(conn, st);
+    }
+}
+
+static void step_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct step_conn *st = &s_step[server_rsp_index(conn)];
+
+    if (!st->active) {
+        return;
+    }
+    if (!reply) {
+        /* the connection is closing */
+        step_finish(conn, st);
+        return;
+    }
+
+    free(st->stop);
+    st->stop = server_rsp_dup(reply, len);
+    st->stop_len = st->stop ? len : 0;
+    st->steps++;
+    s_stats.steps++;
+
+    bool trap = len >= 3 && (reply[0] == 'T' || reply[0] == 'S') && reply[1] == '0' && reply[2] == '5';
+    if (!trap || !st->stop || server_rsp_interrupts(conn) != st->interrupts) {
+        step_finish(conn, st);
+        return;
+    }
+    if (st->steps >= CONFIG_SERVER_STEP_MAX_STEPS) {
+        s_stats.limited++;
+        step_finish(conn, st);
+        return;
+    }
+    step_read_pc(conn, st);
+}
+
+static void step_one(struct rsp_conn *conn, struct step_conn *st)
+{
+    if (server_rsp_request(conn, "s", 1, step_cb, NULL) != ESP_OK) {
+        step_finish(conn, st);
+    }
+}
+
+static void step_pc_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct step_conn *st = &s_step[server_rsp_index(conn)];
+    int reg = (int)(intptr_t)arg;
+
+    if (!st->active) {
+        return;
+    }
+    if (!reply || !len || reply[0] == 'E') {
+        step_finish(conn, st);
+        return;
+    }
+
+    uint32_t pc = step_parse_le(reply, len);
+    bool in_range = pc >= st->start && pc < st->end;
+
+    if (server_rsp_pc_reg() < 0) {
+        /* before the first step the pc is in the range, that tells which register it is */
+        if (in_range) {
+            server_rsp_set_pc_reg(reg);
+            step_one(conn, st);
+        } else if (++st->pc_try < (int)(sizeof(s_pc_regs) / sizeof(s_pc_regs[0]))) {
+            step_read_pc(conn, st);
+        } else {
+            ESP_LOGD(TAG, "pc not found, range [0x%" PRIx32 ", 0x%" PRIx32 ") sent as a step", st->start, st->end);
+            step_finish(conn, st);
+        }
+        return;
+    }
+
+    if (!in_range || step_at_breakpoint(conn, st, pc)) {
+        step_finish(conn, st);
+        return;
+    }
+    step_one(conn, st);
+}
+
+static rsp_action_t step_range(struct rsp_conn *conn, struct step_conn *st, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("vCont;r");
+
+    uint32_t start = server_rsp_parse_hex(&p, end);
+    if (p == end || *p != ',') {
+        return RSP_PASS;
+    }
+    p++;
+    uint32_t stop = server_rsp_parse_hex(&p, end);
+
+    free(st->req);
+    st->req = server_rsp_dup(pkt, len);
+    if (!st->req) {
+        return RSP_PASS;
+    }
+    st->req_len = len;
+    st->start = start;
+    st->end = stop;
+    st->steps = 0;
+    st->pc_try = 0;
+    st->interrupts = server_rsp_interrupts(conn);
+    st->active = true;
+    s_stats.ranges++;
+
+    if (server_rsp_pc_reg() >= 0) {
+        step_one(conn, st);
+    } else {
+        step_read_pc(conn, st);
+    }
+    return RSP_DONE;
+}
+
+/* adds range stepping to OpenOCD's vCont actions */
+static void step_vcont_actions(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt, size_t len)
+{
+    char *reply = malloc(len + 3);
+
+    if (!reply) {
+        server_rsp_release(conn, &server_step_feature, req, req_len, pkt, len);
+        return;
+    }
+    memcpy(reply, pkt, len);
+    memcpy(reply + len, ";r", 3);
+    server_rsp_release(conn, &server_step_feature, req, req_len, reply, len + 2);
+    free(reply);
+}
+
+static rsp_action_t step_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct step_conn *st = &s_step[server_rsp_index(conn)];
+
+    if (len > 3 && (pkt[0] == 'Z' || pkt[0] == 'z') && (pkt[1] == '0' || pkt[1] == '1') && pkt[2] == ',') {
+        const char *p = pkt + 3;
+        uint32_t addr = server_rsp_parse_hex(&p, pkt + len);
+        bool wanted;
+
+        /* server_bp answers the z0 of the breakpoints it tracks, step_at_breakpoint() asks it for them */
+        if (pkt[1] == '0' && server_bp_lookup(conn, addr, &wanted)) {
+            return RSP_PASS;
+        }
+        if (pkt[0] == 'Z') {
+            step_bp_insert(st, addr);
+        } else {
+            step_bp_remove(st, addr);
+        }
+        return RSP_PASS;
+    }
+    if (server_rsp_starts_with(pkt, len, "vCont;r")) {
+        return step_range(conn, st, pkt, len);
+    }
+    return RSP_PASS;
+}
+
+static rsp_action_t step_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                    size_t len)
+{
+    if (req_len == 6 && !memcmp(req, "vCont?", 6) && server_rsp_starts_with(pkt, len, "vCont") &&
+            !server_rsp_starts_with(pkt + len - 2, 2, ";r")) {
+        step_vcont_actions(conn, req, req_len, pkt, len);
+        return RSP_DONE;
+    }
+    return RSP_PASS;
+}
+
+static void step_open(struct rsp_conn *conn)
+{
+    struct step_conn *st = &s_step[server_rsp_index(conn)];
+
+    memset(st, 0, sizeof(*st));
+}
+
+static void step_close(struct rsp_conn *conn)
+{
+    struct step_conn *st = &s_step[server_rsp_index(conn)];
+
+    free(st->req);
+    free(st->stop);
+    memset(st, 0, sizeof(*st));
+}
+
+const struct rsp_feature server_step_feature = {
+    .open = step_open,
+    .close = step_close,
+    .request = step_request_hook,
+    .reply = step_reply_hook,
+};
+
+const char *server_step_tcl_script(void)
+{
+    return s_tcl_script;
+}
+
+static void server_step_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "ranges", s_stats.ranges);
+    cJSON_AddNumberToObject(obj, "steps", s_stats.steps);
+    cJSON_AddNumberToObject(obj, "stepsPerRange", s_stats.ranges ? (double)s_stats.steps / s_stats.ranges : 0);
+    cJSON_AddNumberToObject(obj, "maxSteps", s_stats.max_steps);
+    cJSON_AddNumberToObject(obj, "limited", s_stats.limited);
+    cJSON_AddNumberToObject(obj, "fallbacks", s_stats.fallbacks);
+}
+
+void server_step_init(void)
+{
+    metrics_register("step", server_step_metrics);
+}
@@ -0,0 +1,434 @@
+/*
+    Thread register cache of the gdb connections.
+
+    With an RTOS, gdb and the IDEs built on it read the registers of every thread on each halt
+    (`Hg<thread>` then `g`) to show their call stacks. OpenOCD's FreeRTOS support reads them from
+    the saved context on the stack of the task, found through its TCB, a few JTAG reads per task.
+    A task which hasn't run since the previous halt has the same context, so its `g` reply is kept.
+
+    The thread id given by OpenOCD is the address of the TCB. On the first `g` of a thread after a
+    halt, the head of its TCB is read in one go: the top of stack and the state and event list
+    items. Then SERVER_THREAD_CACHE_CONTEXT_BYTES from the top of stack, the context saved when the
+    task was switched out, from which OpenOCD decodes the registers. The registers are sent without
+    asking OpenOCD only if the head is the same and the checksum of the saved context is the same
+    as when they were cached: a task which ran and blocked again at the same depth saved another
+    context. The tasks running on a core at the halt are never answered from the cache, their TCBs
+    aren't updated while they run. They are read from pxCurrentTCBs, whose address is learned from
+    gdb's answer to OpenOCD's symbol lookup.
+
+    The cache is dropped on any write (memory, registers, flash).
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+/* pxTopOfStack, xStateListItem and xEventListItem */
+#define THREADS_TCB_HEAD_BYTES      44
+/* pxCurrentTCBs[portNUM_PROCESSORS] of the dual core chips, single core ones read a word past it */
+#define THREADS_MAX_CORES           2
+
+static const char *TAG = "server-threads";
+
+struct thread_entry {
+    uint32_t tid;                       /* 0 when the entry is free */
+    uint32_t checked;                   /* halt the head was found unchanged at */
+    char head[THREADS_TCB_HEAD_BYTES * 2];
+    uint64_t context_sum;               /* of the saved context the registers were read from */
+    char *regs;
+    size_t regs_len;
+};
+
+struct thread_cache {
+    struct thread_entry *entries;
+    uint32_t halt;                      /* halts seen on this connection */
+    bool halted;
+    uint32_t stop_tid;
+    uint32_t running[THREADS_MAX_CORES];
+    uint32_t running_halt;              /* halt the running tasks were read at */
+    uint32_t running_asked;             /* halt they were requested at */
+    uint32_t gthread;                   /* thread selected by Hg, 0 for the stopped one */
+    uint32_t parked_tid;                /* `g` held back while the head and the context are read */
+    char parked_head[THREADS_TCB_HEAD_BYTES * 2];
+    uint32_t fill_tid;                  /* `g` sent to OpenOCD, its reply goes to the cache */
+};
+
+static struct thread_cache s_threads[SERVER_SHIM_MAX_CONNS];
+
+/* address of pxCurrentTCBs, the same for every connection to the target */
+static uint32_t s_current_tcbs;
+
+static struct {
+    uint32_t halts;
+    uint32_t checks;                    /* TCB heads read */
+    uint32_t saved;                     /* `g` answered from the cache */
+    uint32_t misses;
+    uint32_t last_halt_saved;
+} s_stats;
+
+static uint32_t threads_parse_id(const char *p, const char *end)
+{
+    /* multiprocess form p<pid>.<tid> */
+    if (p < end && *p == 'p') {
+        while (p < end && *p != '.') {
+            p++;
+        }
+        p++;
+    }
+    if (p < end && *p == '-') {
+        return 0;
+    }
+    return server_rsp_parse_hex(&p, end);
+}
+
+static struct thread_entry *threads_find(struct thread_cache *tc, uint32_t tid)
+{
+    for (size_t i = 0; tc->entries && i < CONFIG_SERVER_THREAD_CACHE_SIZE; i++) {
+        if (tc->entries[i].tid == tid) {
+            return &tc->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* entry of `tid`, the least recently checked one is reused when the cache is full */
+static struct thread_entry *threads_get(struct thread_cache *tc, uint32_t tid)
+{
+    struct thread_entry *entry = threads_find(tc, tid);
+    if (entry) {
+        return entry;
+    }
+    if (!tc->entries) {
+        tc->entries = calloc(CONFIG_SERVER_THREAD_CACHE_SIZE, sizeof(*tc->entries));
+        if (!tc->entries) {
+            return NULL;
+        }
+    }
+
+    entry = &tc->entries[0];
+    for (size_t i = 0; i < CONFIG_SERVER_THREAD_CACHE_SIZE && entry->tid; i++) {
+        if (!tc->entries[i].tid || tc->entries[i].checked < entry->checked) {
+            entry = &tc->entries[i];
+        }
+    }
+    free(entry->regs);
+    memset(entry, 0, sizeof(*entry));
+    entry->tid = tid;
+    return entry;
+}
+
+static void threads_drop(struct thread_cache *tc)
+{
+    for (size_t i = 0; tc->entries && i < CONFIG_SERVER_THREAD_CACHE_SIZE; i++) {
+        free(tc->entries[i].regs);
+        memset(&tc->entries[i], 0, sizeof(tc->entries[i]));
+    }
+    tc->fill_tid = 0;
+}
+
+static bool threads_is_running(const struct thread_cache *tc, uint32_t tid)
+{
+    if (tc->running_halt != tc->halt) {
+        /* not known, the task may be running */
+        return true;
+    }
+    for (int i = 0; i < THREADS_MAX_CORES; i++) {
+        if (tc->running[i] == tid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void threads_hit(struct rsp_conn *conn, const struct thread_entry *entry)
+{
+    server_rsp_reply(conn, entry->regs, entry->regs_len);
+    s_stats.saved++;
+    s_stats.last_halt_saved++;
+}
+
+static void threads_running_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+
+    if (!reply || (uint32_t)(uintptr_t)arg != tc->halt || len != THREADS_MAX_CORES * 8) {
+        return;
+    }
+    for (int i = 0; i < THREADS_MAX_CORES; i++) {
+        const char *p = reply + i * 8;
+        uint32_t tcb = 0;
+        /* little endian words */
+        for (int b = 0; b < 4; b++) {
+            const char *digit = p + b * 2;
+            tcb |= server_rsp_parse_hex(&digit, p + b * 2 + 2) << (b * 8);
+        }
+        tc->running[i] = tcb;
+    }
+    tc->running_halt = tc->halt;
+}
+
+/* FNV-1a of the hex reply */
+static uint64_t threads_checksum(const char *data, size_t len)
+{
+    uint64_t sum = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        sum = (sum ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+static void threads_miss(struct rsp_conn *conn)
+{
+    s_stats.misses++;
+    server_rsp_forward(conn, "g", 1);
+}
+
+static void threads_context_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+    uint32_t tid = tc->parked_tid;
+
+    tc->parked_tid = 0;
+    if (!tid) {
+        return;
+    }
+
+    struct thread_entry *entry = threads_find(tc, tid);
+    if (entry && reply && len == CONFIG_SERVER_THREAD_CACHE_CONTEXT_BYTES * 2 && reply[0] != 'E') {
+        uint64_t sum = threads_checksum(reply, len);
+        if (entry->regs && !memcmp(entry->head, tc->parked_head, sizeof(entry->head)) && entry->context_sum == sum) {
+            entry->checked = tc->halt;
+            threads_hit(conn, entry);
+            return;
+        }
+        memcpy(entry->head, tc->parked_head, sizeof(entry->head));
+        entry->context_sum = sum;
+        free(entry->regs);
+        entry->regs = NULL;
+        tc->fill_tid = tid;
+    }
+    threads_miss(conn);
+}
+
+static void threads_head_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+    uint32_t tid = tc->parked_tid;
+
+    if (!tid) {
+        return;
+    }
+
+    struct thread_entry *entry = threads_find(tc, tid);
+    if (entry && reply && len == sizeof(entry->head) && !threads_is_running(tc, tid)) {
+        /* pxTopOfStack, the first word of the TCB */
+        uint32_t top = 0;
+        for (int b = 0; b < 4; b++) {
+            const char *digit = reply + b * 2;
+            top |= server_rsp_parse_hex(&digit, reply + b * 2 + 2) << (b * 8);
+        }
+
+        char req[32];
+        int n = snprintf(req, sizeof(req), "m%" PRIx32 ",%x", top, CONFIG_SERVER_THREAD_CACHE_CONTEXT_BYTES);
+        if (server_rsp_request(conn, req, n, threads_context_cb, NULL) == ESP_OK) {
+            memcpy(tc->parked_head, reply, len);
+            return;
+        }
+    }
+
+    tc->parked_tid = 0;
+    threads_miss(conn);
+}
+
+/* the running tasks are read once per halt, before the first TCB head */
+static bool threads_request_running(struct rsp_conn *conn, struct thread_cache *tc)
+{
+    char req[32];
+
+    if (tc->running_asked == tc->halt) {
+        return true;
+    }
+    int n = snprintf(req, sizeof(req), "m%" PRIx32 ",%x", s_current_tcbs, THREADS_MAX_CORES * 4);
+    if (server_rsp_request(conn, req, n, threads_running_cb, (void *)(uintptr_t)tc->halt) != ESP_OK) {
+        return false;
+    }
+    tc->running_asked = tc->halt;
+    return true;
+}
+
+static rsp_action_t threads_read_regs(struct rsp_conn *conn, struct thread_cache *tc)
+{
+    uint32_t tid = tc->gthread;
+
+    if (!tc->halted || !tid || tid == tc->stop_tid || !s_current_tcbs) {
+        return RSP_PASS;
+    }
+    if (tc->running_halt == tc->halt && threads_is_running(tc, tid)) {
+        return RSP_PASS;
+    }
+
+    struct thread_entry *entry = threads_get(tc, tid);
+    if (!entry) {
+        return RSP_PASS;
+    }
+    if (entry->checked == tc->halt && entry->regs) {
+        threads_hit(conn, entry);
+        return RSP_DONE;
+    }
+
+    char req[32];
+    int n = snprintf(req, sizeof(req), "m%" PRIx32 ",%x", tid, THREADS_TCB_HEAD_BYTES);
+    if (!threads_request_running(conn, tc) ||
+            server_rsp_request(conn, req, n, threads_head_cb, NULL) != ESP_OK) {
+        return RSP_PASS;
+    }
+    tc->parked_tid = tid;
+    s_stats.checks++;
+    return RSP_DONE;
+}
+
+/* gdb's answer to OpenOCD's symbol lookup, qSymbol:<value>:<hex name> */
+static void threads_learn_symbol(const char *pkt, size_t len)
+{
+    static const char *const names[] = { "pxCurrentTCBs", "pxCurrentTCB" };
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("qSymbol:");
+
+    uint32_t value = server_rsp_parse_hex(&p, end);
+    if (p == pkt + strlen("qSymbol:") || p == end || *p != ':') {
+        return;
+    }
+    p++;
+
+    char name[32];
+    size_t n = 0;
+    while (p + 2 <= end && n < sizeof(name) - 1) {
+        const char *digit = p;
+        name[n++] = server_rsp_parse_hex(&digit, p + 2);
+        p += 2;
+    }
+    name[n] = '\0';
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(name, names[i]) && value != s_current_tcbs) {
+            ESP_LOGD(TAG, "%s at 0x%" PRIx32, name, value);
+            s_current_tcbs = value;
+        }
+    }
+}
+
+static rsp_action_t threads_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+
+    if (!len) {
+        return RSP_PASS;
+    }
+    if (server_rsp_is_resume(pkt, len)) {
+        tc->halted = false;
+        return RSP_PASS;
+    }
+    if (server_rsp_is_write(pkt, len)) {
+        threads_drop(tc);
+        return RSP_PASS;
+    }
+    if (server_rsp_starts_with(pkt, len, "qSymbol:")) {
+        threads_learn_symbol(pkt, len);
+        return RSP_PASS;
+    }
+    if (server_rsp_starts_with(pkt, len, "Hg")) {
+        tc->gthread = threads_parse_id(pkt + 2, pkt + len);
+        return RSP_PASS;
+    }
+    if (len == 1 && pkt[0] == 'g') {
+        return threads_read_regs(conn, tc);
+    }
+    return RSP_PASS;
+}
+
+static void threads_halted(struct thread_cache *tc, const char *pkt, size_t len)
+{
+    char thread[24];
+
+    tc->halt++;
+    tc->halted = true;
+    tc->gthread = 0;
+    s_stats.halts++;
+    s_stats.last_halt_saved = 0;
+
+    server_rsp_stop_thread(pkt, len, thread, sizeof(thread));
+    tc->stop_tid = threads_parse_id(thread, thread + strlen(thread));
+}
+
+static rsp_action_t threads_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                       size_t len)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+
+    if (tc->fill_tid && req_len == 1 && req[0] == 'g') {
+        struct thread_entry *entry = threads_find(tc, tc->fill_tid);
+        tc->fill_tid = 0;
+        if (entry && len && pkt[0] != 'E') {
+            free(entry->regs);
+            entry->regs = server_rsp_dup(pkt, len);
+            entry->regs_len = entry->regs ? len : 0;
+            entry->checked = tc->halt;
+        }
+        return RSP_PASS;
+    }
+
+    if (server_rsp_is_stop(pkt, len) && req_len && (server_rsp_is_resume(req, req_len) || req[0] == '?')) {
+        threads_halted(tc, pkt, len);
+    }
+    return RSP_PASS;
+}
+
+static void threads_open(struct rsp_conn *conn)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+
+    memset(tc, 0, sizeof(*tc));
+}
+
+static void threads_close(struct rsp_conn *conn)
+{
+    struct thread_cache *tc = &s_threads[server_rsp_index(conn)];
+
+    threads_drop(tc);
+    free(tc->entries);
+    memset(tc, 0, sizeof(*tc));
+}
+
+const struct rsp_feature server_threads_feature = {
+    .open = threads_open,
+    .close = threads_close,
+    .request = threads_request_hook,
+    .reply = threads_reply_hook,
+};
+
+static void server_threads_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    uint32_t halts = s_stats.halts;
+
+    cJSON_AddNumberToObject(obj, "halts", halts);
+    cJSON_AddNumberToObject(obj, "tcbChecks", s_stats.checks);
+    cJSON_AddNumberToObject(obj, "readsSaved", s_stats.saved);
+    cJSON_AddNumberToObject(obj, "misses", s_stats.misses);
+    cJSON_AddNumberToObject(obj, "readsSavedLastHalt", s_stats.last_halt_saved);
+    cJSON_AddNumberToObject(obj, "readsSavedPerHalt", halts ? (double)s_stats.saved / halts : 0);
+    cJSON_AddBoolToObject(obj, "currentTcbsKnown", s_current_tcbs != 0);
+}
+
+void server_threads_init(void)
+{
+    metrics_register("threadCache", server_threads_metrics);
+}
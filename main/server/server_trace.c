@@ -0,0 +1,1202 @@
+/*
+    gdb tracepoints, collected on the debugger.
+
+    OpenOCD doesn't support tracepoints, and a breakpoint with `commands` to print variables costs
+    a halt, the stop reply over Wi-Fi, gdb's reads and a continue for every hit. Here gdb's trace
+    packets (QTinit, QTDP, QTStart, QTStop, qTStatus, QTFrame, qTBuffer...) are answered locally:
+
+    - QTStart puts a hardware breakpoint (`Z1`) at every enabled tracepoint.
+    - When a continue stops at one of them, the stop is held, the registers (`R` action) and memory
+      ranges (`M` actions, absolute or relative to a register) are read from OpenOCD into a frame of
+      the trace buffer, the breakpoint is stepped over and gdb's continue is sent again. gdb never
+      sees the hit.
+    - tfind (QTFrame) selects a frame, gdb's `g`, `p` and `m` are then answered from it, what wasn't
+      collected is unavailable. tsave reads the buffer in bulk with qTBuffer.
+
+    The buffer is in PSRAM, frames are in gdbserver's layout (tpnum:16, size:32, then 'R' register
+    blocks and 'M' address:64 length:16 blocks, little endian), so qTBuffer sends it unchanged.
+    Tracing stops when the buffer is full or at a tracepoint's pass count, the target keeps running.
+
+    Not supported: agent expression collections (`X`, gdb compiles `collect` of expressions it can't
+    turn into ranges to them), while-stepping actions, trace state variables and disconnected tracing
+    (QTDisconnected gets an empty reply). When gdb goes away while tracing, the tracepoint breakpoints
+    are removed through the tcl server.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "server_priv.h"
+#include "server_rsp.h"
+#include "metrics.h"
+
+#define TRACE_MAX_TRACEPOINTS   16
+#define TRACE_MAX_RANGES        8
+#define TRACE_MAX_BREAKPOINTS   32
+/* bytes per `m` read, each is an 'M' block of the frame */
+#define TRACE_READ_CHUNK        1024
+/* hardware breakpoints don't patch the code, OpenOCD doesn't need the instruction size */
+#define TRACE_BP_KIND           4
+#define TRACE_FRAME_HEADER      6
+#define TRACE_NO_FRAME          -1
+
+static const char *TAG = "server-trace";
+
+typedef enum {
+    TRACE_NOT_RUN,
+    TRACE_RUNNING,
+    TRACE_STOPPED,                      /* QTStop */
+    TRACE_FULL,
+    TRACE_PASSCOUNT,
+} trace_status_t;
+
+/* what comes after the tracepoint breakpoints are inserted or removed */
+typedef enum {
+    TRACE_THEN_REPLY,                   /* answer gdb's QTStart or QTStop */
+    TRACE_THEN_RESUME,                  /* send gdb's continue again */
+} trace_then_t;
+
+struct trace_range {
+    uint32_t basereg;                   /* UINT32_MAX for an absolute address */
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct trace_point {
+    uint32_t num;
+    uint32_t addr;
+    bool enabled;
+    uint32_t pass;                      /* hits which stop the tracing, 0 for none */
+    bool regs;
+    struct trace_range ranges[TRACE_MAX_RANGES];
+    size_t range_count;
+    uint32_t hits;
+    bool inserted;
+};
+
+struct trace_conn {
+    struct trace_point *tps;
+    size_t tp_count;
+    trace_status_t status;
+    uint32_t stop_tp;                   /* tracepoint whose pass count stopped the tracing */
+    uint8_t *buf;                       /* frames, PSRAM */
+    size_t used;
+    uint32_t frames;
+    size_t regs_size;                   /* of the 'R' blocks, the size of a `g` reply */
+    int frame;                          /* selected by tfind, TRACE_NO_FRAME for the target */
+    size_t frame_off;
+    trace_then_t then;
+    bool failed;                        /* a breakpoint couldn't be inserted */
+    uint32_t bps[TRACE_MAX_BREAKPOINTS];    /* gdb's breakpoints, their hits are reported */
+    size_t bp_count;
+    bool bps_overflow;
+    /* the hit being collected */
+    char *resume;                       /* gdb's continue */
+    size_t resume_len;
+    char *stop;
+    size_t stop_len;
+    uint32_t interrupts;                /* ^C count when gdb sent the continue */
+    int pc_try;
+    uint32_t pc;
+    struct trace_point *hit;
+    size_t frame_start;
+    size_t range;
+    bool base_known;                    /* range_base was read, for a range relative to a register */
+    uint32_t range_base;
+    uint32_t range_done;
+    int64_t hit_us;
+};
+
+static struct trace_conn s_trace[SERVER_SHIM_MAX_CONNS];
+
+static const int s_pc_regs[] = RSP_PC_REG_CANDIDATES;
+
+static struct {
+    uint32_t hits;
+    uint32_t frames;
+    uint32_t reported;                  /* hits at a gdb breakpoint or after ^C */
+    uint32_t full;
+    uint32_t errors;                    /* failed reads, the frame lacks a block */
+    uint32_t skipped_actions;           /* unsupported actions of the tracepoints */
+    uint32_t frame_reads;               /* gdb's reads answered from a frame */
+    uint32_t max_collect_us;            /* from the stop to the continue */
+    size_t used;
+} s_stats;
+
+static void trace_step_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+static void trace_resumed_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+static void trace_collect(struct rsp_conn *conn, struct trace_conn *tc);
+
+static bool trace_hex_digit(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* hex of a reply to bytes, unavailable registers ("xx") are 0 */
+static size_t trace_unhex(const char *hex, size_t len, uint8_t *out)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i + 2 <= len; i += 2) {
+        const char *digit = hex + i;
+        out[n++] = trace_hex_digit(hex[i]) ? server_rsp_parse_hex(&digit, hex + i + 2) : 0;
+    }
+    return n;
+}
+
+static void trace_hex(const uint8_t *data, size_t len, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = hex[data[i] >> 4];
+        out[2 * i + 1] = hex[data[i] & 0xf];
+    }
+}
+
+static uint64_t trace_get_le(const uint8_t *data, size_t bytes)
+{
+    uint64_t value = 0;
+
+    for (size_t i = 0; i < bytes; i++) {
+        value |= (uint64_t)data[i] << (8 * i);
+    }
+    return value;
+}
+
+static bool trace_put(struct trace_conn *tc, const void *data, size_t len)
+{
+    if (tc->used + len > CONFIG_SERVER_TRACE_BUFFER_KB * 1024) {
+        return false;
+    }
+    memcpy(tc->buf + tc->used, data, len);
+    tc->used += len;
+    return true;
+}
+
+static bool trace_put_le(struct trace_conn *tc, uint64_t value, size_t bytes)
+{
+    uint8_t data[8];
+
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = value >> (8 * i);
+    }
+    return trace_put(tc, data, bytes);
+}
+
+static struct trace_point *trace_find(struct trace_conn *tc, uint32_t num, uint32_t addr)
+{
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        if (tc->tps[i].num == num && tc->tps[i].addr == addr) {
+            return &tc->tps[i];
+        }
+    }
+    return NULL;
+}
+
+static struct trace_point *trace_find_num(struct trace_conn *tc, uint32_t num)
+{
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        if (tc->tps[i].num == num) {
+            return &tc->tps[i];
+        }
+    }
+    return NULL;
+}
+
+/* length of the block at `p` of a frame, 0 if it is unknown */
+static size_t trace_block_size(const struct trace_conn *tc, const uint8_t *p)
+{
+    switch (p[0]) {
+    case 'R':
+        return 1 + tc->regs_size;
+    case 'M':
+        return 1 + 8 + 2 + trace_get_le(p + 9, 2);
+    case 'V':
+        return 1 + 4 + 8;
+    default:
+        return 0;
+    }
+}
+
+/* offset of the `n`th frame, the end of the frames if there are fewer */
+static size_t trace_frame_offset(const struct trace_conn *tc, int n)
+{
+    size_t off = 0;
+
+    for (int i = 0; i < n && off < tc->used; i++) {
+        off += TRACE_FRAME_HEADER + trace_get_le(tc->buf + off + 2, 4);
+    }
+    return off;
+}
+
+/* block `type` of the selected frame covering `addr`, NULL if it wasn't collected */
+static const uint8_t *trace_frame_block(const struct trace_conn *tc, char type, uint32_t addr, size_t *avail)
+{
+    const uint8_t *frame = tc->buf + tc->frame_off;
+    const uint8_t *p = frame + TRACE_FRAME_HEADER;
+    const uint8_t *end = p + trace_get_le(frame + 2, 4);
+
+    while (p < end) {
+        size_t size = trace_block_size(tc, p);
+        if (!size) {
+            break;
+        }
+        if (p[0] == type && type == 'R') {
+            *avail = tc->regs_size;
+            return p + 1;
+        }
+        if (p[0] == type && type == 'M') {
+            uint32_t start = trace_get_le(p + 1, 8);
+            uint32_t len = trace_get_le(p + 9, 2);
+            if (addr >= start && addr - start < len) {
+                *avail = len - (addr - start);
+                return p + 11 + (addr - start);
+            }
+        }
+        p += size;
+    }
+    return NULL;
+}
+
+static const struct trace_point *trace_frame_tp(struct trace_conn *tc, size_t off)
+{
+    return trace_find_num(tc, trace_get_le(tc->buf + off, 2));
+}
+
+static void trace_reset_frames(struct trace_conn *tc)
+{
+    tc->used = 0;
+    tc->frames = 0;
+    tc->frame = TRACE_NO_FRAME;
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        tc->tps[i].hits = 0;
+    }
+}
+
+/* gdb's own breakpoints, a tracepoint hit at one of them is reported */
+static void trace_track_bp(struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const char *p = pkt + 3;
+    uint32_t addr = server_rsp_parse_hex(&p, pkt + len);
+
+    for (size_t i = 0; i < tc->bp_count; i++) {
+        if (tc->bps[i] == addr) {
+            if (pkt[0] == 'z') {
+                tc->bps[i] = tc->bps[--tc->bp_count];
+            }
+            return;
+        }
+    }
+    if (pkt[0] == 'z') {
+        return;
+    }
+    if (tc->bp_count == TRACE_MAX_BREAKPOINTS) {
+        tc->bps_overflow = true;
+        return;
+    }
+    tc->bps[tc->bp_count++] = addr;
+}
+
+static bool trace_at_gdb_bp(const struct trace_conn *tc, uint32_t pc)
+{
+    if (tc->bps_overflow) {
+        return true;
+    }
+    for (size_t i = 0; i < tc->bp_count; i++) {
+        if (tc->bps[i] == pc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* QTDP:<num>:<addr>:<E|D>:<step>:<pass>[-] defines a tracepoint */
+static void trace_define(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("QTDP:");
+
+    uint32_t num = server_rsp_parse_hex(&p, end);
+    if (p == end || *p++ != ':') {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    if (end - p < 2 || p[0] != ':') {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    bool enabled = p[1] == 'E';
+    p += 2;
+    uint32_t step = 0;
+    uint32_t pass = 0;
+    if (p < end && *p == ':') {
+        p++;
+        step = server_rsp_parse_hex(&p, end);
+    }
+    if (p < end && *p == ':') {
+        p++;
+        pass = server_rsp_parse_hex(&p, end);
+    }
+
+    if (!tc->tps) {
+        tc->tps = calloc(TRACE_MAX_TRACEPOINTS, sizeof(*tc->tps));
+    }
+    struct trace_point *tp = trace_find(tc, num, addr);
+    if (!tp && tc->tps && tc->tp_count < TRACE_MAX_TRACEPOINTS) {
+        tp = &tc->tps[tc->tp_count++];
+    }
+    if (!tp) {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    *tp = (struct trace_point) {
+        .num = num, .addr = addr, .enabled = enabled, .pass = pass,
+    };
+    if (step) {
+        s_stats.skipped_actions++;
+        ESP_LOGW(TAG, "tracepoint %" PRIu32 ": while-stepping isn't supported", num);
+    }
+    server_rsp_reply(conn, "OK", 2);
+}
+
+/* QTDP:-<num>:<addr>:<actions>[-], R<mask>, M<basereg>,<offset>,<len> and X<len>,<bytecode> */
+static void trace_define_actions(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("QTDP:-");
+
+    uint32_t num = server_rsp_parse_hex(&p, end);
+    p++;
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    struct trace_point *tp = trace_find(tc, num, addr);
+    if (!tp || p == end || *p++ != ':') {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    if (p < end && *p == 'S') {
+        /* while-stepping actions */
+        s_stats.skipped_actions++;
+        server_rsp_reply(conn, "OK", 2);
+        return;
+    }
+
+    while (p < end && *p != '-') {
+        char action = *p++;
+        if (action == 'R') {
+            server_rsp_parse_hex(&p, end);
+            tp->regs = true;
+        } else if (action == 'M') {
+            struct trace_range range;
+            range.basereg = server_rsp_parse_hex(&p, end);
+            p += p < end;
+            range.offset = server_rsp_parse_hex(&p, end);
+            p += p < end;
+            range.len = server_rsp_parse_hex(&p, end);
+            if (tp->range_count < TRACE_MAX_RANGES) {
+                tp->ranges[tp->range_count++] = range;
+            } else {
+                s_stats.skipped_actions++;
+            }
+        } else if (action == 'X') {
+            uint32_t bytes = server_rsp_parse_hex(&p, end);
+            p += p < end;
+            p = (size_t)(end - p) > bytes * 2 ? p + bytes * 2 : end;
+            s_stats.skipped_actions++;
+            ESP_LOGW(TAG, "tracepoint %" PRIu32 ": expressions can't be collected", num);
+        } else {
+            break;
+        }
+    }
+    server_rsp_reply(conn, "OK", 2);
+}
+
+static void trace_status(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    char reply[160];
+    const char *reason;
+    char stop[24];
+
+    switch (tc->status) {
+    case TRACE_RUNNING:
+        reason = "";
+        break;
+    case TRACE_STOPPED:
+        reason = "tstop::0";
+        break;
+    case TRACE_FULL:
+        reason = "tfull:0";
+        break;
+    case TRACE_PASSCOUNT:
+        snprintf(stop, sizeof(stop), "tpasscount:%" PRIx32, tc->stop_tp);
+        reason = stop;
+        break;
+    default:
+        reason = "tnotrun:0";
+        break;
+    }
+
+    size_t size = tc->buf ? CONFIG_SERVER_TRACE_BUFFER_KB * 1024 : 0;
+    int n = snprintf(reply, sizeof(reply), "T%d;%s%stframes:%" PRIx32 ";tcreated:%" PRIx32 ";tfree:%x;tsize:%x;"
+                     "circular:0;disconn:0", tc->status == TRACE_RUNNING, reason, *reason ? ";" : "", tc->frames,
+                     tc->frames, (unsigned)(size - tc->used), (unsigned)size);
+    server_rsp_reply(conn, reply, n);
+}
+
+/* qTP:<num>:<addr>, hits and bytes used */
+static void trace_tp_status(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("qTP:");
+    char reply[32];
+
+    uint32_t num = server_rsp_parse_hex(&p, end);
+    p += p < end;
+    uint32_t addr = server_rsp_parse_hex(&p, end);
+    const struct trace_point *tp = trace_find(tc, num, addr);
+    if (!tp) {
+        server_rsp_reply(conn, "", 0);
+        return;
+    }
+
+    size_t used = 0;
+    for (size_t off = 0; off < tc->used;) {
+        size_t size = TRACE_FRAME_HEADER + trace_get_le(tc->buf + off + 2, 4);
+        if (trace_get_le(tc->buf + off, 2) == num) {
+            used += size;
+        }
+        off += size;
+    }
+    int n = snprintf(reply, sizeof(reply), "V%" PRIx32 ":%x", tp->hits, (unsigned)used);
+    server_rsp_reply(conn, reply, n);
+}
+
+static bool trace_frame_matches(struct trace_conn *tc, size_t off, const char *how, uint32_t a, uint32_t b)
+{
+    const struct trace_point *tp = trace_frame_tp(tc, off);
+
+    if (!strcmp(how, "tdp")) {
+        return trace_get_le(tc->buf + off, 2) == a;
+    }
+    if (!tp) {
+        return false;
+    }
+    if (!strcmp(how, "pc")) {
+        return tp->addr == a;
+    }
+    if (!strcmp(how, "range")) {
+        return tp->addr >= a && tp->addr <= b;
+    }
+    return tp->addr < a || tp->addr > b;
+}
+
+/* QTFrame:<n>, QTFrame:pc:<addr>, tdp:<num>, range:<start>:<end> and outside:<start>:<end> */
+static void trace_select(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    static const char *const searches[] = { "pc:", "tdp:", "range:", "outside:" };
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("QTFrame:");
+    char reply[32];
+    int found = TRACE_NO_FRAME;
+    size_t off = 0;
+
+    const char *how = NULL;
+    for (size_t i = 0; i < sizeof(searches) / sizeof(searches[0]); i++) {
+        if (server_rsp_starts_with(p, end - p, searches[i])) {
+            how = searches[i];
+            p += strlen(searches[i]);
+            break;
+        }
+    }
+
+    if (!how) {
+        uint32_t n = server_rsp_parse_hex(&p, end);
+        if (n < tc->frames) {
+            found = n;
+            off = trace_frame_offset(tc, n);
+        }
+    } else {
+        char what[8];
+        uint32_t a = server_rsp_parse_hex(&p, end);
+        p += p < end;
+        uint32_t b = server_rsp_parse_hex(&p, end);
+        snprintf(what, sizeof(what), "%.*s", (int)(strchr(how, ':') - how), how);
+
+        /* searches go forward from the selected frame */
+        int n = tc->frame + 1;
+        for (off = trace_frame_offset(tc, n); off < tc->used; n++) {
+            if (trace_frame_matches(tc, off, what, a, b)) {
+                found = n;
+                break;
+            }
+            off += TRACE_FRAME_HEADER + trace_get_le(tc->buf + off + 2, 4);
+        }
+    }
+
+    tc->frame = found;
+    if (found == TRACE_NO_FRAME) {
+        server_rsp_reply(conn, "F-1", 3);
+        return;
+    }
+    tc->frame_off = off;
+    int n = snprintf(reply, sizeof(reply), "F%xT%x", found, (unsigned)trace_get_le(tc->buf + off, 2));
+    server_rsp_reply(conn, reply, n);
+}
+
+/* qTBuffer:<offset>,<len>, the raw frames for tsave */
+static void trace_send_buffer(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const char *end = pkt + len;
+    const char *p = pkt + strlen("qTBuffer:");
+
+    uint32_t off = server_rsp_parse_hex(&p, end);
+    p += p < end;
+    uint32_t count = server_rsp_parse_hex(&p, end);
+    if (off >= tc->used) {
+        server_rsp_reply(conn, "l", 1);
+        return;
+    }
+    if (count > tc->used - off) {
+        count = tc->used - off;
+    }
+    if (count > TRACE_READ_CHUNK * 4) {
+        count = TRACE_READ_CHUNK * 4;
+    }
+
+    char *reply = malloc(count * 2);
+    if (!reply) {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    trace_hex(tc->buf + off, count, reply);
+    server_rsp_reply(conn, reply, count * 2);
+    free(reply);
+}
+
+/* `g`, `p` and `m` of gdb while a frame is selected */
+static void trace_frame_read(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    const struct trace_point *tp = trace_frame_tp(tc, tc->frame_off);
+    const char *end = pkt + len;
+    const char *p = pkt + 1;
+    size_t avail = 0;
+    const uint8_t *data;
+    char *reply;
+
+    s_stats.frame_reads++;
+    if (pkt[0] == 'm') {
+        uint32_t addr = server_rsp_parse_hex(&p, end);
+        p += p < end;
+        uint32_t count = server_rsp_parse_hex(&p, end);
+        data = trace_frame_block(tc, 'M', addr, &avail);
+        if (!data || !count) {
+            server_rsp_reply(conn, "E01", 3);
+            return;
+        }
+        count = count < avail ? count : avail;
+        reply = malloc(count * 2);
+        if (reply) {
+            trace_hex(data, count, reply);
+            server_rsp_reply(conn, reply, count * 2);
+            free(reply);
+        } else {
+            server_rsp_reply(conn, "E01", 3);
+        }
+        return;
+    }
+
+    uint32_t reg = pkt[0] == 'p' ? server_rsp_parse_hex(&p, end) : 0;
+    char value[8];
+    if (pkt[0] == 'p' && tp && (int)reg == server_rsp_pc_reg()) {
+        /* the pc is the tracepoint's address, collected or not */
+        uint8_t pc[4] = { tp->addr, tp->addr >> 8, tp->addr >> 16, tp->addr >> 24 };
+        trace_hex(pc, sizeof(pc), value);
+        server_rsp_reply(conn, value, sizeof(value));
+        return;
+    }
+
+    data = trace_frame_block(tc, 'R', 0, &avail);
+    if (pkt[0] == 'p') {
+        /* the registers gdb reads one by one are 32 bits, the ones before the TIE registers */
+        if (data && (reg + 1) * 4 <= tc->regs_size) {
+            trace_hex(data + reg * 4, 4, value);
+        } else {
+            memset(value, 'x', sizeof(value));
+        }
+        server_rsp_reply(conn, value, sizeof(value));
+        return;
+    }
+
+    reply = tc->regs_size ? malloc(tc->regs_size * 2) : NULL;
+    if (!reply) {
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    if (data) {
+        trace_hex(data, tc->regs_size, reply);
+    } else {
+        memset(reply, 'x', tc->regs_size * 2);
+    }
+    server_rsp_reply(conn, reply, tc->regs_size * 2);
+    free(reply);
+}
+
+static void trace_insert_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+static void trace_remove_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len);
+
+static void trace_bp_request(struct rsp_conn *conn, char type, struct trace_point *tp, rsp_reply_cb_t cb)
+{
+    char req[32];
+    int n = snprintf(req, sizeof(req), "%c1,%" PRIx32 ",%d", type, tp->addr, TRACE_BP_KIND);
+
+    if (server_rsp_request(conn, req, n, cb, tp) != ESP_OK) {
+        cb(conn, tp, "E01", 3);
+    }
+}
+
+static void trace_resume(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    if (server_rsp_interrupts(conn) != tc->interrupts || !tc->resume ||
+            server_rsp_request(conn, tc->resume, tc->resume_len, trace_resumed_cb, NULL) != ESP_OK) {
+        /* gdb waits for a stop, it gets the one of the hit */
+        if (tc->stop) {
+            server_rsp_release(conn, &server_trace_feature, tc->resume, tc->resume_len, tc->stop, tc->stop_len);
+        }
+    }
+    free(tc->stop);
+    tc->stop = NULL;
+}
+
+/* all the breakpoints are in, or out */
+static void trace_bps_done(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    bool failed = tc->failed;
+
+    tc->failed = false;
+    if (tc->then == TRACE_THEN_RESUME) {
+        trace_resume(conn, tc);
+        return;
+    }
+    server_rsp_reply(conn, failed ? "E01" : "OK", failed ? 3 : 2);
+}
+
+static void trace_remove_next(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        if (tc->tps[i].inserted) {
+            trace_bp_request(conn, 'z', &tc->tps[i], trace_remove_cb);
+            return;
+        }
+    }
+    trace_bps_done(conn, tc);
+}
+
+static void trace_insert_next(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        struct trace_point *tp = &tc->tps[i];
+        if (tp->enabled && !tp->inserted) {
+            trace_bp_request(conn, 'Z', tp, trace_insert_cb);
+            return;
+        }
+    }
+    trace_bps_done(conn, tc);
+}
+
+static void trace_insert_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    struct trace_point *tp = arg;
+
+    if (!reply) {
+        return;
+    }
+    if (len != 2 || memcmp(reply, "OK", 2)) {
+        /* out of hardware breakpoints, the ones inserted are removed and QTStart fails */
+        ESP_LOGW(TAG, "no breakpoint for tracepoint %" PRIu32 " at 0x%" PRIx32, tp->num, tp->addr);
+        tc->failed = true;
+        tc->status = tc->then == TRACE_THEN_REPLY ? TRACE_NOT_RUN : TRACE_STOPPED;
+        trace_remove_next(conn, tc);
+        return;
+    }
+    tp->inserted = true;
+    trace_insert_next(conn, tc);
+}
+
+static void trace_remove_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    struct trace_point *tp = arg;
+
+    if (!reply) {
+        return;
+    }
+    tp->inserted = false;
+    trace_remove_next(conn, tc);
+}
+
+static void trace_start(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    if (!tc->buf) {
+        tc->buf = heap_caps_malloc(CONFIG_SERVER_TRACE_BUFFER_KB * 1024, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (!tc->buf) {
+        ESP_LOGE(TAG, "No memory for a trace buffer of %d KB", CONFIG_SERVER_TRACE_BUFFER_KB);
+        server_rsp_reply(conn, "E01", 3);
+        return;
+    }
+    trace_reset_frames(tc);
+    tc->status = TRACE_RUNNING;
+    tc->failed = false;
+    tc->then = TRACE_THEN_REPLY;
+    trace_insert_next(conn, tc);
+}
+
+/* tracing ends, the target goes on */
+static void trace_end(struct rsp_conn *conn, struct trace_conn *tc, trace_status_t status, trace_then_t then)
+{
+    tc->status = status;
+    tc->then = then;
+    trace_remove_next(conn, tc);
+}
+
+/* a stop gdb gets as the reply to its continue */
+static void trace_report(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    s_stats.reported++;
+    server_rsp_release(conn, &server_trace_feature, tc->resume, tc->resume_len, pkt, len);
+    free(tc->stop);
+    tc->stop = NULL;
+}
+
+/* the frame is complete, the breakpoint is stepped over and gdb's continue is sent again */
+static void trace_hit_done(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    struct trace_point *tp = tc->hit;
+    uint32_t collect_us = esp_timer_get_time() - tc->hit_us;
+
+    tc->hit = NULL;
+    if (collect_us > s_stats.max_collect_us) {
+        s_stats.max_collect_us = collect_us;
+    }
+
+    if (trace_at_gdb_bp(tc, tc->pc) || server_rsp_interrupts(conn) != tc->interrupts) {
+        trace_report(conn, tc, tc->stop, tc->stop_len);
+        return;
+    }
+    if (tc->status == TRACE_RUNNING && tp->pass && tp->hits >= tp->pass) {
+        tc->stop_tp = tp->num;
+        trace_end(conn, tc, TRACE_PASSCOUNT, TRACE_THEN_RESUME);
+        return;
+    }
+    if (tc->status != TRACE_RUNNING) {
+        trace_end(conn, tc, tc->status, TRACE_THEN_RESUME);
+        return;
+    }
+    trace_bp_request(conn, 'z', tp, trace_step_cb);
+}
+
+/* step over the tracepoint: z1, s, Z1 */
+static void trace_step_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    struct trace_point *tp = arg;
+
+    if (!reply) {
+        return;
+    }
+    if (tp->inserted) {
+        /* reply to the z1 */
+        if (len != 2 || memcmp(reply, "OK", 2) || server_rsp_request(conn, "s", 1, trace_step_cb, tp) != ESP_OK) {
+            s_stats.errors++;
+            trace_report(conn, tc, tc->stop, tc->stop_len);
+            return;
+        }
+        tp->inserted = false;
+        return;
+    }
+    if (!server_rsp_is_break(reply, len) && !server_rsp_starts_with(reply, len, "S05")) {
+        /* the step ended with something else than a trap, gdb has to know */
+        trace_report(conn, tc, reply, len);
+        return;
+    }
+    if (tc->status == TRACE_RUNNING) {
+        trace_bp_request(conn, 'Z', tp, trace_insert_cb);
+        tc->then = TRACE_THEN_RESUME;
+        return;
+    }
+    trace_resume(conn, tc);
+}
+
+static void trace_fail_frame(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    tc->used = tc->frame_start;
+    s_stats.full++;
+    tc->status = TRACE_FULL;
+    trace_hit_done(conn, tc);
+}
+
+static void trace_next_range(struct trace_conn *tc)
+{
+    tc->range++;
+    tc->range_done = 0;
+    tc->base_known = false;
+}
+
+static void trace_regs_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+
+    if (!reply || !tc->hit) {
+        return;
+    }
+    if (!len || reply[0] == 'E' || (tc->regs_size && len != tc->regs_size * 2)) {
+        s_stats.errors++;
+        trace_collect(conn, tc);
+        return;
+    }
+    tc->regs_size = len / 2;
+    if (tc->used + 1 + tc->regs_size > CONFIG_SERVER_TRACE_BUFFER_KB * 1024 || !trace_put(tc, "R", 1)) {
+        trace_fail_frame(conn, tc);
+        return;
+    }
+    tc->used += trace_unhex(reply, len, tc->buf + tc->used);
+    trace_collect(conn, tc);
+}
+
+static void trace_base_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    uint8_t value[4] = { 0 };
+
+    if (!reply || !tc->hit) {
+        return;
+    }
+    if (!len || reply[0] == 'E') {
+        /* the range can't be located */
+        s_stats.errors++;
+        trace_next_range(tc);
+        trace_collect(conn, tc);
+        return;
+    }
+    trace_unhex(reply, len < 8 ? len : 8, value);
+    tc->range_base = trace_get_le(value, 4);
+    tc->base_known = true;
+    trace_collect(conn, tc);
+}
+
+static void trace_mem_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    const struct trace_range *range;
+    uint32_t addr = (uintptr_t)arg;
+
+    if (!reply || !tc->hit) {
+        return;
+    }
+    range = &tc->hit->ranges[tc->range];
+    if (!len || reply[0] == 'E') {
+        s_stats.errors++;
+        trace_next_range(tc);
+        trace_collect(conn, tc);
+        return;
+    }
+
+    size_t count = len / 2;
+    if (tc->used + 11 + count > CONFIG_SERVER_TRACE_BUFFER_KB * 1024 || !trace_put(tc, "M", 1) ||
+            !trace_put_le(tc, addr, 8) || !trace_put_le(tc, count, 2)) {
+        trace_fail_frame(conn, tc);
+        return;
+    }
+    tc->used += trace_unhex(reply, len, tc->buf + tc->used);
+    tc->range_done += count;
+    if (tc->range_done >= range->len) {
+        trace_next_range(tc);
+    }
+    trace_collect(conn, tc);
+}
+
+/* next read of the hit, the frame is closed after the last one */
+static void trace_collect(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    struct trace_point *tp = tc->hit;
+    char req[32];
+    int n;
+
+    while (tc->range < tp->range_count && !tp->ranges[tc->range].len) {
+        trace_next_range(tc);
+    }
+    if (tc->range < tp->range_count) {
+        const struct trace_range *range = &tp->ranges[tc->range];
+        bool absolute = range->basereg == UINT32_MAX;
+
+        if (!absolute && !tc->base_known) {
+            n = snprintf(req, sizeof(req), "p%" PRIx32, range->basereg);
+            if (server_rsp_request(conn, req, n, trace_base_cb, NULL) != ESP_OK) {
+                trace_fail_frame(conn, tc);
+            }
+            return;
+        }
+        uint32_t addr = (absolute ? 0 : tc->range_base) + range->offset + tc->range_done;
+        uint32_t count = range->len - tc->range_done;
+        count = count < TRACE_READ_CHUNK ? count : TRACE_READ_CHUNK;
+        n = snprintf(req, sizeof(req), "m%" PRIx32 ",%" PRIx32, addr, count);
+        if (server_rsp_request(conn, req, n, trace_mem_cb, (void *)(uintptr_t)addr) != ESP_OK) {
+            trace_fail_frame(conn, tc);
+        }
+        return;
+    }
+
+    uint8_t *frame = tc->buf + tc->frame_start;
+    uint32_t size = tc->used - tc->frame_start - TRACE_FRAME_HEADER;
+    for (size_t i = 0; i < 4; i++) {
+        frame[2 + i] = size >> (8 * i);
+    }
+    tc->frames++;
+    tp->hits++;
+    s_stats.frames++;
+    s_stats.used = tc->used;
+    trace_hit_done(conn, tc);
+}
+
+static void trace_hit(struct rsp_conn *conn, struct trace_conn *tc, struct trace_point *tp)
+{
+    s_stats.hits++;
+    tc->hit = tp;
+    tc->frame_start = tc->used;
+    tc->range = 0;
+    tc->range_done = 0;
+    tc->base_known = false;
+    if (!trace_put_le(tc, tp->num, 2) || !trace_put_le(tc, 0, 4)) {
+        trace_fail_frame(conn, tc);
+        return;
+    }
+    if (!tp->regs) {
+        trace_collect(conn, tc);
+        return;
+    }
+    if (server_rsp_request(conn, "g", 1, trace_regs_cb, NULL) != ESP_OK) {
+        trace_fail_frame(conn, tc);
+    }
+}
+
+static void trace_pc_request(struct rsp_conn *conn, struct trace_conn *tc);
+
+static void trace_pc_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    int reg = (int)(intptr_t)arg;
+    uint8_t value[4] = { 0 };
+
+    if (!reply || !tc->stop) {
+        return;
+    }
+    if (len && reply[0] != 'E') {
+        trace_unhex(reply, len < 8 ? len : 8, value);
+        tc->pc = trace_get_le(value, 4);
+        for (size_t i = 0; i < tc->tp_count; i++) {
+            if (tc->tps[i].inserted && tc->tps[i].addr == tc->pc) {
+                server_rsp_set_pc_reg(reg);
+                trace_hit(conn, tc, &tc->tps[i]);
+                return;
+            }
+        }
+    }
+
+    /* not a tracepoint, or not the pc */
+    if (server_rsp_pc_reg() < 0 && ++tc->pc_try < (int)(sizeof(s_pc_regs) / sizeof(s_pc_regs[0]))) {
+        trace_pc_request(conn, tc);
+        return;
+    }
+    server_rsp_release(conn, &server_trace_feature, tc->resume, tc->resume_len, tc->stop, tc->stop_len);
+    free(tc->stop);
+    tc->stop = NULL;
+}
+
+static void trace_pc_request(struct rsp_conn *conn, struct trace_conn *tc)
+{
+    int reg = server_rsp_pc_reg() >= 0 ? server_rsp_pc_reg() : s_pc_regs[tc->pc_try];
+    char req[16];
+    int n = snprintf(req, sizeof(req), "p%x", reg);
+
+    if (server_rsp_request(conn, req, n, trace_pc_cb, (void *)(intptr_t)reg) != ESP_OK) {
+        trace_resume(conn, tc);
+    }
+}
+
+/* a stop of gdb's continue while tracing, held until it is known whether it is a tracepoint */
+static void trace_check(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    free(tc->stop);
+    tc->stop = server_rsp_dup(pkt, len);
+    if (!tc->stop) {
+        server_rsp_release(conn, &server_trace_feature, tc->resume, tc->resume_len, pkt, len);
+        return;
+    }
+    tc->stop_len = len;
+    tc->hit_us = esp_timer_get_time();
+    tc->pc_try = 0;
+    trace_pc_request(conn, tc);
+}
+
+static void trace_resumed_cb(struct rsp_conn *conn, void *arg, const char *reply, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+
+    if (!reply) {
+        return;
+    }
+    if (tc->status == TRACE_RUNNING && server_rsp_is_break(reply, len)) {
+        trace_check(conn, tc, reply, len);
+        return;
+    }
+    server_rsp_release(conn, &server_trace_feature, tc->resume, tc->resume_len, reply, len);
+}
+
+static rsp_action_t trace_packet(struct rsp_conn *conn, struct trace_conn *tc, const char *pkt, size_t len)
+{
+    if (server_rsp_starts_with(pkt, len, "QTinit")) {
+        for (size_t i = 0; i < tc->tp_count; i++) {
+            if (tc->tps[i].inserted) {
+                server_rsp_reply(conn, "E01", 3);
+                return RSP_DONE;
+            }
+        }
+        tc->tp_count = 0;
+        tc->status = TRACE_NOT_RUN;
+        trace_reset_frames(tc);
+        server_rsp_reply(conn, "OK", 2);
+    } else if (server_rsp_starts_with(pkt, len, "QTDP:-")) {
+        trace_define_actions(conn, tc, pkt, len);
+    } else if (server_rsp_starts_with(pkt, len, "QTDP:")) {
+        trace_define(conn, tc, pkt, len);
+    } else if (server_rsp_starts_with(pkt, len, "QTStart")) {
+        trace_start(conn, tc);
+    } else if (server_rsp_starts_with(pkt, len, "QTStop")) {
+        trace_end(conn, tc, tc->status == TRACE_RUNNING ? TRACE_STOPPED : tc->status, TRACE_THEN_REPLY);
+    } else if (server_rsp_starts_with(pkt, len, "qTStatus")) {
+        trace_status(conn, tc);
+    } else if (server_rsp_starts_with(pkt, len, "qTP:")) {
+        trace_tp_status(conn, tc, pkt, len);
+    } else if (server_rsp_starts_with(pkt, len, "QTFrame:")) {
+        trace_select(conn, tc, pkt, len);
+    } else if (server_rsp_starts_with(pkt, len, "qTBuffer:")) {
+        trace_send_buffer(conn, tc, pkt, len);
+    } else if (server_rsp_starts_with(pkt, len, "qTf") || server_rsp_starts_with(pkt, len, "qTs")) {
+        /* qTfP, qTfV: no tracepoint or variable to upload to gdb */
+        server_rsp_reply(conn, "l", 1);
+    } else if (server_rsp_starts_with(pkt, len, "qTV:")) {
+        server_rsp_reply(conn, "U", 1);
+    } else if (server_rsp_starts_with(pkt, len, "QTDV:") || server_rsp_starts_with(pkt, len, "QTDPsrc:") ||
+               server_rsp_starts_with(pkt, len, "QTro") || server_rsp_starts_with(pkt, len, "QTBuffer:") ||
+               server_rsp_starts_with(pkt, len, "QTNotes:")) {
+        /* accepted, not used */
+        server_rsp_reply(conn, "OK", 2);
+    } else if (server_rsp_starts_with(pkt, len, "QTDisconnected:")) {
+        /* tracing can't go on without gdb, the breakpoints are removed when it leaves */
+        server_rsp_reply(conn, "", 0);
+    } else {
+        return RSP_PASS;
+    }
+    return RSP_DONE;
+}
+
+static rsp_action_t trace_request_hook(struct rsp_conn *conn, const char *pkt, size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+
+    if (!len) {
+        return RSP_PASS;
+    }
+    if (pkt[0] == 'Q' || pkt[0] == 'q') {
+        return trace_packet(conn, tc, pkt, len);
+    }
+    if (tc->frame != TRACE_NO_FRAME && (pkt[0] == 'g' || pkt[0] == 'p' || pkt[0] == 'm')) {
+        trace_frame_read(conn, tc, pkt, len);
+        return RSP_DONE;
+    }
+    if (len > 3 && (pkt[0] == 'Z' || pkt[0] == 'z') && (pkt[1] == '0' || pkt[1] == '1') && pkt[2] == ',') {
+        trace_track_bp(tc, pkt, len);
+    } else if (server_rsp_is_resume(pkt, len) && !server_rsp_is_step(pkt, len)) {
+        free(tc->resume);
+        tc->resume = server_rsp_dup(pkt, len);
+        tc->resume_len = tc->resume ? len : 0;
+        tc->interrupts = server_rsp_interrupts(conn);
+    }
+    return RSP_PASS;
+}
+
+static rsp_action_t trace_reply_hook(struct rsp_conn *conn, const char *req, size_t req_len, const char *pkt,
+                                     size_t len)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+
+    if (tc->status != TRACE_RUNNING || !tc->resume || !server_rsp_is_resume(req, req_len) ||
+            server_rsp_is_step(req, req_len) || !server_rsp_is_break(pkt, len)) {
+        return RSP_PASS;
+    }
+    trace_check(conn, tc, pkt, len);
+    return RSP_DONE;
+}
+
+static void trace_open(struct rsp_conn *conn)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+
+    memset(tc, 0, sizeof(*tc));
+    tc->frame = TRACE_NO_FRAME;
+}
+
+static void trace_close(struct rsp_conn *conn)
+{
+    struct trace_conn *tc = &s_trace[server_rsp_index(conn)];
+    uint32_t addrs[TRACE_MAX_TRACEPOINTS];
+    size_t count = 0;
+
+    for (size_t i = 0; i < tc->tp_count; i++) {
+        if (tc->tps[i].inserted) {
+            addrs[count++] = tc->tps[i].addr;
+        }
+    }
+    server_rsp_remove_bps(conn, addrs, count, "tracepoint breakpoints");
+    free(tc->tps);
+    free(tc->buf);
+    free(tc->resume);
+    free(tc->stop);
+    memset(tc, 0, sizeof(*tc));
+    tc->frame = TRACE_NO_FRAME;
+}
+
+const struct rsp_feature server_trace_feature = {
+    .open = trace_open,
+    .close = trace_close,
+    .request = trace_request_hook,
+    .reply = trace_reply_hook,
+};
+
+static void server_trace_metrics(cJSON *obj)
+{
+    /* counters are only written by the OpenOCD task, a torn read here is harmless */
+    cJSON_AddNumberToObject(obj, "hits", s_stats.hits);
+    cJSON_AddNumberToObject(obj, "frames", s_stats.frames);
+    cJSON_AddNumberToObject(obj, "reported", s_stats.reported);
+    cJSON_AddNumberToObject(obj, "bufferFull", s_stats.full);
+    cJSON_AddNumberToObject(obj, "bufferUsed", s_stats.used);
+    cJSON_AddNumberToObject(obj, "bufferSize", CONFIG_SERVER_TRACE_BUFFER_KB * 1024);
+    cJSON_AddNumberToObject(obj, "readErrors", s_stats.errors);
+    cJSON_AddNumberToObject(obj, "skippedActions", s_stats.skipped_actions);
+    cJSON_AddNumberToObject(obj, "frameReads", s_stats.frame_reads);
+    cJSON_AddNumberToObject(obj, "maxCollectUs", s_stats.max_collect_us);
+}
+
+void server_trace_init(void)
+{
+    metrics_register("trace", server_trace_metrics);
+}
@@ -10,6 +10,8 @@
 #define OOCD_INTERFACE_KEY          "interface"
 #define OOCD_CMD_LINE_ARGS_KEY      "command"
 #define OOCD_DBG_LEVEL_KEY          "debug"
+/* followed by the hash of the target config file name */
+#define OOCD_TCK_SPEED_KEY_PREFIX   "tck"
 
 /* Network params */
 #define WIFI_SSID_KEY               "ssid"
@@ -0,0 +1,158 @@
+/*
+    Target auto-detection.
+
+    Before OpenOCD is launched, the JTAG chain scan (main/jtag) reads the IDCODEs of the chain. They are
+    looked up in the table below, an entry matches when the chain has its number of TAPs and every
+    TAP with an IDCODE has its one.
+
+    The table is maintained by hand from the _CPUTAPID of the tcl-lite target scripts and the
+    number of cores of each chip (one TAP per core). tools/gen_target_idcode_table.py lists the
+    IDCODEs of the scripts to help checking it when a target is added.
+
+    Only configs of the target list are considered. The selected config is kept when it matches.
+    When a single other config matches, it is launched instead. When several do, nothing is
+    switched: ESP32, ESP32-S2 and ESP32-S3 share 0x120034e5, the single TAP of the S2 tells it
+    apart, but an ESP32 and an ESP32-S3 chain look the same and the user's choice stands. Nothing
+    is saved, the selection made from the web page or the ESP-BOX is left as is.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "target_detect.h"
+#include "jtag.h"
+#include "metrics.h"
+#include "types.h"
+
+static const char *TAG = "target-detect";
+
+/* IDCODE of the TAPs and TAPs on the chain (cores) */
+static const struct {
+    uint32_t idcode;
+    uint8_t taps;
+    const char *config;
+} s_idcode_table[] = {
+    { 0x120034e5, 2, "esp32.cfg" },
+    { 0x0000cc25, 1, "esp32c2.cfg" },
+    { 0x00005c25, 1, "esp32c3.cfg" },
+    { 0x0000dc25, 1, "esp32c6.cfg" },
+    { 0x00010c25, 1, "esp32h2.cfg" },
+    { 0x120034e5, 1, "esp32s2.cfg" },
+    { 0x120034e5, 2, "esp32s3.cfg" },
+};
+
+#define TARGET_DETECT_TABLE_SIZE    (sizeof(s_idcode_table) / sizeof(s_idcode_table[0]))
+
+static struct {
+    uint32_t idcodes[JTAG_MAX_TAPS];
+    size_t taps;
+    size_t candidates;
+    const char *detected;               /* NULL if nothing or several configs matched */
+    bool switched;
+    int64_t scan_us;
+} s_detect;
+
+static bool target_detect_in_list(const char *config)
+{
+    for (size_t i = 0; i < g_app_params.target_count; i++) {
+        if (!strcmp(g_app_params.target_list[i], config)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool target_detect_match(size_t entry)
+{
+    if (s_detect.taps != s_idcode_table[entry].taps) {
+        return false;
+    }
+    for (size_t i = 0; i < s_detect.taps; i++) {
+        /* TAPs in BYPASS after reset don't tell anything */
+        if (s_detect.idcodes[i] && s_detect.idcodes[i] != s_idcode_table[entry].idcode) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static esp_err_t target_detect_scan(void)
+{
+    struct jtag_pins pins;
+
+    /* the pins OpenOCD is going to drive, a runtime esp_gpio_jtag_nums included */
+    jtag_openocd_pins(g_app_params.command_arg, &pins);
+
+    esp_err_t err = jtag_init(&pins);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    int64_t start = esp_timer_get_time();
+    err = jtag_read_idcodes(s_detect.idcodes, JTAG_MAX_TAPS, &s_detect.taps);
+    s_detect.scan_us = esp_timer_get_time() - start;
+
+    /* OpenOCD's driver takes the pins over */
+    jtag_deinit();
+
+    return err;
+}
+
+static void target_detect_metrics(cJSON *obj)
+{
+    cJSON *ids = cJSON_AddArrayToObject(obj, "idcodes");
+    for (size_t i = 0; ids && i < s_detect.taps; i++) {
+        char id[12];
+        snprintf(id, sizeof(id), "0x%08" PRIx32, s_detect.idcodes[i]);
+        cJSON_AddItemToArray(ids, cJSON_CreateString(id));
+    }
+    cJSON_AddNumberToObject(obj, "candidates", s_detect.candidates);
+    cJSON_AddStringToObject(obj, "detected", s_detect.detected ? s_detect.detected : "");
+    cJSON_AddBoolToObject(obj, "switched", s_detect.switched);
+    cJSON_AddNumberToObject(obj, "scanUs", s_detect.scan_us);
+}
+
+const char *target_detect_config(const char *current)
+{
+    esp_err_t err = target_detect_scan();
+    if (err != ESP_OK) {
+        /* OpenOCD is launched with the selected config, it reports the chain problems */
+        ESP_LOGW(TAG, "chain scan failed (%s)", esp_err_to_name(err));
+        return current;
+    }
+
+    metrics_register("targetDetect", target_detect_metrics);
+
+    const char *match = NULL;
+    for (size_t i = 0; i < TARGET_DETECT_TABLE_SIZE; i++) {
+        if (!target_detect_match(i) || !target_detect_in_list(s_idcode_table[i].config)) {
+            continue;
+        }
+        s_detect.candidates++;
+        if (!strcmp(s_idcode_table[i].config, current)) {
+            /* the selected config fits the chain */
+            s_detect.detected = current;
+            return current;
+        }
+        match = s_idcode_table[i].config;
+    }
+
+    if (s_detect.candidates == 0) {
+        ESP_LOGI(TAG, "no config matches the chain (%u taps, first IDCODE 0x%08" PRIx32 ")",
+                 (unsigned)s_detect.taps, s_detect.idcodes[0]);
+        return current;
+    }
+    if (s_detect.candidates > 1) {
+        ESP_LOGW(TAG, "%s doesn't match the chain and %u configs do, keeping it", current,
+                 (unsigned)s_detect.candidates);
+        return current;
+    }
+
+    s_detect.detected = match;
+    s_detect.switched = true;
+    ESP_LOGW(TAG, "%s doesn't match the chain, launching %s", current, match);
+    return match;
+}
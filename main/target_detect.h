@@ -0,0 +1,10 @@
+#pragma once
+
+#include "esp_err.h"
+
+/*
+ * Reads the IDCODEs of the JTAG chain and looks them up in the table of target configs. Returns
+ * the config to launch: `current` unless the chain matches another config of the target list
+ * without ambiguity. Must be called before OpenOCD is launched, the pins are released.
+ */
+const char *target_detect_config(const char *current);
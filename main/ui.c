@@ -23,6 +23,8 @@ lv_obj_t *g_ui_openocd_screen;
 lv_obj_t *g_ui_info_screen;
 lv_obj_t *g_ui_ip_label;
 lv_obj_t *g_ui_info_text_area;
+lv_obj_t *g_ui_selftest_label;
+lv_obj_t *g_ui_activity_led;
 lv_obj_t *g_ui_target_dropdown;
 lv_obj_t *g_ui_rtos_dropdown;
 lv_obj_t *g_ui_debug_level_dropdown;
@@ -433,6 +435,27 @@ void ui_update_ip_info(const char *ip)
     lv_label_set_text(g_ui_ip_label, temp);
 }
 
+void ui_update_selftest_info(const char *text)
+{
+    bsp_display_lock(0);
+    lv_label_set_text(g_ui_selftest_label, text);
+    bsp_display_unlock();
+}
+
+void ui_update_activity(bool active)
+{
+    /* called from the timer service task, don't wait for the display */
+    if (!g_ui_activity_led || !bsp_display_lock(10)) {
+        return;
+    }
+    if (active) {
+        lv_led_on(g_ui_activity_led);
+    } else {
+        lv_led_off(g_ui_activity_led);
+    }
+    bsp_display_unlock();
+}
+
 static void ui_info_screen_init(void)
 {
     if (!g_ui_info_screen) {
@@ -468,6 +491,23 @@ static void ui_info_screen_init(void)
         lv_obj_set_style_text_align(g_ui_ip_label, LV_TEXT_ALIGN_LEFT, LV_PART_MAIN | LV_STATE_DEFAULT);
         lv_obj_set_style_text_font(g_ui_ip_label, &lv_font_montserrat_16, LV_PART_MAIN | LV_STATE_DEFAULT);
 
+        g_ui_selftest_label = lv_label_create(g_ui_info_screen);
+        lv_obj_set_width( g_ui_selftest_label, LV_SIZE_CONTENT);
+        lv_obj_set_height( g_ui_selftest_label, LV_SIZE_CONTENT);
+        lv_obj_set_x( g_ui_selftest_label, 0 );
+        lv_obj_set_y( g_ui_selftest_label, 104 );
+        lv_obj_set_align( g_ui_selftest_label, LV_ALIGN_CENTER );
+        lv_label_set_text(g_ui_selftest_label, "");
+        lv_obj_set_style_text_font(g_ui_selftest_label, &lv_font_montserrat_12, LV_PART_MAIN | LV_STATE_DEFAULT);
+
+        g_ui_activity_led = lv_led_create(g_ui_info_screen);
+        lv_obj_set_size(g_ui_activity_led, 12, 12);
+        lv_obj_set_x(g_ui_activity_led, -140);
+        lv_obj_set_y(g_ui_activity_led, 104);
+        lv_obj_set_align(g_ui_activity_led, LV_ALIGN_CENTER);
+        lv_led_set_color(g_ui_activity_led, lv_palette_main(LV_PALETTE_GREEN));
+        lv_led_off(g_ui_activity_led);
+
         lv_obj_add_event_cb(g_ui_info_screen, ui_event_info_screen, LV_EVENT_ALL, NULL);
     }
 }
@@ -30,6 +30,8 @@ void ui_update_interface_dropdown(uint16_t selected_inx);
 void ui_show_info_screen(const char *text);
 void ui_update_ip_ssid_info(const char *ip, const char *ssid);
 void ui_update_ip_info(const char *ip);
+void ui_update_selftest_info(const char *text);
+void ui_update_activity(bool active);
 
 #else
 
@@ -45,5 +47,7 @@ __attribute__((weak)) void ui_update_interface_dropdown(uint16_t selected_inx) {
 __attribute__((weak)) void ui_show_info_screen(const char *text) {}
 __attribute__((weak)) void ui_update_ip_ssid_info(const char *ip, const char *ssid) {}
 __attribute__((weak)) void ui_update_ip_info(const char *ip) {}
+__attribute__((weak)) void ui_update_selftest_info(const char *text) {}
+__attribute__((weak)) void ui_update_activity(bool active) {}
 
 #endif
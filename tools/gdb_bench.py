@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+#
+# Bulk memory read benchmark of the debugger's GDB server.
+#
+#   gdb_bench.py <ip> --addr 0x3fc88000 --size 65536 --chunk 1024
+#   gdb_bench.py <ip> --addr 0x3fc88000 --size 262144 --chunk 1024,4096,16384,32768
+#
+# The target is halted on attach, then `m` packets are issued back to back and the throughput and the
+# per packet latency percentiles are reported, once per packet size given to --chunk. Run it with the
+# same arguments before and after a configuration change to compare. When the debugger exposes
+# /metrics, the CPU side numbers are printed too.
+#
+# Only the python standard library is used.
+
+import argparse
+import json
+import socket
+import sys
+import time
+import urllib.request
+
+GDB_PORT = 3333
+
+
+class RspError(Exception):
+    pass
+
+
+class RspClient:
+    def __init__(self, ip, port, timeout):
+        self.sock = socket.create_connection((ip, port), timeout=timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buf = b''
+        self.ack = True
+
+    def close(self):
+        self.sock.close()
+
+    def _recv_byte(self):
+        if not self.buf:
+            self.buf = self.sock.recv(65536)
+            if not self.buf:
+                raise RspError('connection closed by the debugger')
+        b, self.buf = self.buf[:1], self.buf[1:]
+        return b
+
+    def send(self, payload):
+        data = payload.encode()
+        self.sock.sendall(b'$' + data + b'#' + '{:02x}'.format(sum(data) & 0xff).encode())
+        if self.ack:
+            while self._recv_byte() != b'+':
+                pass
+
+    def recv(self):
+        while self._recv_byte() != b'$':
+            pass
+        payload = b''
+        while True:
+            b = self._recv_byte()
+            if b == b'#':
+                break
+            payload += b
+        self._recv_byte()
+        self._recv_byte()
+        if self.ack:
+            self.sock.sendall(b'+')
+        return payload.decode(errors='replace')
+
+    def command(self, payload):
+        self.send(payload)
+        return self.recv()
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    return samples[(len(samples) - 1) * pct // 100]
+
+
+def packet_size(supported):
+    for feature in supported.split(';'):
+        if feature.startswith('PacketSize='):
+            return int(feature[len('PacketSize='):], 16)
+    return 0
+
+
+def read_pass(rsp, args, chunk):
+    samples = []
+    total = 0
+    start = time.monotonic()
+    for _ in range(args.repeat):
+        for offset in range(0, args.size, chunk):
+            length = min(chunk, args.size - offset)
+            t0 = time.monotonic()
+            reply = rsp.command('m{:x},{:x}'.format(args.addr + offset, length))
+            samples.append((time.monotonic() - t0) * 1e6)
+            if reply.startswith('E'):
+                raise RspError('read of 0x{:x} failed ({})'.format(args.addr + offset, reply))
+            total += len(reply) // 2
+    return total, time.monotonic() - start, sorted(samples)
+
+
+def fetch_metrics(ip, timeout):
+    try:
+        with urllib.request.urlopen('http://{}/metrics'.format(ip), timeout=timeout) as resp:
+            return json.loads(resp.read())
+    except (OSError, ValueError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description='GDB server memory read benchmark for OpenOCD on ESP32')
+    parser.add_argument('ip', help='IP address of the debugger')
+    parser.add_argument('--port', type=int, default=GDB_PORT)
+    parser.add_argument('--addr', type=lambda x: int(x, 0), required=True, help='start address of the read')
+    parser.add_argument('--size', type=lambda x: int(x, 0), default=64 * 1024, help='total bytes to read')
+    parser.add_argument('--chunk', type=lambda x: [int(c, 0) for c in x.split(',')], default=[1024],
+                        help='bytes per m packet, a comma separated list compares several sizes')
+    parser.add_argument('--repeat', type=int, default=3, help='number of passes')
+    parser.add_argument('--timeout', type=float, default=10, help='socket timeout in seconds')
+    args = parser.parse_args()
+
+    try:
+        rsp = RspClient(args.ip, args.port, args.timeout)
+    except OSError as e:
+        print('connection failed: {}'.format(e), file=sys.stderr)
+        return 1
+
+    try:
+        supported = rsp.command('qSupported:multiprocess+;swbreak+;hwbreak+')
+        size = packet_size(supported)
+        print('PacketSize {} bytes, m packets up to {} bytes'.format(size, (size - 1) // 2) if size else
+              'no PacketSize advertised')
+        if rsp.command('QStartNoAckMode') == 'OK':
+            rsp.ack = False
+        # OpenOCD halts the target when gdb attaches, the stop reason is just consumed here
+        rsp.command('?')
+
+        metrics_before = fetch_metrics(args.ip, args.timeout)
+        results = [(chunk,) + read_pass(rsp, args, chunk) for chunk in args.chunk]
+        metrics_after = fetch_metrics(args.ip, args.timeout)
+    except (OSError, RspError) as e:
+        print('benchmark failed: {}'.format(e), file=sys.stderr)
+        return 1
+    finally:
+        rsp.close()
+
+    for chunk, total, duration, samples in results:
+        print('read {} bytes in {:.2f} s, {:.1f} KB/s, {} packets of {} bytes'.format(
+            total, duration, total / duration / 1024 if duration > 0 else 0, len(samples), chunk))
+        print('packet latency: min {:.0f} us p50 {:.0f} us p90 {:.0f} us p99 {:.0f} us max {:.0f} us'.format(
+            samples[0], percentile(samples, 50), percentile(samples, 90), percentile(samples, 99), samples[-1]))
+
+    if metrics_before and metrics_after and 'server' in metrics_after:
+        before = metrics_before.get('server', {})
+        after = metrics_after['server']
+        tx_calls = after.get('txPackets', 0) - before.get('txPackets', 0)
+        tx_bytes = after.get('txBytes', 0) - before.get('txBytes', 0)
+        if tx_calls:
+            print('debugger side: {} write calls, {:.0f} bytes per call'.format(tx_calls, tx_bytes / tx_calls))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
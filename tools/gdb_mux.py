@@ -0,0 +1,714 @@
+#!/usr/bin/env python3
+#
+# Host side multiplexer of the debugger's GDB server.
+#
+#   gdb_mux.py <ip>                         - serve local gdb and IDE clients on port 3333
+#   gdb_mux.py <ip> --ro 0x400d0000-0x40400000 --listen 4444
+#   gdb_mux.py --selftest                   - check the proxy against a stand-in GDB stub
+#
+# One connection to the debugger is kept open and several gdb or IDE clients connect to the local
+# port instead; `target remote :3333` of tools/gdbinit works as is. Their packets go to the debugger
+# one at a time. A client's resume makes it the owner of the target until the stop reply, which
+# goes to it only; ^C from any client interrupts the target.
+#
+# Registers are cached while the target is halted, read-only memory (the flash ranges of the
+# debugger's memory map, plus --ro) is cached in lines until a write, flash operation or monitor
+# command. A second client, or gdb reading the same code again, doesn't cross Wi-Fi. While the
+# target runs for one client the others are answered from the caches, or get an error.
+#
+# A client's detach is answered here while others are connected, only the last one detaches the
+# target. `k` only closes the client's connection.
+#
+# --selftest runs the proxy and a stand-in stub on the loopback and checks the sharing and the
+# caches, no debugger is needed.
+#
+# Only the python standard library is used.
+
+import argparse
+import asyncio
+import re
+import sys
+
+GDB_PORT = 3333
+MEM_LINE = 1024
+# room for the command and the address in the debugger's packet buffer
+PACKET_HEADROOM = 64
+DEFAULT_PACKET_SIZE = 0x4000
+
+
+def checksum(payload):
+    return sum(payload) & 0xff
+
+
+def frame(payload):
+    return b'$' + payload + b'#' + b'%02x' % checksum(payload)
+
+
+def escape(data):
+    out = bytearray()
+    for c in data:
+        if c in b'$#}*':
+            out += bytes((0x7d, c ^ 0x20))
+        else:
+            out.append(c)
+    return bytes(out)
+
+
+def unescape(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        if data[i] == 0x7d and i + 1 < len(data):
+            out.append(data[i + 1] ^ 0x20)
+            i += 2
+        else:
+            out.append(data[i])
+            i += 1
+    return bytes(out)
+
+
+def expand_rle(payload):
+    if b'*' not in payload:
+        return payload
+    out = bytearray()
+    i = 0
+    while i < len(payload):
+        c = payload[i]
+        if c == 0x7d and i + 1 < len(payload):
+            out += payload[i:i + 2]
+            i += 2
+        elif c == 0x2a and out and i + 1 < len(payload):
+            out += out[-1:] * (payload[i + 1] - 29)
+            i += 2
+        else:
+            out.append(c)
+            i += 1
+    return bytes(out)
+
+
+def parse_hex_args(payload, skip):
+    """Address and length of `m`, `x`, `M` and `X`, None if the packet doesn't have them"""
+    m = re.match(rb'([0-9a-fA-F]+),([0-9a-fA-F]+)', payload[skip:])
+    if not m:
+        return None
+    return int(m.group(1), 16), int(m.group(2), 16)
+
+
+def is_console(payload):
+    return len(payload) > 1 and payload[:1] == b'O' and re.fullmatch(rb'[0-9a-f]+', payload[1:]) is not None
+
+
+def is_resume(payload):
+    if payload.startswith(b'vCont'):
+        return not payload.startswith(b'vCont?')
+    # `F` is the reply to a File-I/O request, the target continues after it
+    return payload[:1] in (b'c', b'C', b's', b'S', b'F')
+
+
+class Parser:
+    """Splits a byte stream into packet payloads, '+' and '-' are dropped, ^C is reported as None"""
+
+    def __init__(self):
+        self.state = 0
+        self.pkt = bytearray()
+
+    def feed(self, data):
+        events = []
+        i = 0
+        while i < len(data):
+            if self.state == 0:
+                start = data.find(b'$', i)
+                events += [None] * data.count(b'\x03', i, start if start >= 0 else len(data))
+                if start < 0:
+                    break
+                self.pkt = bytearray()
+                self.state = 1
+                i = start + 1
+            elif self.state == 1:
+                end = data.find(b'#', i)
+                if end < 0:
+                    self.pkt += data[i:]
+                    break
+                self.pkt += data[i:end]
+                self.state = 2
+                i = end + 1
+            elif self.state == 2:
+                self.state = 3
+                i += 1
+            else:
+                self.state = 0
+                i += 1
+                events.append(bytes(self.pkt))
+        return events
+
+
+class Upstream:
+    """The connection to the debugger, one command at a time"""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+        self.parser = Parser()
+        self.ack = True
+        self.lock = asyncio.Lock()
+        self.waiting = None
+        self.console = None
+        self.packets = 0
+
+    async def run(self):
+        while True:
+            data = await self.reader.read(65536)
+            if not data:
+                break
+            for pkt in self.parser.feed(data):
+                if pkt is None:
+                    continue
+                if self.ack:
+                    self.writer.write(b'+')
+                pkt = expand_rle(pkt)
+                if is_console(pkt):
+                    # monitor command output, or the target's while it runs
+                    if self.console:
+                        self.console(pkt)
+                elif self.waiting and not self.waiting.done():
+                    self.waiting.set_result(pkt)
+        if self.waiting and not self.waiting.done():
+            self.waiting.set_exception(ConnectionError('connection closed by the debugger'))
+
+    async def command(self, payload, console=None):
+        async with self.lock:
+            self.waiting = asyncio.get_running_loop().create_future()
+            self.console = console
+            self.writer.write(frame(payload))
+            self.packets += 1
+            try:
+                return await self.waiting
+            finally:
+                self.waiting = None
+                self.console = None
+
+    def send(self, payload):
+        """Packets the debugger doesn't answer"""
+        self.writer.write(frame(payload))
+        self.packets += 1
+
+    def interrupt(self):
+        self.writer.write(b'\x03')
+
+
+class Client:
+    def __init__(self, name, writer):
+        self.name = name
+        self.writer = writer
+        self.parser = Parser()
+        self.ack = True
+        self.closed = False
+        self.threads = {}               # thread selected with Hg and Hc
+
+    def send(self, payload):
+        if not self.closed:
+            self.writer.write(frame(payload))
+
+    def close(self):
+        if not self.closed:
+            self.closed = True
+            self.writer.close()
+
+
+class Mux:
+    def __init__(self, upstream, ro_ranges, log=print):
+        self.upstream = upstream
+        self.ro = list(ro_ranges)
+        self.log = log
+        self.clients = set()
+        self.queue = asyncio.Queue()
+        self.running = False
+        self.supported = b''
+        self.max_read = (DEFAULT_PACKET_SIZE - PACKET_HEADROOM) // 2
+        self.up_threads = {}            # thread the debugger has selected
+        self.regs = {}                  # (thread, packet) -> reply, while halted
+        self.lines = {}                 # address of a line of read-only memory -> its bytes
+        self.next_id = 1
+        self.stats = {'forwarded': 0, 'regHits': 0, 'memHits': 0, 'memLines': 0}
+
+    async def setup(self):
+        self.supported = await self.upstream.command(b'qSupported:multiprocess+;swbreak+;hwbreak+;vContSupported+')
+        for feature in self.supported.split(b';'):
+            if feature.startswith(b'PacketSize='):
+                size = int(feature[len(b'PacketSize='):], 16)
+                self.max_read = max(MEM_LINE, (size - PACKET_HEADROOM) // 2 // MEM_LINE * MEM_LINE)
+        if b'QStartNoAckMode+' in self.supported and await self.upstream.command(b'QStartNoAckMode') == b'OK':
+            self.upstream.ack = False
+        if b'qXfer:memory-map:read+' in self.supported:
+            self.ro += await self.read_memory_map()
+        for start, end in self.ro:
+            self.log('read-only 0x{:08x}-0x{:08x} cached'.format(start, end))
+
+    async def read_memory_map(self):
+        xml = b''
+        while True:
+            reply = await self.upstream.command(b'qXfer:memory-map:read::%x,%x' % (len(xml), self.max_read))
+            if not reply or reply[:1] not in (b'm', b'l'):
+                break
+            xml += unescape(reply[1:])
+            if reply[:1] == b'l':
+                break
+        ranges = []
+        for m in re.finditer(rb'<memory\s+type="(flash|rom)"\s+start="(\w+)"\s+length="(\w+)"', xml):
+            start = int(m.group(2), 0)
+            length = int(m.group(3), 0)
+            if length:
+                ranges.append((start, start + length))
+        return ranges
+
+    # read-only memory
+
+    def ro_lines(self, addr, length):
+        """Lines covering a read, None unless they are all in a read-only range"""
+        first = addr - addr % MEM_LINE
+        last = addr + length + (-(addr + length) % MEM_LINE)
+        for start, end in self.ro:
+            if start <= first and last <= end:
+                return range(first, last, MEM_LINE)
+        return None
+
+    async def fetch_lines(self, lines):
+        missing = [line for line in lines if line not in self.lines]
+        while missing:
+            start = missing[0]
+            count = 1
+            while (count < len(missing) and missing[count] == start + count * MEM_LINE and
+                   (count + 1) * MEM_LINE <= self.max_read):
+                count += 1
+            reply = await self.upstream.command(b'm%x,%x' % (start, count * MEM_LINE))
+            if len(reply) != count * MEM_LINE * 2 or reply[:1] == b'E':
+                return False
+            data = bytes.fromhex(reply.decode())
+            for i in range(count):
+                self.lines[start + i * MEM_LINE] = data[i * MEM_LINE:(i + 1) * MEM_LINE]
+            self.stats['memLines'] += count
+            missing = missing[count:]
+        return True
+
+    async def read_ro(self, pkt, fetch):
+        args = parse_hex_args(pkt, 1)
+        if not args or not args[1]:
+            return None
+        addr, length = args
+        lines = self.ro_lines(addr, length)
+        if lines is None:
+            return None
+        if any(line not in self.lines for line in lines):
+            if not fetch or not await self.fetch_lines(lines):
+                return None
+        else:
+            self.stats['memHits'] += 1
+        data = b''.join(self.lines[line] for line in lines)
+        data = data[addr - lines.start:addr - lines.start + length]
+        return b'b' + escape(data) if pkt[:1] == b'x' else data.hex().encode()
+
+    def drop_lines(self, addr, length):
+        lines = self.ro_lines(addr, max(length, 1))
+        for line in lines or []:
+            self.lines.pop(line, None)
+
+    def invalidate(self, pkt):
+        """Drops what a packet may change"""
+        if pkt[:1] in (b'G', b'P', b'M', b'X') or pkt.startswith((b'qRcmd', b'vFlash', b'vRun', b'R')):
+            self.regs.clear()
+        if pkt[:1] in (b'M', b'X', b'Z', b'z'):
+            args = parse_hex_args(pkt, 1 if pkt[:1] in (b'M', b'X') else 3)
+            if args:
+                self.drop_lines(*args)
+        elif pkt.startswith((b'qRcmd', b'vFlash', b'vRun', b'R')):
+            self.lines.clear()
+
+    # clients
+
+    def local(self, client, pkt):
+        """Packets answered here: (True, reply or None) or (False, None)"""
+        if pkt.startswith(b'qSupported'):
+            return True, self.supported
+        if pkt == b'QStartNoAckMode':
+            client.send(b'OK')
+            client.ack = False
+            return True, None
+        if pkt in (b'k', b'vKill') or pkt.startswith(b'vKill;'):
+            # the others keep the target, and OpenOCD closes the connection on `k`
+            if pkt != b'k':
+                client.send(b'OK')
+            client.close()
+            return True, None
+        if pkt[:1] == b'D' and len(self.clients) > 1:
+            client.send(b'OK')
+            client.close()
+            return True, None
+        if pkt[:1] in (b'g', b'p') or pkt == b'?':
+            reply = self.regs.get((self.thread_for(client, b'g'), pkt))
+            if reply is not None:
+                self.stats['regHits'] += 1
+                return True, reply
+        return False, None
+
+    def thread_for(self, client, kind):
+        return client.threads.get(kind, self.up_threads.get(kind))
+
+    async def sync_threads(self, client, pkt):
+        kind = b'g' if pkt[:1] in (b'g', b'G', b'p', b'P') else b'c' if pkt[:1] in (b'c', b'C', b's', b'S') else None
+        if not kind:
+            return
+        thread = client.threads.get(kind)
+        if thread is not None and thread != self.up_threads.get(kind):
+            if await self.upstream.command(b'H' + kind + thread) == b'OK':
+                self.up_threads[kind] = thread
+
+    async def handle(self, client, pkt):
+        done, reply = self.local(client, pkt)
+        if done:
+            return reply
+
+        if pkt[:1] in (b'm', b'x'):
+            reply = await self.read_ro(pkt, fetch=True)
+            if reply is not None:
+                return reply
+
+        if pkt[:2] in (b'Hg', b'Hc'):
+            kind, thread = pkt[1:2], pkt[2:]
+            reply = await self.upstream.command(pkt)
+            if reply == b'OK':
+                client.threads[kind] = thread
+                self.up_threads[kind] = thread
+            return reply
+
+        await self.sync_threads(client, pkt)
+        self.invalidate(pkt)
+        self.stats['forwarded'] += 1
+        if pkt[:1] == b'R':
+            self.upstream.send(pkt)
+            return None
+        if not is_resume(pkt):
+            reply = await self.upstream.command(pkt, console=client.send)
+            if pkt[:1] in (b'g', b'p') or pkt == b'?':
+                if reply and reply[:1] != b'E':
+                    self.regs[(self.up_threads.get(b'g'), pkt)] = reply
+            return reply
+
+        # the stop reply goes to this client only, the others are answered from the caches meanwhile
+        self.regs.clear()
+        self.running = True
+        try:
+            return await self.upstream.command(pkt, console=client.send)
+        finally:
+            self.running = False
+
+    def answer_running(self, client, pkt):
+        done, reply = self.local(client, pkt)
+        if done:
+            return reply
+        return b'E01'
+
+    async def serve_client(self, reader, writer):
+        client = Client('client {}'.format(self.next_id), writer)
+        self.next_id += 1
+        self.clients.add(client)
+        self.log('{} connected, {} in total'.format(client.name, len(self.clients)))
+        try:
+            while not client.closed:
+                data = await reader.read(65536)
+                if not data:
+                    break
+                for pkt in client.parser.feed(data):
+                    if pkt is None:
+                        if self.running:
+                            self.upstream.interrupt()
+                        continue
+                    if client.ack:
+                        writer.write(b'+')
+                    if self.running and pkt[:1] in (b'm', b'x'):
+                        reply = await self.read_ro(pkt, fetch=False)
+                        client.send(reply if reply is not None else b'E01')
+                    elif self.running:
+                        reply = self.answer_running(client, pkt)
+                        if reply is not None:
+                            client.send(reply)
+                    else:
+                        self.queue.put_nowait((client, pkt))
+        except ConnectionError:
+            pass
+        finally:
+            self.clients.discard(client)
+            client.close()
+            self.log('{} disconnected, {} left'.format(client.name, len(self.clients)))
+
+    async def dispatch(self):
+        while True:
+            client, pkt = await self.queue.get()
+            if client.closed:
+                continue
+            reply = await self.handle(client, pkt)
+            if reply is not None:
+                client.send(reply)
+
+
+async def start(ip, port, listen_host, listen_port, ro_ranges, log=print):
+    reader, writer = await asyncio.open_connection(ip, port)
+    upstream = Upstream(reader, writer)
+    upstream_task = asyncio.create_task(upstream.run())
+    mux = Mux(upstream, ro_ranges, log)
+    await mux.setup()
+    server = await asyncio.start_server(mux.serve_client, listen_host, listen_port)
+    dispatch_task = asyncio.create_task(mux.dispatch())
+    return mux, server, [upstream_task, dispatch_task]
+
+
+async def serve(args):
+    mux, server, tasks = await start(args.ip, args.port, args.listen_host, args.listen, args.ro)
+    print('debugger {}:{} served on {}:{}'.format(args.ip, args.port, args.listen_host, args.listen))
+    try:
+        # the proxy ends with the debugger's connection
+        await tasks[0]
+    finally:
+        server.close()
+        print(' '.join('{}={}'.format(k, v) for k, v in mux.stats.items()))
+        print('debugger packets: {}'.format(mux.upstream.packets))
+
+
+# stand-in GDB stub of --selftest
+
+SELFTEST_FLASH = (0x400d0000, 0x400e0000)
+SELFTEST_RAM = (0x3ffb0000, 0x3ffb1000)
+
+
+class StandInStub:
+    """Answers like OpenOCD for the packets the self-test sends, and counts them"""
+
+    def __init__(self):
+        self.counts = {}
+        self.ram = bytearray(SELFTEST_RAM[1] - SELFTEST_RAM[0])
+        self.threads = {b'g': b'1', b'c': b'1'}
+        self.stops = 0
+        self.stop_after = 0.05
+        self.running = None
+
+    def flash(self, addr):
+        return (addr * 7 + (addr >> 9)) & 0xff
+
+    def read(self, addr, length):
+        if SELFTEST_FLASH[0] <= addr and addr + length <= SELFTEST_FLASH[1]:
+            return bytes(self.flash(a) for a in range(addr, addr + length))
+        if SELFTEST_RAM[0] <= addr and addr + length <= SELFTEST_RAM[1]:
+            return bytes(self.ram[addr - SELFTEST_RAM[0]:addr - SELFTEST_RAM[0] + length])
+        return None
+
+    def memory_map(self):
+        return ('<memory-map><memory type="ram" start="0x{:x}" length="0x{:x}"/>'
+                '<memory type="flash" start="0x{:x}" length="0x{:x}"><property name="blocksize">0x1000</property>'
+                '</memory></memory-map>').format(SELFTEST_RAM[0], SELFTEST_RAM[1] - SELFTEST_RAM[0],
+                                                 SELFTEST_FLASH[0], SELFTEST_FLASH[1] - SELFTEST_FLASH[0]).encode()
+
+    def answer(self, pkt):
+        if pkt.startswith(b'qSupported'):
+            return b'PacketSize=4000;qXfer:memory-map:read+;QStartNoAckMode+'
+        if pkt == b'QStartNoAckMode':
+            return b'OK'
+        if pkt.startswith(b'qXfer:memory-map:read::'):
+            offset, length = (int(x, 16) for x in pkt.split(b'::')[1].split(b','))
+            xml = self.memory_map()
+            part = xml[offset:offset + length]
+            return (b'l' if offset + length >= len(xml) else b'm') + escape(part)
+        if pkt == b'?':
+            return b'T05thread:%s;' % self.threads[b'g']
+        if pkt[:1] == b'H':
+            self.threads[pkt[1:2]] = pkt[2:]
+            return b'OK'
+        if pkt == b'g':
+            return b'%08x' % (int(self.threads[b'g'], 16) << 16 | self.stops) * 4
+        if pkt[:1] == b'p':
+            return b'%08x' % (int(self.threads[b'g'], 16) << 16 | int(pkt[1:], 16))
+        if pkt[:1] == b'm':
+            data = self.read(*parse_hex_args(pkt, 1))
+            return data.hex().encode() if data is not None else b'E14'
+        if pkt[:1] == b'M':
+            addr, length = parse_hex_args(pkt, 1)
+            data = bytes.fromhex(pkt.split(b':')[1].decode())
+            if not SELFTEST_RAM[0] <= addr < SELFTEST_RAM[1]:
+                return b'E14'
+            self.ram[addr - SELFTEST_RAM[0]:addr - SELFTEST_RAM[0] + length] = data
+            return b'OK'
+        if pkt.startswith(b'qRcmd,'):
+            return [b'O' + b'halted\n'.hex().encode(), b'OK']
+        if pkt[:1] == b'D':
+            return b'OK'
+        return b''
+
+    async def serve(self, reader, writer):
+        parser = Parser()
+        ack = True
+        loop = asyncio.get_running_loop()
+        while True:
+            data = await reader.read(65536)
+            if not data:
+                break
+            for pkt in parser.feed(data):
+                if pkt is None:
+                    if self.running:
+                        self.running.cancel()
+                        self.running = None
+                        writer.write(frame(b'T02thread:1;'))
+                    continue
+                if ack:
+                    writer.write(b'+')
+                key = pkt[:1] if pkt[:1] not in (b'q', b'Q', b'v') else pkt.split(b':')[0].split(b',')[0]
+                key = key.decode()
+                self.counts[key] = self.counts.get(key, 0) + 1
+                if pkt[:1] == b'c':
+                    self.stops += 1
+                    if self.stop_after is not None:
+                        self.running = loop.call_later(self.stop_after, self.stop, writer)
+                    else:
+                        self.running = loop.call_later(3600, self.stop, writer)
+                    continue
+                replies = self.answer(pkt)
+                for reply in replies if isinstance(replies, list) else [replies]:
+                    writer.write(frame(reply))
+                if pkt == b'QStartNoAckMode':
+                    ack = False
+
+    def stop(self, writer):
+        self.running = None
+        writer.write(frame(b'T05thread:1;'))
+
+
+class SelftestClient:
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+        self.parser = Parser()
+        self.pending = []
+
+    @classmethod
+    async def connect(cls, port):
+        reader, writer = await asyncio.open_connection('127.0.0.1', port)
+        return cls(reader, writer)
+
+    async def recv(self):
+        while not self.pending:
+            data = await asyncio.wait_for(self.reader.read(65536), 5)
+            if not data:
+                raise ConnectionError('proxy closed the connection')
+            self.pending += [p for p in self.parser.feed(data) if p is not None]
+        return self.pending.pop(0)
+
+    async def command(self, payload):
+        self.writer.write(frame(payload))
+        reply = await self.recv()
+        self.writer.write(b'+')
+        return reply
+
+    def interrupt(self):
+        self.writer.write(b'\x03')
+
+
+async def selftest():
+    stub = StandInStub()
+    stub_server = await asyncio.start_server(stub.serve, '127.0.0.1', 0)
+    stub_port = stub_server.sockets[0].getsockname()[1]
+    mux, server, _ = await start('127.0.0.1', stub_port, '127.0.0.1', 0, [], log=lambda msg: None)
+    port = server.sockets[0].getsockname()[1]
+    failures = 0
+
+    def check(name, ok):
+        nonlocal failures
+        print('{} - {}'.format('ok' if ok else 'FAIL', name))
+        failures += not ok
+
+    a = await SelftestClient.connect(port)
+    b = await SelftestClient.connect(port)
+    for c in (a, b):
+        supported = await c.command(b'qSupported:multiprocess+')
+        check('qSupported is the debugger\'s', b'PacketSize=4000' in supported)
+        check('no-ack mode is local', await c.command(b'QStartNoAckMode') == b'OK')
+    check('one qSupported reached the stub', stub.counts.get('qSupported') == 1)
+    check('flash of the memory map is cached', mux.ro == [SELFTEST_FLASH])
+
+    addr = SELFTEST_FLASH[0] + 0x123
+    expected = bytes(stub.flash(x) for x in range(addr, addr + 300)).hex().encode()
+    check('flash read', await a.command(b'm%x,12c' % addr) == expected)
+    check('flash read of another client', await b.command(b'm%x,12c' % addr) == expected)
+    check('binary flash read', unescape((await b.command(b'x%x,12c' % addr))[1:]) == bytes.fromhex(expected.decode()))
+    check('one flash read reached the stub', stub.counts.get('m') == 1)
+    check('RAM is not cached', await a.command(b'm%x,4' % SELFTEST_RAM[0]) == b'00000000' and
+          await b.command(b'm%x,4' % SELFTEST_RAM[0]) == b'00000000' and stub.counts['m'] == 3)
+
+    check('Hg of a', await a.command(b'Hg2') == b'OK')
+    check('Hg of b', await b.command(b'Hg3') == b'OK')
+    regs_a = await a.command(b'g')
+    regs_b = await b.command(b'g')
+    check('registers of the thread of each client', regs_a.startswith(b'00020000') and regs_b.startswith(b'00030000'))
+    check('registers cached per thread', await a.command(b'g') == regs_a and await b.command(b'g') == regs_b and
+          stub.counts['g'] == 2)
+
+    check('continue of a', await a.command(b'c') == b'T05thread:1;')
+    check('registers read again after a resume', (await a.command(b'g')).startswith(b'00020001') and
+          stub.counts['g'] == 3)
+
+    stub.stop_after = None
+    a.writer.write(frame(b'c'))
+    await asyncio.sleep(0.1)
+    check('cached flash while running', await b.command(b'm%x,10' % addr) == expected[:32])
+    check('error for RAM while running', await b.command(b'm%x,4' % SELFTEST_RAM[0]) == b'E01')
+    a.interrupt()
+    check('^C stops the target for a', await a.recv() == b'T02thread:1;')
+    check('b sees no stop reply', not b.pending)
+
+    output = await a.command(b'qRcmd,' + b'halt'.hex().encode())
+    check('monitor command output', output == b'O' + b'halted\n'.hex().encode() and await a.recv() == b'OK')
+    before = stub.counts['m']
+    check('flash read again after a monitor command', await b.command(b'm%x,10' % addr) == expected[:32] and
+          stub.counts['m'] == before + 1)
+
+    check('detach of b is local', await b.command(b'D') == b'OK' and 'D' not in stub.counts)
+    await asyncio.sleep(0.05)
+    check('detach of the last client reaches the stub', await a.command(b'D') == b'OK' and stub.counts.get('D') == 1)
+
+    a.writer.close()
+    mux.upstream.writer.close()
+    await asyncio.sleep(0.05)
+    server.close()
+    stub_server.close()
+    print('{} failures'.format(failures))
+    return 1 if failures else 0
+
+
+def parse_range(text):
+    start, end = (int(x, 0) for x in text.split('-'))
+    return start, end
+
+
+def main():
+    parser = argparse.ArgumentParser(description='GDB multiplexing proxy for OpenOCD on ESP32')
+    parser.add_argument('ip', nargs='?', help='IP address of the debugger')
+    parser.add_argument('--port', type=int, default=GDB_PORT, help='GDB port of the debugger')
+    parser.add_argument('--listen', type=int, default=GDB_PORT, help='local port of the clients')
+    parser.add_argument('--listen-host', default='127.0.0.1', help='local address of the clients')
+    parser.add_argument('--ro', type=parse_range, action='append', default=[],
+                        help='read-only range start-end to cache, in addition to the flash of the memory map')
+    parser.add_argument('--selftest', action='store_true', help='check the proxy against a stand-in GDB stub')
+    args = parser.parse_args()
+
+    if args.selftest:
+        return asyncio.run(selftest())
+    if not args.ip:
+        parser.error('the IP address of the debugger is needed')
+    try:
+        asyncio.run(serve(args))
+    except OSError as e:
+        print('proxy failed: {}'.format(e), file=sys.stderr)
+        return 1
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+#
+# Lists the TAP IDCODEs of the tcl-lite target scripts, to check the hand maintained table of
+# main/target_detect.c when a target is added. The output isn't used by the build.
+#
+#   gen_target_idcode_table.py [main/openocd/tcl-lite]
+#
+# A target script is listed when it gives its TAP IDCODE, either with `set _CPUTAPID <id>` or with
+# `-expected-id <id>`. The TAP count is only a guess (2 when the script mentions cpu1), the table
+# takes the number of cores of the chip from its datasheet.
+
+import os
+import re
+import sys
+
+ID_PATTERNS = [
+    re.compile(r'^\s*set\s+_CPUTAPID\s+(0x[0-9a-fA-F]+)', re.MULTILINE),
+    re.compile(r'-expected-id\s+(0x[0-9a-fA-F]+)'),
+]
+SECOND_CORE = re.compile(r'cpu1', re.IGNORECASE)
+
+
+def idcode(text):
+    for pattern in ID_PATTERNS:
+        match = pattern.search(text)
+        if match:
+            return int(match.group(1), 16)
+    return None
+
+
+def main():
+    root = sys.argv[1] if len(sys.argv) > 1 else os.path.join('main', 'openocd', 'tcl-lite')
+    target_dir = os.path.join(root, 'target')
+    entries = []
+    for name in sorted(os.listdir(target_dir)):
+        if not name.endswith('.cfg'):
+            continue
+        with open(os.path.join(target_dir, name)) as f:
+            text = f.read()
+        value = idcode(text)
+        if value is None:
+            continue
+        taps = 2 if SECOND_CORE.search(text) else 1
+        entries.append((value, taps, name))
+    for value, taps, name in entries:
+        print('    {{ 0x{:08x}, {}, "{}" }},'.format(value, taps, name))
+
+
+if __name__ == '__main__':
+    main()
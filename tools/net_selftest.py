@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Host side client for the network self-test service of the debugger.
+#
+#   net_selftest.py <ip> sink     - send data to the debugger and report throughput
+#   net_selftest.py <ip> source   - receive data from the debugger and report throughput
+#   net_selftest.py <ip> echo     - measure RTT percentiles with the TCP or UDP echo service
+#   net_selftest.py <ip> rtt      - echo the debugger's probes back, the debugger measures RTT
+#   net_selftest.py <ip> report   - print the results collected by the debugger
+#   net_selftest.py <ip> all      - run all of the above
+#
+# The test ports of the debugger are opened by a POST to /selftest first.
+# Only the python standard library is used.
+
+import argparse
+import json
+import socket
+import sys
+import time
+import urllib.request
+
+SINK_PORT = 5001
+SOURCE_PORT = 5002
+ECHO_PORT = 7
+RTT_PORT = 5003
+RTT_PROBE_SIZE = 32
+CHUNK_SIZE = 16 * 1024
+
+
+def percentile(samples, pct):
+    if not samples:
+        return 0.0
+    return samples[(len(samples) - 1) * pct // 100]
+
+
+def print_throughput(name, nbytes, duration):
+    kbps = nbytes * 8 / duration / 1000 if duration > 0 else 0
+    print('{}: {} bytes in {:.2f} s, {:.0f} kbps'.format(name, nbytes, duration, kbps))
+
+
+def run_sink(args):
+    payload = bytes(i % 256 for i in range(CHUNK_SIZE))
+    with socket.create_connection((args.ip, args.sink_port), timeout=args.timeout) as sock:
+        start = time.monotonic()
+        end = start + args.duration
+        nbytes = 0
+        while time.monotonic() < end:
+            sock.sendall(payload)
+            nbytes += len(payload)
+        sock.shutdown(socket.SHUT_WR)
+        # wait for the debugger to close the connection, so its numbers are final
+        while sock.recv(CHUNK_SIZE):
+            pass
+        print_throughput('sink', nbytes, time.monotonic() - start)
+
+
+def run_source(args):
+    with socket.create_connection((args.ip, args.source_port), timeout=args.timeout) as sock:
+        start = time.monotonic()
+        nbytes = 0
+        while True:
+            data = sock.recv(CHUNK_SIZE)
+            if not data:
+                break
+            nbytes += len(data)
+        print_throughput('source', nbytes, time.monotonic() - start)
+
+
+def recv_exact(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError('connection closed by the debugger')
+        data += chunk
+    return data
+
+
+def run_echo(args):
+    samples = []
+    lost = 0
+    if args.udp:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.connect((args.ip, args.echo_port))
+    else:
+        sock = socket.create_connection((args.ip, args.echo_port))
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.settimeout(args.timeout)
+
+    with sock:
+        for seq in range(args.count):
+            probe = seq.to_bytes(4, 'little') + bytes(args.size - 4)
+            start = time.monotonic()
+            try:
+                sock.send(probe)
+                reply = sock.recv(len(probe)) if args.udp else recv_exact(sock, len(probe))
+            except socket.timeout:
+                lost += 1
+                continue
+            if reply != probe:
+                lost += 1
+                continue
+            samples.append((time.monotonic() - start) * 1e6)
+
+    samples.sort()
+    print('echo ({}): samples {} lost {} min {:.0f} us p50 {:.0f} us p90 {:.0f} us p99 {:.0f} us max {:.0f} us'.format(
+        'udp' if args.udp else 'tcp', len(samples), lost,
+        samples[0] if samples else 0, percentile(samples, 50), percentile(samples, 90),
+        percentile(samples, 99), samples[-1] if samples else 0))
+
+
+def run_rtt(args):
+    with socket.create_connection((args.ip, args.rtt_port), timeout=args.timeout) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        count = 0
+        try:
+            while True:
+                sock.sendall(recv_exact(sock, RTT_PROBE_SIZE))
+                count += 1
+        except ConnectionError:
+            pass
+        print('rtt: echoed {} probes, see the report for the debugger side percentiles'.format(count))
+
+
+def open_ports(args):
+    req = urllib.request.Request('http://{}/selftest'.format(args.ip), data=b'', method='POST')
+    with urllib.request.urlopen(req, timeout=args.timeout) as resp:
+        print(resp.read().decode())
+
+
+def run_report(args):
+    with urllib.request.urlopen('http://{}/selftest'.format(args.ip), timeout=args.timeout) as resp:
+        print(json.dumps(json.loads(resp.read()), indent=2))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Network self-test client for OpenOCD on ESP32')
+    parser.add_argument('ip', help='IP address of the debugger')
+    parser.add_argument('test', choices=['sink', 'source', 'echo', 'rtt', 'report', 'all'])
+    parser.add_argument('--duration', type=float, default=10, help='sink test duration in seconds')
+    parser.add_argument('--count', type=int, default=200, help='number of echo probes')
+    parser.add_argument('--size', type=int, default=32, help='echo probe size in bytes')
+    parser.add_argument('--udp', action='store_true', help='use the UDP echo service')
+    parser.add_argument('--timeout', type=float, default=5, help='socket timeout in seconds')
+    parser.add_argument('--sink-port', type=int, default=SINK_PORT)
+    parser.add_argument('--source-port', type=int, default=SOURCE_PORT)
+    parser.add_argument('--echo-port', type=int, default=ECHO_PORT)
+    parser.add_argument('--rtt-port', type=int, default=RTT_PORT)
+    args = parser.parse_args()
+
+    if args.size < 4:
+        parser.error('--size must be at least 4 bytes')
+
+    tests = {
+        'sink': run_sink,
+        'source': run_source,
+        'echo': run_echo,
+        'rtt': run_rtt,
+        'report': run_report,
+    }
+    try:
+        if args.test != 'report':
+            open_ports(args)
+        if args.test == 'all':
+            for name in ['sink', 'source', 'echo', 'rtt', 'report']:
+                tests[name](args)
+        else:
+            tests[args.test](args)
+    except (OSError, ConnectionError) as e:
+        print('{} test failed: {}'.format(args.test, e), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())